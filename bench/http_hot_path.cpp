@@ -0,0 +1,109 @@
+/* Microbenchmark for the per-request hot path of the embedded HTTP
+ * server: decoding and parsing the tile path, formatting the Date
+ * header and filling out the reply headers. Rendering the tile itself
+ * isn't included, so the real handler is run with an empty map.
+ *
+ * As well as timing each step, this counts the number of calls to
+ * the global operator new made while running it, which should be
+ * zero once the buffers have been warmed up. */
+
+#include "http_server/mapnik_request_handler.hpp"
+#include "http_server/request_handler.hpp"
+#include "http_server/parse_path.hpp"
+#include "http_server/http_date.hpp"
+#include "http_server/reply.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include <mapnik/map.hpp>
+
+namespace {
+
+std::atomic<std::size_t> allocation_count(0);
+
+} // anonymous namespace
+
+void *operator new(std::size_t size) {
+  ++allocation_count;
+  void *ptr = std::malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) { throw std::bad_alloc(); }
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+
+namespace {
+
+namespace hs = http::server3;
+
+template <typename F>
+void run(const char *name, std::size_t iterations, F f) {
+  // warm up, so that any buffers reach their steady-state size.
+  for (std::size_t i = 0; i < 16; ++i) { f(); }
+
+  const std::size_t allocs_before = allocation_count.load();
+  const auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < iterations; ++i) { f(); }
+  const auto end = std::chrono::steady_clock::now();
+  const std::size_t allocs = allocation_count.load() - allocs_before;
+
+  const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+  std::printf("%-16s %10.1f ns/op %10.3f allocs/op\n", name,
+              ns / iterations, double(allocs) / iterations);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  std::size_t iterations = 1000000;
+  if (argc > 1) { iterations = std::strtoul(argv[1], nullptr, 10); }
+
+  const std::string uri = "/14/%38192/5461.pbf";
+  std::string decoded;
+  run("url_decode", iterations, [&]() {
+      hs::request_handler::url_decode(uri.data(), uri.data() + uri.size(), decoded);
+    });
+
+  const std::string path = "/14/8192/5461.pbf";
+  int z = 0, x = 0, y = 0;
+  run("parse_path", iterations, [&]() {
+      hs::parse_path(path, z, x, y);
+    });
+
+  std::size_t total = 0;
+  run("http_date", iterations, [&]() {
+      total += hs::current_http_date()[0];
+    });
+
+  hs::mapnik_server_options options;
+  options.max_age = 60;
+  options.compression_level = -1;
+  options.datasource_pool_size = 0;
+  hs::mapnik_request_handler handler(options, "8080", mapnik::Map());
+
+  // the steps of handling a tile request, other than rendering it, in
+  // the order that the handler does them.
+  hs::reply rep;
+  rep.content.assign(512, 'x');
+  run("tile_request", iterations, [&]() {
+      const char *begin = uri.data();
+      const char *end = begin + uri.size();
+      hs::request_handler::url_decode(begin, end, decoded);
+      hs::parse_path(decoded, z, x, y);
+      handler.fill_tile_reply(rep);
+      handler.recycle(rep);
+    });
+
+  return (total > 0) ? 0 : 1;
+}
@@ -0,0 +1,59 @@
+/* Measures the start-up cost of giving each worker thread its own
+ * mapnik::Map, comparing loading the map from the XML style for each
+ * thread against loading it once and copying it.
+ *
+ * Usage: map_startup <map-file> [num-threads]
+ */
+
+#include "util.hpp"
+#include "config.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <mapnik/map.hpp>
+#include <mapnik/load_map.hpp>
+#include <mapnik/font_engine_freetype.hpp>
+#include <mapnik/datasource_cache.hpp>
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::fprintf(stderr, "Usage: %s <map-file> [num-threads]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const std::string map_file = argv[1];
+  const int num_threads = (argc > 2) ? std::atoi(argv[2]) : 8;
+
+  mapnik::freetype_engine::register_fonts(MAPNIK_DEFAULT_FONT_DIR);
+  mapnik::datasource_cache::instance().register_datasources(MAPNIK_DEFAULT_INPUT_PLUGIN_DIR);
+
+  // the old behaviour: every thread parses the XML itself.
+  {
+    std::vector<mapnik::Map> maps(num_threads);
+    avecado::util::stopwatch timer;
+    for (auto &map : maps) {
+      mapnik::load_map(map, map_file);
+    }
+    std::printf("load per thread:  %10.1f ms total\n", timer.elapsed_ms());
+  }
+
+  // load once, and copy for each thread.
+  {
+    avecado::util::stopwatch timer;
+    mapnik::Map map;
+    mapnik::load_map(map, map_file);
+    const double load_ms = timer.elapsed_ms();
+
+    std::vector<mapnik::Map> maps;
+    maps.reserve(num_threads);
+    for (int i = 0; i < num_threads; ++i) {
+      maps.push_back(map);
+    }
+    std::printf("load once + copy: %10.1f ms total (%.1f ms load)\n",
+                timer.elapsed_ms(), load_ms);
+  }
+
+  return EXIT_SUCCESS;
+}
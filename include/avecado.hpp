@@ -3,10 +3,12 @@
 
 #include "tile.hpp"
 #include "post_processor.hpp"
+#include "util_tile.hpp"
 
 #include <memory>
 #include <boost/optional.hpp>
 #include <mapnik/map.hpp>
+#include <mapnik/request.hpp>
 #include <mapnik/image_scaling.hpp>
 
 namespace avecado {
@@ -78,6 +80,11 @@ namespace avecado {
  *
  * Throws an exception if an unrecoverable error was encountered
  * while building the vector tile.
+ *
+ * Note that the extent and size of the tile are taken from the map's
+ * current extent and size, which means the map has to be changed for
+ * each tile. The overload below, which takes a `mapnik::request`,
+ * should be preferred when the map is to be re-used.
  */
 bool make_vector_tile(tile &tile,
                       unsigned int path_multiplier,
@@ -92,6 +99,31 @@ bool make_vector_tile(tile &tile,
                       double scale_denominator,
                       boost::optional<const post_processor &> post_processor);
 
+/**
+ * make_vector_tile adds geometry from a mapnik query to a vector
+ * tile object, for the extent, size and buffer size given in the
+ * request. The map is only read, and the map's own extent and size
+ * are ignored, so a single map can be used to make many tiles at
+ * once from different threads.
+ *
+ * `avecado::util::request_for_tile` can be used to make a request
+ * for a conventional z/x/y tile.
+ *
+ * The other arguments are as described above.
+ */
+bool make_vector_tile(tile &tile,
+                      unsigned int path_multiplier,
+                      mapnik::Map const& map,
+                      mapnik::request const& request,
+                      double scale_factor,
+                      unsigned int offset_x,
+                      unsigned int offset_y,
+                      unsigned int tolerance,
+                      const std::string &image_format,
+                      mapnik::scaling_method_e scaling_method,
+                      double scale_denominator,
+                      boost::optional<const post_processor &> post_processor);
+
 /* Render a vector tile to a raster image.
  *
  * This function takes a vector tile as data, and renders to the
@@ -126,8 +158,26 @@ bool make_vector_tile(tile &tile,
  *     normally have an effect. (TODO: check this is what's
  *     actually happening.)
  */
+bool render_vector_tile(mapnik::image_rgba8 &image,
+                        tile const &tile,
+                        mapnik::Map const &map,
+                        double scale_factor,
+                        unsigned int buffer_size);
+
+/**
+ * As above, but for rendering the tile (z, x, y) from the data of
+ * one of its ancestors (i.e: overzoomed). Rather than handing all of
+ * the ancestor's features to the renderer, the data is first cut
+ * down to the features touching the tile and its buffer.
+ *
+ * The cuts are kept in the cache, so rendering many tiles from the
+ * same ancestor only decodes and cuts the whole ancestor once. Note
+ * that the tile is made shareable, if it wasn't already.
+ */
 bool render_vector_tile(mapnik::image_rgba8 &image,
                         tile &tile,
+                        unsigned int z, unsigned int x, unsigned int y,
+                        util::cut_cache &cache,
                         mapnik::Map const &map,
                         double scale_factor,
                         unsigned int buffer_size);
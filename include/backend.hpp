@@ -5,7 +5,7 @@
 #include <mapnik/feature.hpp>
 #include <mapnik/value_types.hpp>
 #include <mapnik/vertex.hpp>
-#include <mapnik/map.hpp>
+#include <mapnik/request.hpp>
 
 // vector tile
 #include "vector_tile_backend_pbf.hpp"
@@ -21,7 +21,7 @@ class backend {
 public:
   backend(vector_tile::Tile & tile,
           unsigned path_multiplier,
-          mapnik::Map const& map,
+          mapnik::request const& request,
           boost::optional<const post_processor &> pp);
 
   void start_tile_layer(std::string const& name);
@@ -56,7 +56,7 @@ public:
 
 private:
   mapnik::vector_tile_impl::backend_pbf m_pbf;
-  mapnik::Map const& m_map;
+  mapnik::request const& m_request;
   unsigned int m_tolerance;
   boost::optional<const post_processor &> m_post_processor;
   std::string m_current_layer_name;
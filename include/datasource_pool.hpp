@@ -0,0 +1,129 @@
+#ifndef AVECADO_DATASOURCE_POOL_HPP
+#define AVECADO_DATASOURCE_POOL_HPP
+
+#include <mapnik/map.hpp>
+#include <mapnik/datasource.hpp>
+#include <mapnik/params.hpp>
+
+#include <boost/noncopyable.hpp>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace avecado {
+
+/**
+ * Counters describing how a pool, or a set of pools, has been
+ * used. These can be used to tell whether the pool size is too
+ * small, in which case a lot of time will be spent waiting.
+ */
+struct datasource_pool_stats {
+  datasource_pool_stats();
+
+  // number of times a datasource was borrowed from the pool.
+  std::size_t borrows;
+
+  // number of borrows which had to wait for another thread to
+  // hand a datasource back.
+  std::size_t waits;
+
+  // total time spent waiting, in milliseconds.
+  double wait_ms;
+
+  // number of datasource instances which have been created.
+  std::size_t instances;
+
+  datasource_pool_stats &operator+=(const datasource_pool_stats &);
+};
+
+/**
+ * A pool of datasource instances, all created from the same
+ * parameters, which are lent out one query at a time.
+ *
+ * Instances are created on demand, up to a maximum size, after
+ * which borrowers wait for another instance to be handed back.
+ * This means the number of instances, and so the number of
+ * database connections, is bounded by the size of the pool
+ * rather than the number of threads using it.
+ */
+class datasource_pool
+  : public std::enable_shared_from_this<datasource_pool>,
+    private boost::noncopyable {
+public:
+  // an instance borrowed from the pool, which is handed back when
+  // the last copy of the lease goes away.
+  typedef std::shared_ptr<mapnik::datasource> lease;
+
+  // create a pool with an initial instance, e.g: the one which was
+  // loaded along with the map, which is used as the template for
+  // creating more instances.
+  datasource_pool(mapnik::datasource_ptr initial, std::size_t max_size);
+
+  // borrow an instance from the pool, waiting for one to become
+  // available if the pool is already at its maximum size.
+  lease borrow();
+
+  // the initial instance, which can be used for metadata such as
+  // the envelope and descriptor, which doesn't need exclusive use.
+  const mapnik::datasource &primary() const { return *m_primary; }
+
+  datasource_pool_stats stats() const;
+
+private:
+  void hand_back(mapnik::datasource_ptr ds);
+
+  const mapnik::datasource_ptr m_primary;
+  const mapnik::parameters m_params;
+  const std::size_t m_max_size;
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_available;
+  std::vector<mapnik::datasource_ptr> m_free;
+  std::size_t m_size;
+  datasource_pool_stats m_stats;
+};
+
+/**
+ * A datasource which forwards each query to an instance borrowed
+ * from a pool. The instance is held until the featureset returned
+ * from the query is destroyed.
+ */
+class pooled_datasource : public mapnik::datasource {
+public:
+  explicit pooled_datasource(std::shared_ptr<datasource_pool> pool);
+  virtual ~pooled_datasource();
+
+  virtual datasource_t type() const;
+  virtual mapnik::processor_context_ptr get_context(mapnik::feature_style_context_map &) const;
+  virtual mapnik::featureset_ptr features_with_context(mapnik::query const &q, mapnik::processor_context_ptr ctx) const;
+  virtual mapnik::featureset_ptr features(mapnik::query const &q) const;
+  virtual mapnik::featureset_ptr features_at_point(mapnik::coord2d const &pt, double tol = 0) const;
+  virtual mapnik::box2d<double> envelope() const;
+  virtual boost::optional<geometry_t> get_geometry_type() const;
+  virtual mapnik::layer_descriptor get_descriptor() const;
+
+  const datasource_pool &pool() const { return *m_pool; }
+
+private:
+  std::shared_ptr<datasource_pool> m_pool;
+};
+
+/**
+ * Replaces the datasource of each layer in the map with a pooled
+ * datasource of at most `max_size` instances. Copies of the map
+ * share the pools, so that all threads using a copy of the map
+ * borrow from the same set of datasources.
+ */
+void pool_datasources(mapnik::Map &map, std::size_t max_size);
+
+/**
+ * Returns the sum of the statistics from all the pooled datasources
+ * in the map.
+ */
+datasource_pool_stats pooled_datasource_stats(const mapnik::Map &map);
+
+} // namespace avecado
+
+#endif // AVECADO_DATASOURCE_POOL_HPP
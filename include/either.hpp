@@ -15,7 +15,9 @@ namespace avecado {
 template <typename L, typename R>
 struct either {
    inline either(const either<L, R> &other) : m_impl(other.m_impl) {}
-   inline either(either<L, R> &&other) : m_impl(std::move(other.m_impl)) {}
+   // note: noexcept, so that containers move rather than copy when
+   // they grow, as either side may be move-only.
+   inline either(either<L, R> &&other) noexcept : m_impl(std::move(other.m_impl)) {}
    inline explicit either(const L &left) : m_impl(left) {}
    inline explicit either(L &&left) : m_impl(std::move(left)) {}
    inline explicit either(const R &right) : m_impl(right) {}
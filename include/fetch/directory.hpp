@@ -0,0 +1,61 @@
+#ifndef FETCHER_DIRECTORY_HPP
+#define FETCHER_DIRECTORY_HPP
+
+#include "fetcher.hpp"
+#include "fetch/url_template.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace vector_tile { struct Tile; }
+
+namespace avecado { namespace fetch {
+
+/* Fetcher which reads tiles straight from files on the local disk,
+ * e.g: a directory of tiles written by the exporter.
+ *
+ * Tiles are read and decoded on the calling thread, before fetch()
+ * returns, so there is no hand-off to another thread and the cost of
+ * a fetch is just the cost of reading the file.
+ *
+ * Tiles put into the directory are encoded and written out by a
+ * background thread, started on first use, so that put() doesn't
+ * wait for the disk. Each file is written under a temporary name and
+ * renamed into place, so readers never see part of a tile.
+ */
+struct directory : public fetcher, public tile_store {
+  // the pattern is a path, or a file: URL, with the same variables as
+  // the HTTP fetcher's URL patterns, e.g: "/srv/tiles/{z}/{x}/{y}.pbf".
+  // %-escapes in a file: URL are decoded, and it throws if the URL is
+  // for a file on another host.
+  explicit directory(const std::string &pattern);
+  // waits for any tiles which have been put to be written.
+  virtual ~directory();
+
+  void fetch(const request &, fetch_callback);
+  void put(tile &);
+
+private:
+  struct pending_write {
+    unsigned int z, x, y;
+    std::shared_ptr<const vector_tile::Tile> data;
+  };
+
+  void writer_func();
+
+  url_template m_pattern;
+
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  std::deque<pending_write> m_writes;
+  bool m_shutdown;
+  std::thread m_writer;
+};
+
+} } // namespace avecado::fetch
+
+#endif /* FETCHER_DIRECTORY_HPP */
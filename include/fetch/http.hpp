@@ -2,12 +2,73 @@
 #define FETCHER_HTTP_HPP
 
 #include "fetcher.hpp"
+#include "fetch/memory_cache.hpp"
 
+#include <cstddef>
 #include <memory>
 #include <string>
+#include <vector>
+
+#include <boost/optional.hpp>
 
 namespace avecado { namespace fetch {
 
+/* Options controlling how the HTTP fetcher talks to the upstream
+ * hosts. The defaults are set by the constructor.
+ */
+struct http_options {
+  http_options();
+
+  // maximum time, in milliseconds, to wait for a connection to be
+  // made, and for the whole transfer to finish. zero means no limit.
+  long connect_timeout_ms, timeout_ms;
+
+  // number of times to retry a request after a connection failure,
+  // timeout or server error. each retry goes to the next host in
+  // turn, after a randomised, exponentially increasing delay of up
+  // to retry_base_delay_ms * 2^n, capped at retry_max_delay_ms.
+  unsigned int max_retries;
+  long retry_base_delay_ms, retry_max_delay_ms;
+
+  // if set, hedge requests which have taken longer than this
+  // percentile (0 to 1) of recent request latencies, by sending a
+  // duplicate request to another host and using whichever answers
+  // first. hedging never starts sooner than hedge_min_delay_ms.
+  boost::optional<double> hedge_percentile;
+  long hedge_min_delay_ms;
+
+  // maximum number of idle handles, and the connections they keep
+  // alive, to hold on to for re-use.
+  std::size_t handle_pool_size;
+
+  // maximum number of connections to open to any one host, and in
+  // total. zero means no limit. requests beyond these limits wait
+  // for a connection to become free.
+  long max_host_connections, max_total_connections;
+
+  // if true, negotiate HTTP/2 with upstreams which support it (over
+  // TLS) and multiplex many requests over each connection.
+  bool multiplex;
+
+  // how long, in seconds, to remember that the origin doesn't have a
+  // tile, answering requests for it locally in the mean time. zero
+  // turns this off.
+  long not_found_ttl_seconds;
+
+  // how long, in seconds, after a cached tile has expired that it can
+  // still be served. within stale_while_revalidate_seconds, it's
+  // answered straight away and refreshed in the background. within
+  // stale_if_error_seconds, it's served if the origin can't be
+  // reached or answers with a server error. zero turns these off.
+  long stale_while_revalidate_seconds, stale_if_error_seconds;
+
+  // number of threads decoding tiles once they've been received, so
+  // that decoding doesn't hold up other transfers. callbacks for
+  // fetched tiles are called from these threads. zero decodes on the
+  // fetcher's own thread.
+  unsigned int decode_threads;
+};
+
 /* Fetcher which fetches tiles from URLs.
  */
 struct http : public fetcher {
@@ -15,20 +76,48 @@ struct http : public fetcher {
   http(const std::string &base_url, const std::string &ext);
   // patterns of a more general form
   explicit http(std::vector<std::string> &&patterns);
+  http(std::vector<std::string> &&patterns, const http_options &options);
 
   virtual ~http();
 
-  std::future<fetch_response> operator()(const request &);
+  // the callback is called from one of the fetcher's own threads,
+  // except for errors and cache hits, which are answered straight
+  // away.
+  void fetch(const request &, fetch_callback);
+
+  // the whole batch is handed to the fetcher's thread at once.
+  void fetch_many(const std::vector<request> &, fetch_many_callback);
 
   // enable local caching of tiles. this is disabled by default
   // and this method will throw an exception if caching has not
   // been built into avecado.
-  void enable_cache(const std::string &cache_location);
+  //
+  // if max_bytes is non-zero, the least recently used tiles are
+  // evicted to keep the total size of the cached tiles under it.
+  void enable_cache(const std::string &cache_location, std::size_t max_bytes = 0);
 
   // disable local caching - all requests will go to the origin
   // server.
   void disable_cache();
 
+  // enable an in-memory cache of decoded tiles in front of the local
+  // cache and the origin, using at most approximately max_bytes. the
+  // tiles are shared between responses, and only copied if they're
+  // modified. tiles are only kept until they expire, so this has no
+  // effect for origins which don't send expiry headers.
+  void enable_memory_cache(std::size_t max_bytes);
+
+  // disable the in-memory cache, freeing the tiles in it.
+  void disable_memory_cache();
+
+  // statistics for the in-memory cache, all zero if it's disabled.
+  memory_cache_stats get_memory_cache_stats() const;
+
+  // number of stale tiles which have finished being refreshed in the
+  // background, successfully or not. the cache has been updated by
+  // the time a refresh is counted.
+  std::size_t background_refreshes() const;
+
 private:
   struct impl;
   std::unique_ptr<impl> m_impl;
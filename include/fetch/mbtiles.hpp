@@ -0,0 +1,34 @@
+#ifndef FETCHER_MBTILES_HPP
+#define FETCHER_MBTILES_HPP
+
+#include "fetcher.hpp"
+
+#include <memory>
+#include <string>
+
+namespace avecado { namespace fetch {
+
+/* Fetcher which reads tiles from an MBTiles file, i.e: an SQLite
+ * database with a "tiles" table in the TMS scheme.
+ *
+ * As with the directory fetcher, tiles are read and decoded on the
+ * calling thread. Each thread fetching at the same time gets its own
+ * read-only connection to the file, so fetches don't wait on each
+ * other.
+ */
+struct mbtiles : public fetcher {
+  // opens the file at the path, or mbtiles: URL, throwing if it can't
+  // be opened or if avecado was built without SQLite3 support.
+  explicit mbtiles(const std::string &path);
+  virtual ~mbtiles();
+
+  void fetch(const request &, fetch_callback);
+
+private:
+  struct impl;
+  std::unique_ptr<impl> m_impl;
+};
+
+} } // namespace avecado::fetch
+
+#endif /* FETCHER_MBTILES_HPP */
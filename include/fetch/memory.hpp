@@ -0,0 +1,32 @@
+#ifndef FETCHER_MEMORY_HPP
+#define FETCHER_MEMORY_HPP
+
+#include "fetcher.hpp"
+#include "fetch/memory_cache.hpp"
+
+namespace avecado { namespace fetch {
+
+/* Fetcher which answers from an in-memory LRU cache of decoded tiles.
+ *
+ * It only has the tiles which have been put into it, so it's mostly
+ * useful as the top tier of a tiered fetcher, which fills it in with
+ * the tiles fetched from the tiers below. Tiles are kept for at most
+ * ttl_seconds, as the fetchers below don't say when tiles expire.
+ */
+struct memory : public fetcher, public tile_store {
+  memory(std::size_t max_bytes, long ttl_seconds);
+  virtual ~memory();
+
+  void fetch(const request &, fetch_callback);
+  void put(tile &);
+
+  memory_cache_stats stats() const;
+
+private:
+  memory_cache m_cache;
+  const long m_ttl_seconds;
+};
+
+} } // namespace avecado::fetch
+
+#endif /* FETCHER_MEMORY_HPP */
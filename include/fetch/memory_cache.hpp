@@ -0,0 +1,85 @@
+#ifndef FETCHER_MEMORY_CACHE_HPP
+#define FETCHER_MEMORY_CACHE_HPP
+
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+
+#include <ctime>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace vector_tile { struct Tile; }
+
+namespace avecado { namespace fetch {
+
+/* Counters describing how well the memory cache is working.
+ */
+struct memory_cache_stats {
+  memory_cache_stats();
+
+  // number of lookups which found a current entry.
+  std::size_t hits;
+
+  // number of lookups which found nothing, or an expired entry.
+  std::size_t misses;
+
+  // number of entries removed to keep within the byte budget.
+  std::size_t evictions;
+
+  // current number of entries and their approximate size.
+  std::size_t entries, bytes;
+};
+
+/* Thread-safe, in-memory LRU cache of decoded tiles, keyed by URL.
+ *
+ * The tiles are immutable and shared, so a hit costs neither I/O
+ * nor decoding. Each entry is kept until it expires, or until it's
+ * the least recently used entry when the cache needs room to stay
+ * under its byte budget.
+ */
+class memory_cache : private boost::noncopyable {
+public:
+  typedef std::shared_ptr<const vector_tile::Tile> tile_data;
+
+  explicit memory_cache(std::size_t max_bytes);
+  ~memory_cache();
+
+  // returns the tile data for the key, or nullptr if it isn't in the
+  // cache or has expired.
+  tile_data get(const std::string &key);
+
+  // adds or replaces the entry for the key. entries which don't have
+  // an expiry time, or have already expired, aren't cached as they
+  // would never be used.
+  void put(const std::string &key, tile_data data, boost::optional<std::time_t> expires);
+
+  memory_cache_stats stats() const;
+
+private:
+  struct entry {
+    std::string key;
+    tile_data data;
+    std::time_t expires;
+    std::size_t bytes;
+  };
+
+  typedef std::list<entry> lru_list;
+
+  void erase(lru_list::iterator itr);
+
+  const std::size_t m_max_bytes;
+
+  mutable std::mutex m_mutex;
+  // most recently used at the front.
+  lru_list m_lru;
+  std::unordered_map<std::string, lru_list::iterator> m_index;
+  memory_cache_stats m_stats;
+};
+
+} } // namespace avecado::fetch
+
+#endif /* FETCHER_MEMORY_CACHE_HPP */
@@ -2,25 +2,86 @@
 #define FETCHER_OVERZOOM_HPP
 
 #include "fetcher.hpp"
+#include "fetch/memory_cache.hpp"
 
+#include <atomic>
+#include <ctime>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 namespace avecado { namespace fetch {
 
 /* Fetcher which supports 'overzoom', that is using tiles from
  * a lower zoom level when tiles at the desired zoom level are
  * missing.
+ *
+ * Many tiles share the same parent, so recently used parent tiles
+ * are kept decoded in memory, up to parent_cache_bytes, and
+ * concurrent requests for the same parent share one fetch.
  */
 struct overzoom : public fetcher {
-  overzoom(std::unique_ptr<fetcher> &&source, int max_zoom, boost::optional<int> mask_zoom);
+  // when to fetch the tile at the mask zoom at the same time as the
+  // tile itself, rather than waiting to find out that the tile is
+  // missing. "hinted" speculates only where a tile under the same
+  // mask zoom tile was recently found to be missing, as missing tiles
+  // tend to be clustered in sparse areas.
+  enum class mask_speculation { never, hinted, always };
+
+  overzoom(std::unique_ptr<fetcher> &&source, int max_zoom, boost::optional<int> mask_zoom,
+           std::size_t parent_cache_bytes = 32 * 1024 * 1024);
   virtual ~overzoom();
 
-  std::future<fetch_response> operator()(const request &);
+  void fetch(const request &, fetch_callback);
+
+  // requests which come to the same tile, once zoomed out to the max
+  // zoom, are fetched once and share the tile. the remaining tiles are
+  // fetched from the source as one batch, and the mask zoom tiles for
+  // any which are missing as another.
+  void fetch_many(const std::vector<request> &, fetch_many_callback);
+
+  // statistics for the cache of parent tiles.
+  memory_cache_stats parent_cache_stats() const;
+
+  // the default is never.
+  void set_mask_speculation(mask_speculation);
 
 private:
+  // fetch a parent tile, from the cache if possible, or by sharing a
+  // fetch of the same tile already in progress.
+  void fetch_parent(const request &, fetch_callback);
+  void parent_fetched(const request &, const std::string &key, fetch_callback, fetch_response &&);
+
+  // the stages of a fetch_many.
+  struct batch;
+  void batch_fetched(std::shared_ptr<batch>, const std::vector<std::size_t> &which, std::vector<fetch_response> &&);
+  void batch_masks_fetched(std::shared_ptr<batch>, const std::vector<std::size_t> &which, std::vector<fetch_response> &&);
+  void batch_finished(std::shared_ptr<batch>);
+
+  // fall back to the mask zoom if the tile was missing.
+  void masked(const request &, fetch_callback, fetch_response &&);
+
+  // the mask zoom tile, if the request is for a tile which could be
+  // masked.
+  boost::optional<request> mask_for(const request &) const;
+  bool should_speculate(const request &mask);
+  void note_response(const request &mask, const fetch_response &);
+
   std::unique_ptr<fetcher> m_source;
   int m_max_zoom;
   boost::optional<int> m_mask_zoom;
+
+  std::unique_ptr<memory_cache> m_parents;
+  std::atomic<mask_speculation> m_speculation;
+
+  // callbacks waiting on parent fetches already in progress, and the
+  // mask zoom tiles with recently missing tiles under them, with the
+  // time when that stops being a useful hint.
+  std::mutex m_mutex;
+  std::map<std::string, std::vector<fetch_callback> > m_in_flight;
+  std::map<std::string, std::time_t> m_missing;
 };
 
 } } // namespace avecado::fetch
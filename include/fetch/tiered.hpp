@@ -0,0 +1,47 @@
+#ifndef FETCHER_TIERED_HPP
+#define FETCHER_TIERED_HPP
+
+#include "fetcher.hpp"
+
+#include <memory>
+#include <vector>
+
+namespace avecado { namespace fetch {
+
+/* Fetcher which tries each of a list of fetchers in turn, e.g: an
+ * in-memory cache, then a local directory, then a remote server.
+ *
+ * A tier is skipped if it doesn't have the tile, or fails to fetch
+ * it, and the response from the last tier is always passed on. When
+ * a tile is found, it is written back to the tiers above it which
+ * can store tiles, so that the next fetch of it stops higher up.
+ */
+struct tiered : public fetcher {
+  // the tiers, fastest first.
+  explicit tiered(std::vector<std::unique_ptr<fetcher> > &&tiers);
+  virtual ~tiered();
+
+  void fetch(const request &, fetch_callback);
+
+  // each tier is asked for the whole batch of tiles that the tiers
+  // above it didn't have.
+  void fetch_many(const std::vector<request> &, fetch_many_callback);
+
+private:
+  struct batch;
+
+  void fetch_from(std::size_t tier, const request &, fetch_callback);
+  void fetched(std::size_t tier, const request &, fetch_callback &, fetch_response &&);
+  void fetch_many_from(std::size_t tier, std::shared_ptr<batch>, std::vector<std::size_t> &&which);
+  void fetched_many(std::size_t tier, std::shared_ptr<batch>, const std::vector<std::size_t> &which, std::vector<fetch_response> &&);
+  void write_back(std::size_t tier, tile &);
+
+  std::vector<std::unique_ptr<fetcher> > m_tiers;
+  // the tile store interface for each tier, or nullptr if it can't
+  // store tiles.
+  std::vector<tile_store *> m_stores;
+};
+
+} } // namespace avecado::fetch
+
+#endif /* FETCHER_TIERED_HPP */
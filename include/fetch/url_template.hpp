@@ -0,0 +1,63 @@
+#ifndef FETCHER_URL_TEMPLATE_HPP
+#define FETCHER_URL_TEMPLATE_HPP
+
+#include <string>
+#include <vector>
+
+namespace avecado { namespace fetch {
+
+/* A tile URL pattern, parsed once into literal and variable segments
+ * so that building the URL for a tile is just concatenation.
+ *
+ * The variables recognised are:
+ *
+ *   {z}, {x}, {y}    the tile coordinates.
+ *   {-y}             the y coordinate flipped for TMS, i.e: counting
+ *                    from the south rather than the north. a y which
+ *                    is outside the zoom level is left as it is.
+ *   {s}              a subdomain, chosen from "a", "b" and "c" by
+ *                    the tile coordinates, so that each tile always
+ *                    uses the same one.
+ *   {q}, {quadkey}   the Bing-style quadkey of the tile.
+ *
+ * Anything else in braces is left in the URL as-is.
+ */
+class url_template {
+public:
+  explicit url_template(const std::string &pattern);
+
+  // replace the contents of `out` with the URL for the tile. the
+  // string's capacity is re-used, so passing the same string each
+  // time avoids allocation.
+  void build(unsigned int z, unsigned int x, unsigned int y, std::string &out) const;
+
+  // convenience version returning a new string.
+  std::string operator()(unsigned int z, unsigned int x, unsigned int y) const;
+
+  const std::string &pattern() const { return m_pattern; }
+
+  // true if the pattern has any variables in it. without them, every
+  // tile has the same URL.
+  bool has_variables() const;
+
+private:
+  enum segment_type {
+    literal, var_z, var_x, var_y, var_flipped_y, var_subdomain, var_quadkey
+  };
+
+  struct segment {
+    segment_type type;
+    // offset and length of the literal text in the pattern.
+    std::size_t offset, length;
+  };
+
+  std::string m_pattern;
+  std::vector<segment> m_segments;
+  // length of the literal parts, plus a guess at the variables, to
+  // reserve space for the whole URL up-front.
+  std::size_t m_length_hint;
+};
+
+} } // namespace avecado::fetch
+
+#endif /* FETCHER_URL_TEMPLATE_HPP */
@@ -7,6 +7,8 @@
 #include <stdexcept>
 #include <memory>
 #include <future>
+#include <functional>
+#include <vector>
 #include <boost/optional.hpp>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 
@@ -44,6 +46,16 @@ struct fetch_result {
 
 typedef either<std::unique_ptr<tile>, fetch_result> fetch_response;
 
+/* Called with the response to a fetch, exactly once, when it becomes
+ * available.
+ */
+typedef std::function<void (fetch_response &&)> fetch_callback;
+
+/* Called with the responses to a batch of fetches, in the same order
+ * as the requests, once they are all available.
+ */
+typedef std::function<void (std::vector<fetch_response> &&)> fetch_many_callback;
+
 /* Request objects collect together the parameters needed
  * to specify a tile request, such as its (z, x, y)
  * location.
@@ -79,7 +91,48 @@ struct fetcher {
 
    // fetches a tile from the source, returning either a
    // tile which contains the (z, x, y) tile or an error.
-  virtual std::future<fetch_response> operator()(const request &) = 0;
+   //
+   // this is a wrapper around fetch(), for callers which want to
+   // wait for the response.
+  std::future<fetch_response> operator()(const request &);
+
+  // fetches a tile from the source, calling the callback with either
+  // a tile which contains the (z, x, y) tile or an error.
+  //
+  // the callback may be called from any thread, including from this
+  // one before fetch() returns. it may be called from a thread which
+  // is handling other fetches, so it shouldn't block or throw, but it
+  // can start other fetches.
+  virtual void fetch(const request &, fetch_callback) = 0;
+
+  // fetches a batch of tiles, e.g: all the tiles for a metatile or a
+  // pyramid, waiting for all of the responses.
+  std::future<std::vector<fetch_response> > operator()(const std::vector<request> &);
+
+  // fetches a batch of tiles, calling the callback once with all of
+  // the responses. the same rules apply as for the callback to fetch().
+  //
+  // the default just calls fetch() for each request, but fetchers
+  // can do better by handling the batch all at once.
+  virtual void fetch_many(const std::vector<request> &, fetch_many_callback);
+
+protected:
+  // make a callback for each of n fetches, which collect the
+  // responses together and call the batch callback with them when
+  // the last one has been called.
+  static std::vector<fetch_callback> gather(std::size_t n, fetch_many_callback);
+};
+
+/* Interface for fetchers which can also keep tiles, so that tiles
+ * found further down a tiered fetcher can be written back to them.
+ */
+struct tile_store {
+  virtual ~tile_store();
+
+  // keep the tile, so that it can be fetched later. this is called
+  // from whichever thread the tile was fetched on, so it shouldn't
+  // block. the tile's data may be shared, but not modified.
+  virtual void put(tile &) = 0;
 };
 
 } // namespace avecado
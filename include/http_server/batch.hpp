@@ -0,0 +1,53 @@
+#ifndef HTTP_SERVER3_BATCH_HPP
+#define HTTP_SERVER3_BATCH_HPP
+
+#include <string>
+#include <vector>
+
+namespace http {
+namespace server3 {
+
+struct reply;
+struct request;
+
+/// maximum number of tiles which may be requested in a single batch.
+/// larger batches are rejected as a bad request, as they would tie
+/// up the whole worker pool for a single client.
+const std::size_t max_batch_size = 256;
+
+/// boundary string used to separate the parts of a batch response.
+extern const char batch_boundary[];
+
+/// Returns true if the request is for the batch endpoint, i.e: the
+/// path part of the URI is "/batch".
+bool is_batch_request(const request &req);
+
+/// Parses a batch request URI of the form
+///
+///   /batch?tiles=z/x/y,z/x0-x1/y0-y1,...
+///
+/// where each item is either a single tile or an inclusive range of
+/// x & y coordinates at a single zoom level. The tiles are expanded
+/// into individual tile paths of the form "/z/x/y.pbf", suitable for
+/// passing to a `request_handler`. Returns false if the URI was not
+/// well-formed, or would expand to more than `max_batch_size` tiles.
+bool parse_batch(const std::string &uri, std::vector<std::string> &paths);
+
+/// Fills out the reply with the headers which start a streamed batch
+/// response. The content is left empty, as the parts are written
+/// separately as each one becomes available.
+void batch_reply_header(reply &rep);
+
+/// Serialises a reply for a single tile of a batch as a part of the
+/// multipart response, appending it to `out`. The path of the tile
+/// is given in the Content-Location header, and the status of the
+/// reply in the X-Tile-Status header.
+void append_batch_part(const std::string &path, const reply &rep, std::string &out);
+
+/// Appends the closing boundary of a batch response to `out`.
+void append_batch_end(std::string &out);
+
+} // namespace server3
+} // namespace http
+
+#endif // HTTP_SERVER3_BATCH_HPP
@@ -16,6 +16,8 @@
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <deque>
+#include <string>
 #include "http_server/reply.hpp"
 #include "http_server/request.hpp"
 #include "http_server/request_handler.hpp"
@@ -48,6 +50,24 @@ private:
   /// Handle completion of a write operation.
   void handle_write(const boost::system::error_code& e);
 
+  /// Start streaming a batch of tiles back to the client, or reply
+  /// with an error if the batch request was malformed.
+  void start_batch();
+
+  /// Produce a single tile of a batch. This runs on whichever thread
+  /// of the pool picks it up, using that thread's request handler.
+  void handle_batch_item(const std::string& path);
+
+  /// Queue a serialised chunk of the batch response to be written.
+  void queue_batch_write(const boost::shared_ptr<std::string>& chunk,
+      bool is_item);
+
+  /// Handle completion of writing a chunk of the batch response.
+  void handle_batch_write(const boost::system::error_code& e);
+
+  /// The io_service, used to distribute batch items over the pool.
+  boost::asio::io_service& io_service_;
+
   /// Strand to ensure the connection's handlers are not called concurrently.
   boost::asio::io_service::strand strand_;
 
@@ -68,6 +88,16 @@ private:
 
   /// The reply to be sent back to the client.
   reply reply_;
+
+  /// Serialised chunks of a batch response waiting to be written. The
+  /// chunk at the front is the one currently being written, if any.
+  std::deque<boost::shared_ptr<std::string> > batch_writes_;
+
+  /// Number of tiles in the batch which have not yet been queued.
+  std::size_t batch_remaining_;
+
+  /// Whether a batch write has failed, e.g: the client hung up.
+  bool batch_failed_;
 };
 
 typedef boost::shared_ptr<connection> connection_ptr;
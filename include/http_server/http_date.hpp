@@ -0,0 +1,27 @@
+#ifndef HTTP_SERVER3_HTTP_DATE_HPP
+#define HTTP_SERVER3_HTTP_DATE_HPP
+
+#include <ctime>
+#include <cstddef>
+
+namespace http {
+namespace server3 {
+
+/// Length of an RFC 1123 date, e.g: "Sun, 06 Nov 1994 08:49:37 GMT".
+const std::size_t http_date_length = 29;
+
+/// Formats the time as an RFC 1123 date into `buf`, which must have
+/// space for at least `http_date_length + 1` characters. Unlike
+/// `strftime`, this doesn't depend on the current locale.
+void format_http_date(std::time_t t, char *buf);
+
+/// Returns the current time formatted as an RFC 1123 date, suitable
+/// for use in the Date header. The date is only formatted once per
+/// second, and shared between all the threads. The returned string
+/// is valid until the next call on the same thread.
+const char *current_http_date();
+
+} // namespace server3
+} // namespace http
+
+#endif // HTTP_SERVER3_HTTP_DATE_HPP
@@ -4,15 +4,20 @@
 #include <boost/thread/tss.hpp>
 #include "http_server/mapnik_server_options.hpp"
 #include "http_server/mapnik_request_handler.hpp"
+#include "datasource_pool.hpp"
 
 namespace http {
 namespace server3 {
 
 /* Creating vector tiles requires access to a mapnik::Map
- * object, which itself contains many resources. Rather than
- * attempt to share resources between threads, this factor
- * creates a `mapnik_request_handler` for each thread, giving
- * each thread its own independent resources.
+ * object, which itself contains many resources. The map is
+ * loaded once, when the factory is constructed, and this
+ * factory creates a `mapnik_request_handler` for each thread
+ * with its own copy of the map. Copying the map is much
+ * quicker than parsing the XML again for each thread, and the
+ * copies share the map's pooled datasources. if a pool size is
+ * given in the options, then the number of connections doesn't
+ * depend on the number of threads.
  */
 struct mapnik_handler_factory : public handler_factory {
   explicit mapnik_handler_factory(const mapnik_server_options &options);
@@ -20,8 +25,15 @@ struct mapnik_handler_factory : public handler_factory {
 
   virtual void thread_setup(boost::thread_specific_ptr<request_handler> &tss, const std::string &port);
 
+  /// usage statistics for the pooled datasources, if any.
+  avecado::datasource_pool_stats pool_stats() const;
+
 private:
   mapnik_server_options options_;
+
+  /// map loaded from the style file, which is copied for each
+  /// thread.
+  mapnik::Map map_;
 };
 
 } } // namespace http::server3
@@ -30,16 +30,23 @@ class mapnik_request_handler
   : public request_handler
 {
 public:
-  /// Construct with a directory containing files to be served.
-  mapnik_request_handler(const mapnik_server_options &options, std::string port);
+  /// Construct with a copy of an already-loaded map, which will be
+  /// used to make tiles on this thread.
+  mapnik_request_handler(const mapnik_server_options &options, std::string port,
+                         const mapnik::Map &map);
 
   /// Handle a request and produce a reply.
   void handle_request(const request& req, reply& rep);
 
+  /// Fill out the status and headers of the reply to a tile request,
+  /// once its content has been set. This is done for every tile, so
+  /// is public to allow it to be benchmarked without a map.
+  void fill_tile_reply(reply &rep);
+
 private:
-  /// pointer to thread-local copy of the mapnik Map object used to
-  /// do the rendering.
-  mapnik::Map map_;
+  /// thread-local copy of the mapnik Map object used to do the
+  /// rendering. this isn't modified when making tiles.
+  const mapnik::Map map_;
 
   /// options, mostly passed to mapnik for making the vector tile
   mapnik_server_options options_;
@@ -51,6 +58,10 @@ private:
   /// max-age header directive to use. pre-rendered to a string.
   std::string max_age_value_;
 
+  /// buffer for the decoded request path, kept between requests so
+  /// that its storage can be re-used.
+  std::string request_path_;
+
   /// Implementation detail of handling a request and producing a reply.
   void handle_request_impl(const request& req, reply& rep);
 
@@ -26,6 +26,10 @@ struct mapnik_server_options {
   std::shared_ptr<http::server3::access_logger> logger;
   unsigned int max_age;
   int compression_level;
+  // maximum number of instances of each layer's datasource shared
+  // between the threads. zero means no limit, so that there is at
+  // most one instance for each thread, made when it's first needed.
+  std::size_t datasource_pool_size;
 };
 
 } } // namespace http::server3
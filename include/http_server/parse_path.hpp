@@ -6,6 +6,10 @@
 namespace http {
 namespace server3 {
 
+/// Parses a path of the form "/$z/$x/$y.pbf" in place, without making
+/// any copies. Returns false if the path isn't of that form.
+bool parse_path(const char *begin, const char *end, int &z, int &x, int &y);
+
 bool parse_path(const std::string &path, int &z, int &x, int &y);
 
 } // namespace server3
@@ -12,9 +12,11 @@
 #define HTTP_SERVER3_REQUEST_HANDLER_HPP
 
 #include <string>
+#include <vector>
 #include <boost/noncopyable.hpp>
 #include <boost/optional.hpp>
 #include <boost/thread/tss.hpp>
+#include "http_server/header.hpp"
 
 namespace http {
 namespace server3 {
@@ -35,6 +37,26 @@ struct request_handler : private boost::noncopyable {
   /// Perform URL-decoding on a string. Returns false if the encoding was
   /// invalid.
   static bool url_decode(const std::string& in, std::string& out);
+
+  /// Perform URL-decoding on a range of characters. The output string
+  /// is cleared first, but keeps its capacity, so decoding repeatedly
+  /// into the same string doesn't need to allocate.
+  static bool url_decode(const char *begin, const char *end, std::string& out);
+
+  /// Hand back the storage from a reply which has been completely
+  /// written, so that it can be re-used by the next reply made on
+  /// this thread.
+  void recycle(reply& rep);
+
+protected:
+  /// Resize the headers of the reply to `n` entries, re-using recycled
+  /// header storage when possible, so that assigning the names and
+  /// values doesn't need to allocate.
+  void reuse_headers(reply& rep, std::size_t n);
+
+private:
+  /// Header storage recycled from replies which have been written.
+  std::vector<header> spare_headers_;
 };
 
 } // namespace server3
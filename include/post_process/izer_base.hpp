@@ -3,6 +3,7 @@
 
 #include "vector_tile_backend_pbf.hpp"
 #include "mapnik/map.hpp"
+#include "mapnik/request.hpp"
 
 namespace avecado {
 namespace post_process {
@@ -14,7 +15,13 @@ namespace post_process {
 class izer {
 public:
   virtual ~izer() {};
-  virtual void process(std::vector<mapnik::feature_ptr> &layer, mapnik::Map const& map) const = 0;
+  virtual void process(std::vector<mapnik::feature_ptr> &layer, mapnik::request const& request) const = 0;
+
+  // convenience overload taking the extent and size of the tile from
+  // the map's current extent and size.
+  void process(std::vector<mapnik::feature_ptr> &layer, mapnik::Map const& map) const {
+    process(layer, mapnik::request(map.width(), map.height(), map.get_current_extent()));
+  }
 };
 
 typedef std::shared_ptr<izer> izer_ptr;
@@ -5,6 +5,8 @@
 #include <boost/property_tree/ptree.hpp>
 #include <boost/noncopyable.hpp>
 #include <mapnik/feature.hpp>
+#include <mapnik/map.hpp>
+#include <mapnik/request.hpp>
 #include <memory>
 #include <vector>
 #include <string>
@@ -47,14 +49,23 @@ public:
    *   layer_name
    *     The name of the layer.
    *
-   *   scale
-   *     Scale of the tile.
+   *   request
+   *     Extent and size of the tile, from which the scale is
+   *     calculated.
    *
    * Returns: the number of izer's applied to the layer
    *
    * Throws an exception if an unrecoverable error was encountered
    * while processing a vector layer.
    */
+  size_t process_layer(std::vector<mapnik::feature_ptr> &layer,
+                     const std::string &layer_name,
+                     mapnik::request const& request) const;
+
+  /**
+   * As above, but taking the extent and size of the tile from the
+   * map's current extent and size.
+   */
   size_t process_layer(std::vector<mapnik::feature_ptr> &layer,
                      const std::string &layer_name,
                      mapnik::Map const& map) const;
@@ -4,6 +4,8 @@
 #include <mapnik/map.hpp>
 #include <mapnik/image_scaling.hpp>
 
+#include <memory>
+
 /* Forward declaration of vector tile type. This type is opaque
  * to users of Avecado, but we expose some methods in the
  * exported vector tile object below. */
@@ -22,6 +24,12 @@ public:
   // Construct an empty vector tile
   tile(unsigned int z_, unsigned int x_, unsigned int y_);
 
+  // Construct a vector tile sharing already-decoded, immutable tile
+  // data with other tiles. The data is only copied if this tile is
+  // modified through the non-const accessor.
+  tile(unsigned int z_, unsigned int x_, unsigned int y_,
+       std::shared_ptr<const vector_tile::Tile> data);
+
   ~tile();
 
   // Return the tile contents as PBF
@@ -30,15 +38,29 @@ public:
   // parse the string as PBF to get a tile.
   void from_string(const std::string &str);
 
-  // Return the in-memory structure of the tile.
+  // parse the buffer as (optionally gzipped) PBF to get a tile,
+  // without copying it first.
+  void from_buffer(const char *data, std::size_t size);
+
+  // Return the in-memory structure of the tile. Note that the
+  // non-const version makes a private copy of the data if it is
+  // shared, so use the const version where possible.
   vector_tile::Tile const &mapnik_tile() const;
   vector_tile::Tile &mapnik_tile();
 
+  // Make the tile data shareable, returning a pointer to it which
+  // can be used to construct other tiles. After this, modifying
+  // this tile will make a private copy of the data first.
+  std::shared_ptr<const vector_tile::Tile> share();
+
   // coordinates of this tile
   const unsigned int z, x, y;
 
 private:
+  // exactly one of these is set: either the tile owns its data, or
+  // it is sharing data which mustn't be modified.
   std::unique_ptr<vector_tile::Tile> m_mapnik_tile;
+  std::shared_ptr<const vector_tile::Tile> m_shared_tile;
 };
 
 // read the tile from a zero-copy input stream
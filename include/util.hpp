@@ -2,6 +2,8 @@
 #define AVECADO_UTIL_HPP
 
 #include <mapnik/box2d.hpp>
+#include <mapnik/request.hpp>
+#include <chrono>
 
 namespace avecado { namespace util {
 
@@ -9,6 +11,28 @@ namespace avecado { namespace util {
 // conventional z/x/y tile.
 mapnik::box2d<double> box_for_tile(int z, int x, int y);
 
+// returns a request for a square tile of the given size in pixels
+// covering the extent of a conventional z/x/y tile, with the given
+// buffer in pixels around it.
+mapnik::request request_for_tile(int z, int x, int y,
+                                 unsigned int size, int buffer_size);
+
+// measures elapsed wall-clock time, used to report how long the
+// expensive start-up steps, such as loading the map, take.
+class stopwatch {
+public:
+  stopwatch() : m_start(std::chrono::steady_clock::now()) {}
+
+  // milliseconds elapsed since construction.
+  double elapsed_ms() const {
+    return std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - m_start).count();
+  }
+
+private:
+  std::chrono::steady_clock::time_point m_start;
+};
+
 } } // namespace avecado::util
 
 #endif // AVECADO_UTIL_HPP
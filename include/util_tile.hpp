@@ -3,7 +3,15 @@
 
 #include "tile.hpp"
 
-namespace vector_tile { struct Tile_Layer; }
+#include <boost/noncopyable.hpp>
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+
+namespace vector_tile { struct Tile; struct Tile_Layer; }
 
 namespace avecado { namespace util {
 
@@ -18,6 +26,65 @@ namespace avecado { namespace util {
  */
 bool is_interesting(const vector_tile::Tile_Layer &);
 
+/* cuts a tile down to the features which might be needed to render
+ * one of its descendants, i.e: those which touch the descendant's
+ * extent plus a buffer around it.
+ *
+ * the descendant is given relative to the tile: dz levels further
+ * in, at (dx, dy) within it. the buffer is a fraction of the size of
+ * the descendant. features are kept whole and in the coordinates of
+ * the original tile, so the result can be rendered in its place.
+ */
+void cut_tile(const vector_tile::Tile &in, unsigned int dz, unsigned int dx, unsigned int dy,
+              double buffer, vector_tile::Tile &out);
+
+/* cache of tiles cut down with cut_tile, to render overzoomed tiles.
+ *
+ * when many tiles are rendered from the same ancestor, each cut is
+ * made from the cut of a nearer ancestor, which is itself cached, so
+ * the work for each tile is proportional to its area rather than the
+ * area of the original tile.
+ */
+class cut_cache : private boost::noncopyable {
+public:
+  typedef std::shared_ptr<const vector_tile::Tile> tile_data;
+
+  explicit cut_cache(std::size_t max_entries);
+  ~cut_cache();
+
+  // returns the data of the tile (z, x, y) cut down to render its
+  // descendant (cz, cx, cy), with a buffer as a fraction of the size
+  // of the descendant.
+  tile_data cut(tile_data data, unsigned int z, unsigned int x, unsigned int y,
+                unsigned int cz, unsigned int cx, unsigned int cy, double buffer);
+
+  // number of cuts which were found in the cache, and made.
+  std::size_t hits() const;
+  std::size_t misses() const;
+
+private:
+  // the original data, the descendant and the buffer.
+  typedef std::tuple<const vector_tile::Tile *, unsigned int, unsigned int, unsigned int, double> key_type;
+
+  struct entry {
+    key_type key;
+    // keeps the original data alive, so its address can't be re-used
+    // by other data while it's part of a key.
+    tile_data original;
+    tile_data cut;
+  };
+
+  typedef std::list<entry> lru_list;
+
+  const std::size_t m_max_entries;
+
+  mutable std::mutex m_mutex;
+  // most recently used at the front.
+  lru_list m_lru;
+  std::map<key_type, lru_list::iterator> m_index;
+  std::size_t m_hits, m_misses;
+};
+
 } } // namespace avecado::util
 
 #endif // AVECADO_UTIL_TILE_HPP
@@ -27,6 +27,7 @@
 #include "fetcher_io.hpp"
 #include "util.hpp"
 #include "util_tile.hpp"
+#include "datasource_pool.hpp"
 #include "config.h"
 #include "vector_tile.pb.h"
 
@@ -157,9 +158,13 @@ struct generator_stopped : public std::exception {
  * and expensive to generate objects such as mapnik::Map
  * which don't need to be re-initialised after each tile is
  * generated.
+ *
+ * the map is copied from one which has already been loaded,
+ * which is much quicker than parsing the XML again for each
+ * thread. the copy shares the datasources with the original.
  */
 struct tile_generator {
-  mapnik::Map map;
+  const mapnik::Map map;
   const std::string output_dir;
   const vector_options &vopt;
   const mapnik::scaling_method_e scaling_method;
@@ -167,25 +172,16 @@ struct tile_generator {
   const std::unordered_set<std::string> ignore_layers;
   std::atomic<bool> &stop_all_threads;
 
-  tile_generator(const std::string &map_file,
-                 const std::string &fonts_dir,
-                 const std::string &input_plugins_dir,
+  tile_generator(const mapnik::Map &map_,
                  const std::string &output_dir_,
                  const vector_options &vopt_,
                  mapnik::scaling_method_e scaling_method_,
                  boost::optional<const avecado::post_processor &> pp_,
                  std::atomic<bool> &stop_all_threads_)
-    : map(), output_dir(output_dir_), vopt(vopt_),
+    : map(map_), output_dir(output_dir_), vopt(vopt_),
       scaling_method(scaling_method_), pp(pp_),
       ignore_layers(vopt.ignore_layers.begin(), vopt.ignore_layers.end()),
       stop_all_threads(stop_all_threads_) {
-
-    // try to register fonts and input plugins
-    mapnik::freetype_engine::register_fonts(fonts_dir);
-    mapnik::datasource_cache::instance().register_datasources(input_plugins_dir);
-
-    // load map config from disk
-    mapnik::load_map(map, map_file);
   }
 
   // generate a tile and, if it's non-empty and max_z > root_z,
@@ -249,13 +245,13 @@ struct tile_generator {
 
     avecado::tile tile(z, x, y);
 
-    // setup map parameters
-    map.resize(256, 256);
-    map.zoom_to_box(avecado::util::box_for_tile(z, x, y));
+    // setup request parameters, leaving the map unchanged
+    const mapnik::request request =
+      avecado::util::request_for_tile(z, x, y, 256, vopt.buffer_size);
 
     // actually make the vector tile
     bool painted = avecado::make_vector_tile(
-      tile, vopt.path_multiplier, map, vopt.buffer_size,
+      tile, vopt.path_multiplier, map, request,
       vopt.scale_factor, vopt.offset_x, vopt.offset_y,
       vopt.tolerance, vopt.image_format, scaling_method,
       vopt.scale_denominator, pp);
@@ -299,17 +295,15 @@ struct tile_generator {
 // this is done by sharing a queue structure and having each thread
 // pull 'jobs' off it until all the tiles have been generated.
 void make_vector_thread(std::shared_ptr<tile_queue> queue,
-                        std::string map_file,
-                        std::string fonts_dir,
-                        std::string input_plugins_dir,
+                        const mapnik::Map &map,
                         std::string output_dir,
                         vector_options vopt,
                         mapnik::scaling_method_e scaling_method,
                         boost::optional<const avecado::post_processor &> pp,
                         std::atomic<bool> &stop_all_threads) {
   try {
-    tile_generator generator(map_file, fonts_dir, input_plugins_dir, output_dir,
-                             vopt, scaling_method, pp, stop_all_threads);
+    tile_generator generator(map, output_dir, vopt, scaling_method,
+                             pp, stop_all_threads);
 
     int root_z = 0, root_x = 0, root_y = 0, max_z = 0;
     while (queue->next(root_z, root_x, root_y, max_z)) {
@@ -333,6 +327,7 @@ int make_vector_bulk(int argc, char *argv[]) {
   vector_options vopt;
   std::string map_file;
   int min_z, max_z, mask_z, num_threads;
+  std::size_t datasource_pool_size;
   std::string fonts_dir, input_plugins_dir;
 
   bpo::options_description options(
@@ -361,6 +356,10 @@ int make_vector_bulk(int argc, char *argv[]) {
      "Minimum zoom level to generate.")
     ("parallel,P", bpo::value<int>(&num_threads)->default_value(1),
      "Number of parallel processes to run when generating tiles.")
+    ("datasource-pool-size", bpo::value<std::size_t>(&datasource_pool_size)->default_value(0),
+     "Maximum number of instances of each layer's datasource, shared between all "
+     "the threads. Leave as 0 to allow as many as there are threads, so that "
+     "none of them wait.")
     // positional arguments
     ("map-file", bpo::value<std::string>(&map_file), "Mapnik XML input file.")
     ("max-z", bpo::value<int>(&max_z), "Maximum zoom level to generate.")
@@ -455,6 +454,20 @@ int make_vector_bulk(int argc, char *argv[]) {
   }
 
   try {
+    // try to register fonts and input plugins
+    mapnik::freetype_engine::register_fonts(fonts_dir);
+    mapnik::datasource_cache::instance().register_datasources(input_plugins_dir);
+
+    // load map config from disk once, each thread takes a copy of it.
+    mapnik::Map map;
+    avecado::util::stopwatch load_timer;
+    mapnik::load_map(map, map_file);
+    std::cout << "Loaded map in " << load_timer.elapsed_ms() << " ms." << std::endl;
+
+    // share a bounded set of datasources between the threads.
+    avecado::pool_datasources(map, (datasource_pool_size > 0) ?
+                              datasource_pool_size : std::size_t(num_threads));
+
     std::shared_ptr<tile_queue> queue =
       std::make_shared<tile_queue>(min_z, max_z, mask_z);
     std::atomic<bool> stop(false);
@@ -463,7 +476,7 @@ int make_vector_bulk(int argc, char *argv[]) {
     for (int i = 0; i < num_threads; ++i) {
       threads.emplace_back(std::async(std::launch::async,
                                       &make_vector_thread,
-                                      queue, map_file, fonts_dir, input_plugins_dir,
+                                      queue, std::cref(map),
                                       output_dir, vopt, scaling_method, pp,
                                       std::ref(stop)));
     }
@@ -495,6 +508,11 @@ int make_vector_bulk(int argc, char *argv[]) {
       std::rethrow_exception(error);
     }
 
+    const avecado::datasource_pool_stats stats = avecado::pooled_datasource_stats(map);
+    std::cout << "Datasource pool: " << stats.instances << " instances, "
+              << stats.borrows << " borrows, " << stats.waits << " waits ("
+              << stats.wait_ms << " ms waiting)." << std::endl;
+
   } catch (const std::exception &e) {
     std::cerr << "Unable to make vector tile: " << e.what() << "\n";
     return EXIT_FAILURE;
@@ -627,12 +645,12 @@ int make_vector(int argc, char *argv[]) {
     // load map config from disk
     mapnik::load_map(map, map_file);
 
-    // setup map parameters
-    map.resize(256, 256);
-    map.zoom_to_box(avecado::util::box_for_tile(z, x, y));
+    // setup request parameters
+    const mapnik::request request =
+      avecado::util::request_for_tile(z, x, y, 256, vopt.buffer_size);
 
     // actually make the vector tile
-    avecado::make_vector_tile(tile, vopt.path_multiplier, map, vopt.buffer_size,
+    avecado::make_vector_tile(tile, vopt.path_multiplier, map, request,
                               vopt.scale_factor, vopt.offset_x, vopt.offset_y,
                               vopt.tolerance, vopt.image_format, scaling_method,
                               vopt.scale_denominator, pp);
@@ -656,6 +674,7 @@ int make_raster(int argc, char *argv[]) {
   unsigned int width = 256, height = 256;
   std::string tilejson_uri, output_file, map_file;
   std::string fonts_dir, input_plugins_dir;
+  std::string local_tiles;
 
   bpo::options_description options(
     "Avecado " VERSION "\n"
@@ -679,6 +698,12 @@ int make_raster(int argc, char *argv[]) {
      "Directory to tell Mapnik to look in for input plugins.")
     ("width", bpo::value<unsigned int>(&width), "Width of output raster.")
     ("height", bpo::value<unsigned int>(&height), "Height of output raster.")
+    ("local-tiles", bpo::value<std::string>(&local_tiles),
+     "Directory, or MBTiles file, to look in for vector tiles before fetching "
+     "them from the TileJSON's tile URLs. Tiles in a directory are laid out as "
+     "{z}/{x}/{y}.pbf, unless a pattern with those variables is given instead. "
+     "Fetched tiles are saved to a directory for next time. Overrides "
+     "\"localTiles\" in the TileJSON.")
     // positional arguments
     ("tilejson", bpo::value<std::string>(&tilejson_uri),
      "TileJSON config file URI to specify where to get vector tiles from.")
@@ -742,6 +767,9 @@ int make_raster(int argc, char *argv[]) {
     map.zoom_to_box(avecado::util::box_for_tile(z, x, y));
 
     bpt::ptree conf = avecado::tilejson(tilejson_uri);
+    if (vm.count("local-tiles")) {
+      conf.put("localTiles", local_tiles);
+    }
     std::unique_ptr<avecado::fetcher> fetcher = avecado::make_tilejson_fetcher(conf);
 
     avecado::request req(z, x, y);
@@ -751,7 +779,10 @@ int make_raster(int argc, char *argv[]) {
       mapnik::image_rgba8 image(width, height);
 
       std::unique_ptr<avecado::tile> tile(std::move(response.left()));
-      avecado::render_vector_tile(image, *tile, map, scale_factor, buffer_size);
+      // only one tile is rendered, so the cache only needs to hold
+      // the chain of cuts leading down to it.
+      avecado::util::cut_cache cuts(16);
+      avecado::render_vector_tile(image, *tile, z, x, y, cuts, map, scale_factor, buffer_size);
       mapnik::save_to_file(image, output_file, "png");
 
     } else {
@@ -1,5 +1,6 @@
 #include <boost/program_options.hpp>
 #include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/asio.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
@@ -37,6 +38,12 @@ int main(int argc, char *argv[]) {
     "tile with coordinates z=2, x=1, y=0 would be available at "
     "http://localhost:8080/2/1/0.pbf if the port parameter is given as 8080."
     "\n"
+    "\n"
+    "Several tiles can be fetched in one request from the /batch endpoint, "
+    "e.g: http://localhost:8080/batch?tiles=2/1/0,3/2-3/0-1 returns a "
+    "multipart response with one part per tile, streamed as each tile is "
+    "finished."
+    "\n"
     "\n");
 
   options.add_options()
@@ -70,6 +77,10 @@ int main(int argc, char *argv[]) {
     ("thread-hint", bpo::value<unsigned short>(&srv_opts.thread_hint)->default_value(1),
      "Hint at the number of asynchronous "
      "requests the server should be able to service.")
+    ("datasource-pool-size", bpo::value<std::size_t>(&map_opts.datasource_pool_size)->default_value(0),
+     "Maximum number of instances of each layer's datasource, shared between all "
+     "the threads. Threads wait for an instance if all of them are in use. Leave "
+     "as 0 to allow as many as there are threads, so that none of them wait.")
     ("config-file,c", bpo::value<std::string>(&config_file),
      "JSON config file to specify post-processing for data layers.")
     ("max-age", bpo::value<unsigned int>(&map_opts.max_age)->default_value(60),
@@ -166,13 +177,26 @@ int main(int argc, char *argv[]) {
     mapnik::freetype_engine::register_fonts(fonts_dir);
     mapnik::datasource_cache::instance().register_datasources(input_plugins_dir);
 
+    // by default, allow as many datasource instances as there are
+    // threads, so that no thread needs to wait for another.
+    if (map_opts.datasource_pool_size == 0) {
+      map_opts.datasource_pool_size = srv_opts.thread_hint;
+    }
+
     // set up the factory object
-    srv_opts.factory.reset(new http::server3::mapnik_handler_factory(map_opts));
+    boost::shared_ptr<http::server3::mapnik_handler_factory> factory =
+      boost::make_shared<http::server3::mapnik_handler_factory>(map_opts);
+    srv_opts.factory = factory;
     
     // start the server running
     http::server3::server server("0.0.0.0", srv_opts);
     server.run(true);
 
+    const avecado::datasource_pool_stats stats = factory->pool_stats();
+    std::cout << "Datasource pool: " << stats.instances << " instances, "
+              << stats.borrows << " borrows, " << stats.waits << " waits ("
+              << stats.wait_ms << " ms waiting)." << std::endl;
+
   } catch (std::exception& e) {
     std::cerr << "Exception: " << e.what() << "\n";
     return EXIT_FAILURE;
@@ -5,10 +5,10 @@ namespace avecado {
 
 backend::backend(vector_tile::Tile & tile,
                  unsigned path_multiplier,
-                 mapnik::Map const& map,
+                 mapnik::request const& request,
                  boost::optional<const post_processor &> pp)
   : m_pbf(tile, path_multiplier),
-    m_map(map),
+    m_request(request),
     m_tolerance(1),
     m_post_processor(pp) {}
 
@@ -21,7 +21,7 @@ void backend::stop_tile_layer() {
   if (m_post_processor) {
     m_post_processor->process_layer(m_current_layer_features,
                                     m_current_layer_name,
-                                    m_map);
+                                    m_request);
   }
 
   m_pbf.start_tile_layer(m_current_layer_name);
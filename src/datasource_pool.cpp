@@ -0,0 +1,200 @@
+#include "datasource_pool.hpp"
+
+#include <mapnik/datasource_cache.hpp>
+#include <mapnik/featureset.hpp>
+#include <mapnik/layer.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <set>
+
+namespace avecado {
+
+namespace {
+
+// wraps a featureset from a borrowed datasource, keeping hold of the
+// lease until the featureset is finished with.
+struct pooled_featureset : public mapnik::Featureset {
+  pooled_featureset(datasource_pool::lease lease, mapnik::featureset_ptr fs)
+    : m_lease(std::move(lease)), m_fs(std::move(fs)) {}
+
+  virtual ~pooled_featureset() {}
+
+  virtual mapnik::feature_ptr next() {
+    return m_fs->next();
+  }
+
+private:
+  // note: declared before the featureset, so that the featureset is
+  // destroyed before the datasource is handed back.
+  datasource_pool::lease m_lease;
+  mapnik::featureset_ptr m_fs;
+};
+
+mapnik::featureset_ptr wrap(datasource_pool::lease lease, mapnik::featureset_ptr fs) {
+  if (!fs) {
+    return fs;
+  }
+  return std::make_shared<pooled_featureset>(std::move(lease), std::move(fs));
+}
+
+} // anonymous namespace
+
+datasource_pool_stats::datasource_pool_stats()
+  : borrows(0), waits(0), wait_ms(0.0), instances(0) {
+}
+
+datasource_pool_stats &datasource_pool_stats::operator+=(const datasource_pool_stats &other) {
+  borrows += other.borrows;
+  waits += other.waits;
+  wait_ms += other.wait_ms;
+  instances += other.instances;
+  return *this;
+}
+
+datasource_pool::datasource_pool(mapnik::datasource_ptr initial, std::size_t max_size)
+  : m_primary(initial),
+    m_params(initial->params()),
+    m_max_size(std::max(max_size, std::size_t(1))),
+    m_free(1, initial),
+    m_size(1) {
+  m_stats.instances = 1;
+}
+
+datasource_pool::lease datasource_pool::borrow() {
+  mapnik::datasource_ptr ds;
+
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    ++m_stats.borrows;
+
+    if (m_free.empty() && (m_size >= m_max_size)) {
+      ++m_stats.waits;
+      const auto start = std::chrono::steady_clock::now();
+      m_available.wait(lock, [this]() {
+          return !m_free.empty() || (m_size < m_max_size);
+        });
+      m_stats.wait_ms += std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+    }
+
+    if (!m_free.empty()) {
+      ds = m_free.back();
+      m_free.pop_back();
+
+    } else {
+      // reserve a place in the pool for the new instance, so that
+      // other threads don't go over the maximum while it's being
+      // created outside the lock.
+      ++m_size;
+    }
+  }
+
+  if (!ds) {
+    try {
+      ds = mapnik::datasource_cache::instance().create(m_params);
+
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      --m_size;
+      m_available.notify_one();
+      throw;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_stats.instances;
+  }
+
+  std::shared_ptr<datasource_pool> self = shared_from_this();
+  return lease(ds.get(), [self, ds](mapnik::datasource *) { self->hand_back(ds); });
+}
+
+void datasource_pool::hand_back(mapnik::datasource_ptr ds) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_free.push_back(ds);
+  m_available.notify_one();
+}
+
+datasource_pool_stats datasource_pool::stats() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_stats;
+}
+
+pooled_datasource::pooled_datasource(std::shared_ptr<datasource_pool> pool)
+  : mapnik::datasource(pool->primary().params()),
+    m_pool(pool) {
+}
+
+pooled_datasource::~pooled_datasource() {
+}
+
+mapnik::datasource::datasource_t pooled_datasource::type() const {
+  return m_pool->primary().type();
+}
+
+mapnik::processor_context_ptr pooled_datasource::get_context(mapnik::feature_style_context_map &ctx) const {
+  return m_pool->primary().get_context(ctx);
+}
+
+mapnik::featureset_ptr pooled_datasource::features_with_context(mapnik::query const &q, mapnik::processor_context_ptr ctx) const {
+  datasource_pool::lease ds = m_pool->borrow();
+  mapnik::featureset_ptr fs = ds->features_with_context(q, ctx);
+  return wrap(std::move(ds), std::move(fs));
+}
+
+mapnik::featureset_ptr pooled_datasource::features(mapnik::query const &q) const {
+  datasource_pool::lease ds = m_pool->borrow();
+  mapnik::featureset_ptr fs = ds->features(q);
+  return wrap(std::move(ds), std::move(fs));
+}
+
+mapnik::featureset_ptr pooled_datasource::features_at_point(mapnik::coord2d const &pt, double tol) const {
+  datasource_pool::lease ds = m_pool->borrow();
+  mapnik::featureset_ptr fs = ds->features_at_point(pt, tol);
+  return wrap(std::move(ds), std::move(fs));
+}
+
+mapnik::box2d<double> pooled_datasource::envelope() const {
+  return m_pool->primary().envelope();
+}
+
+boost::optional<mapnik::datasource::geometry_t> pooled_datasource::get_geometry_type() const {
+  return m_pool->primary().get_geometry_type();
+}
+
+mapnik::layer_descriptor pooled_datasource::get_descriptor() const {
+  return m_pool->primary().get_descriptor();
+}
+
+void pool_datasources(mapnik::Map &map, std::size_t max_size) {
+  for (mapnik::layer &layer : map.layers()) {
+    mapnik::datasource_ptr ds = layer.datasource();
+
+    // skip layers without a datasource, or which have already been
+    // pooled.
+    if (!ds || std::dynamic_pointer_cast<pooled_datasource>(ds)) {
+      continue;
+    }
+
+    std::shared_ptr<datasource_pool> pool = std::make_shared<datasource_pool>(ds, max_size);
+    layer.set_datasource(std::make_shared<pooled_datasource>(pool));
+  }
+}
+
+datasource_pool_stats pooled_datasource_stats(const mapnik::Map &map) {
+  datasource_pool_stats stats;
+  std::set<const datasource_pool *> seen;
+
+  for (const mapnik::layer &layer : map.layers()) {
+    std::shared_ptr<pooled_datasource> ds =
+      std::dynamic_pointer_cast<pooled_datasource>(layer.datasource());
+
+    if (ds && seen.insert(&ds->pool()).second) {
+      stats += ds->pool().stats();
+    }
+  }
+
+  return stats;
+}
+
+} // namespace avecado
@@ -0,0 +1,262 @@
+#include "fetch/directory.hpp"
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/format.hpp>
+#include <boost/date_time/posix_time/conversion.hpp>
+
+#include <cerrno>
+#include <cstdlib>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// maximum number of tiles waiting to be written. writing tiles back
+// is only an optimisation, so any more than this are dropped rather
+// than using more and more memory if the disk can't keep up.
+#define MAX_PENDING_WRITES (1024)
+
+namespace bal = boost::algorithm;
+
+namespace avecado { namespace fetch {
+
+namespace {
+
+int hex_value(char c) {
+  if ((c >= '0') && (c <= '9')) { return c - '0'; }
+  if ((c >= 'a') && (c <= 'f')) { return c - 'a' + 10; }
+  if ((c >= 'A') && (c <= 'F')) { return c - 'A' + 10; }
+  return -1;
+}
+
+// decode %-escapes, leaving any which aren't valid as they are, as
+// curl does.
+std::string percent_decode(const std::string &in) {
+  std::string out;
+  out.reserve(in.size());
+  for (std::size_t i = 0; i < in.size(); ++i) {
+    if ((in[i] == '%') && (i + 2 < in.size())) {
+      int hi = hex_value(in[i + 1]), lo = hex_value(in[i + 2]);
+      if ((hi >= 0) && (lo >= 0)) {
+        out.push_back(char((hi << 4) | lo));
+        i += 2;
+        continue;
+      }
+    }
+    out.push_back(in[i]);
+  }
+  return out;
+}
+
+// the path of a file: URL, which can be "file:///srv/tiles",
+// "file://localhost/srv/tiles" or "file:/srv/tiles". anything else
+// is taken to be a path already.
+std::string file_url_path(const std::string &pattern) {
+  if (!bal::istarts_with(pattern, "file:")) {
+    return pattern;
+  }
+
+  std::string rest = pattern.substr(5);
+  if (bal::starts_with(rest, "//")) {
+    std::size_t slash = rest.find('/', 2);
+    std::string authority = rest.substr(2, (slash == std::string::npos) ? std::string::npos : slash - 2);
+    if (!authority.empty() && !bal::iequals(authority, "localhost")) {
+      throw std::runtime_error((boost::format("Unable to read tiles from \"%1%\", as it's on another "
+                                              "host.") % pattern).str());
+    }
+    rest = (slash == std::string::npos) ? std::string() : rest.substr(slash);
+  }
+
+  return percent_decode(rest);
+}
+
+fetch_response error(fetch_status status) {
+  fetch_result err;
+  err.status = status;
+  return fetch_response(err);
+}
+
+struct file_descriptor {
+  explicit file_descriptor(int fd_) : fd(fd_) {}
+  ~file_descriptor() { if (fd >= 0) { close(fd); } }
+  const int fd;
+};
+
+fetch_response read_tile(const std::string &path, const request &r) {
+  file_descriptor file(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (file.fd < 0) {
+    if ((errno == ENOENT) || (errno == ENOTDIR)) {
+      return error(fetch_status::not_found);
+    }
+    return error(fetch_status::server_error);
+  }
+
+  struct stat st;
+  if ((fstat(file.fd, &st) != 0) || !S_ISREG(st.st_mode)) {
+    return error(fetch_status::server_error);
+  }
+
+  if (r.if_modified_since &&
+      (boost::posix_time::from_time_t(st.st_mtime) <= *r.if_modified_since)) {
+    return error(fetch_status::not_modified);
+  }
+
+  // read the whole file with as few calls as possible, rather than
+  // through a stream.
+  std::string body(st.st_size, '\0');
+  std::size_t done = 0;
+  while (done < body.size()) {
+    ssize_t n = pread(file.fd, &body[done], body.size() - done, done);
+    if (n < 0) {
+      if (errno == EINTR) { continue; }
+      return error(fetch_status::server_error);
+    }
+    if (n == 0) {
+      // the file was truncated while reading it.
+      body.resize(done);
+      break;
+    }
+    done += n;
+  }
+
+  std::unique_ptr<tile> ptr(new tile(r.z, r.x, r.y));
+  try {
+    ptr->from_buffer(body.data(), body.size());
+
+  } catch (...) {
+    return error(fetch_status::server_error);
+  }
+
+  return fetch_response(std::move(ptr));
+}
+
+// create the directory and any missing parents, as with mkdir -p.
+bool make_directories(const std::string &dir) {
+  if (dir.empty() || (mkdir(dir.c_str(), 0777) == 0) || (errno == EEXIST)) {
+    return true;
+  }
+  if (errno != ENOENT) {
+    return false;
+  }
+
+  std::size_t slash = dir.rfind('/');
+  if ((slash == std::string::npos) || (slash == 0) ||
+      !make_directories(dir.substr(0, slash))) {
+    return false;
+  }
+  return (mkdir(dir.c_str(), 0777) == 0) || (errno == EEXIST);
+}
+
+bool write_fully(int fd, const std::string &data) {
+  std::size_t done = 0;
+  while (done < data.size()) {
+    ssize_t n = write(fd, data.data() + done, data.size() - done);
+    if (n < 0) {
+      if (errno == EINTR) { continue; }
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+// write the file under a temporary name, then rename it into place,
+// so that it appears complete or not at all.
+void write_tile(const std::string &path, const std::string &data) {
+  std::size_t slash = path.rfind('/');
+  if ((slash != std::string::npos) && !make_directories(path.substr(0, slash))) {
+    return;
+  }
+
+  std::string temp = path + ".XXXXXX";
+  file_descriptor file(mkstemp(&temp[0]));
+  if (file.fd < 0) {
+    return;
+  }
+
+  if (!write_fully(file.fd, data) ||
+      (fchmod(file.fd, 0644) != 0) ||
+      (rename(temp.c_str(), path.c_str()) != 0)) {
+    unlink(temp.c_str());
+  }
+}
+
+} // anonymous namespace
+
+directory::directory(const std::string &pattern)
+  : m_pattern(file_url_path(pattern)), m_shutdown(false) {
+}
+
+directory::~directory() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_shutdown = true;
+  }
+  m_cond.notify_one();
+  if (m_writer.joinable()) {
+    m_writer.join();
+  }
+}
+
+void directory::fetch(const request &r, fetch_callback callback) {
+  if ((r.z < 0) || (r.x < 0) || (r.y < 0)) {
+    callback(error(fetch_status::not_found));
+    return;
+  }
+
+  std::string path;
+  m_pattern.build(r.z, r.x, r.y, path);
+  callback(read_tile(path, r));
+}
+
+void directory::put(tile &t) {
+  pending_write w;
+  w.z = t.z;
+  w.x = t.x;
+  w.y = t.y;
+  w.data = t.share();
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_writes.size() >= MAX_PENDING_WRITES) {
+      return;
+    }
+    m_writes.push_back(std::move(w));
+    if (!m_writer.joinable()) {
+      m_writer = std::thread(&directory::writer_func, this);
+    }
+  }
+  m_cond.notify_one();
+}
+
+void directory::writer_func() {
+  std::string path;
+
+  while (true) {
+    pending_write w;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cond.wait(lock, [this]() { return m_shutdown || !m_writes.empty(); });
+      if (m_writes.empty()) {
+        // only stop once everything has been written.
+        break;
+      }
+      w = std::move(m_writes.front());
+      m_writes.pop_front();
+    }
+
+    // encoding is done here too, as it's a significant part of the
+    // cost of writing.
+    m_pattern.build(w.z, w.x, w.y, path);
+    try {
+      write_tile(path, tile(w.z, w.x, w.y, std::move(w.data)).get_data());
+
+    } catch (...) {
+      // a tile which couldn't be written will be fetched from
+      // elsewhere again next time.
+    }
+  }
+}
+
+} } // namespace avecado::fetch
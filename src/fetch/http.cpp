@@ -1,31 +1,90 @@
 #include "fetch/http.hpp"
 #include "fetch/http_date_parser.hpp"
+#include "fetch/url_template.hpp"
 #include "vector_tile.pb.h"
 #include "config.h"
 
 #include <boost/format.hpp>
 #include <boost/algorithm/string/find_format.hpp>
 #include <boost/algorithm/string/predicate.hpp>
-#include <boost/xpressive/xpressive.hpp>
 #include <boost/optional/optional_io.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
 #include <sstream>
+#include <algorithm>
+#include <functional>
 #include <list>
 #include <queue>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <map>
+#include <random>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
 #include <google/protobuf/io/zero_copy_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 
 #include <curl/curl.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
 #ifdef HAVE_SQLITE3
 #include <sqlite3.h>
 #endif
 
-// maximum number of idle HTTP handles/connections to keep alive in
-// the handle pool. TODO: make this configurable.
-#define MAX_POOL_SIZE (64)
+// multiplexing HTTP/2 requests needs CURLPIPE_MULTIPLEX and
+// CURL_HTTP_VERSION_2TLS, from libcurl 7.47.0.
+#if LIBCURL_VERSION_NUM >= 0x072f00
+#define CURL_CAN_MULTIPLEX
+#endif
+
+// the default number of threads decoding tiles is one per core, up
+// to this many. decoding is usually quicker than the transfer, so
+// only a few are needed to keep up with the curl thread.
+#define DEFAULT_MAX_DECODE_THREADS (4u)
+
+// maximum number of socket events to handle from each call to
+// epoll_wait. any more are picked up by the next call.
+#define MAX_EPOLL_EVENTS (64)
+
+// number of consecutive failures (connection errors, timeouts or 5xx
+// responses) after which a host is ejected, and the number of seconds
+// it is ejected for. while ejected, requests go to the other hosts.
+#define HOST_EJECT_FAILURES (3)
+#define HOST_EJECT_SECONDS (10)
+
+// number of recent request latencies used to estimate the percentile
+// for hedging, and the number needed before hedging starts. the
+// estimate is also re-calculated after each HEDGE_MIN_SAMPLES.
+#define HEDGE_LATENCY_SAMPLES (256)
+#define HEDGE_MIN_SAMPLES (16)
+
+// time to wait, in milliseconds, for another connection to the
+// cache database to release a lock.
+#define SQLITE_BUSY_TIMEOUT_MS (5000)
+
+// minimum time, in seconds, between updates to the last access time
+// of a cache entry. this keeps reads from turning into writes for
+// popular tiles, at the cost of slightly less precise eviction.
+#define CACHE_TOUCH_INTERVAL (60)
+
+// number of least recently used entries to delete from the cache at
+// a time, when it's over its size limit.
+#define CACHE_EVICT_CHUNK (64)
+
+// largest Content-Length to trust when reserving space for a response
+// body. anything bigger grows as it arrives.
+#define MAX_BODY_RESERVE (16 * 1024 * 1024)
+
+// maximum number of missing tiles to remember in memory.
+#define NOT_FOUND_MEMORY_MAX (65536)
 
 namespace avecado { namespace fetch {
 
@@ -43,10 +102,10 @@ std::string make_http_date(const boost::posix_time::ptime &ptime) {
 }
 
 size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
-  std::stringstream *stream = static_cast<std::stringstream*>(userdata);
+  std::string *body = static_cast<std::string*>(userdata);
   size_t total_bytes = size * nmemb;
-  stream->write(ptr, total_bytes);
-  return stream->good() ? total_bytes : 0;
+  body->append(ptr, total_bytes);
+  return total_bytes;
 }
 
 std::vector<std::string> singleton(const std::string &base_url, const std::string &ext) {
@@ -55,65 +114,310 @@ std::vector<std::string> singleton(const std::string &base_url, const std::strin
   return vec;
 }
 
-struct formatter {
-  unsigned int z, x, y;
+// an entry found in the local cache for a request's URL.
+// response bodies are immutable once received, so they can be
+// shared between the request, the cache and its writer thread
+// without copying.
+typedef std::shared_ptr<const std::string> body_ptr;
+
+struct cache_entry {
+  cache_entry() : not_found(false) {}
+
+  boost::optional<std::time_t> expires;
+  boost::optional<std::time_t> last_modified;
+  boost::optional<std::string> etag;
+  body_ptr body;
+  // true if the origin said the tile doesn't exist, in which case
+  // there's no body.
+  bool not_found;
+
+  bool expired() const {
+    if (expires) {
+      std::time_t now = time(nullptr);
+      return *expires < now;
+    }
+    return true;
+  }
+
+  // true if the entry has validators which can be sent to the origin
+  // to check whether the body is still current.
+  bool revalidatable() const {
+    return bool(etag) || bool(last_modified);
+  }
 
-  formatter(unsigned int z_, unsigned int x_, unsigned int y_) : z(z_), x(x_), y(y_) {}
+  // true if there's a body which expired no more than `seconds` ago,
+  // and so can still be served in place of a fresh one.
+  bool usable_stale(long seconds) const {
+    if (body && !not_found && expires && (seconds > 0)) {
+      std::time_t now = time(nullptr);
+      return now <= *expires + seconds;
+    }
+    return false;
+  }
+};
 
-  template<typename Out>
-  Out operator()(boost::xpressive::smatch const &what, Out out) const {
-    int val = 0;
+// URLs of tiles which the origin recently said don't exist, and when
+// that stops being true. this is kept exact, rather than as a Bloom
+// filter, as a false positive would hide a tile which does exist, and
+// entries need to expire.
+class missing_tiles {
+public:
+  bool contains(const std::string &url) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto itr = m_expires.find(url);
+    if (itr == m_expires.end()) {
+      return false;
+    }
+    if (itr->second < time(nullptr)) {
+      m_expires.erase(itr);
+      return false;
+    }
+    return true;
+  }
 
-    char c = what[1].str()[0];
-    if      (c == 'z') { val = z; }
-    else if (c == 'x') { val = x; }
-    else if (c == 'y') { val = y; }
-    else { throw std::runtime_error("match failed"); }
+  void insert(const std::string &url, std::time_t expires) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_expires[url] = expires;
+
+    if (m_expires.size() > NOT_FOUND_MEMORY_MAX) {
+      const std::time_t now = time(nullptr);
+      for (auto itr = m_expires.begin(); itr != m_expires.end(); ) {
+        if (itr->second < now) {
+          itr = m_expires.erase(itr);
+        } else {
+          ++itr;
+        }
+      }
+      // still too many, so start again rather than grow without
+      // bound. the disk cache, if there is one, still has them.
+      if (m_expires.size() > NOT_FOUND_MEMORY_MAX) {
+        m_expires.clear();
+      }
+    }
+  }
 
-    std::string sub = (boost::format("%1%") % val).str();
-    out = std::copy(sub.begin(), sub.end(), out);
+private:
+  std::mutex m_mutex;
+  std::unordered_map<std::string, std::time_t> m_expires;
+};
+
+// threads which decode tiles, so that the curl thread only has to
+// move bytes and isn't held up by parsing large tiles. jobs are run
+// in the order they're posted, and all of them are run before the
+// pool is destroyed.
+class decode_pool {
+public:
+  explicit decode_pool(unsigned int num_threads) : m_shutdown(false) {
+    for (unsigned int i = 0; i < num_threads; ++i) {
+      m_threads.emplace_back(&decode_pool::thread_func, this);
+    }
+  }
+
+  ~decode_pool() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_shutdown = true;
+    }
+    m_cond.notify_all();
+    for (std::thread &t : m_threads) {
+      t.join();
+    }
+  }
+
+  void post(std::function<void ()> &&job) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_jobs.emplace_back(std::move(job));
+    }
+    m_cond.notify_one();
+  }
 
-    return out;
+private:
+  void thread_func() {
+    while (true) {
+      std::function<void ()> job;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this]() { return m_shutdown || !m_jobs.empty(); });
+        if (m_jobs.empty()) {
+          break;
+        }
+        job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+      }
+      job();
+    }
   }
+
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  std::deque<std::function<void ()> > m_jobs;
+  bool m_shutdown;
+  std::vector<std::thread> m_threads;
+};
+
+// a caller waiting on the result of a transfer started by another
+// request for the same URL.
+struct waiter {
+  fetch_callback callback;
+  unsigned int z, x, y;
 };
 
 struct request {
-  request(std::promise<fetch_response> &&p_, const avecado::request &r_, std::string url_)
-    : promise(std::move(p_)), req(r_), z(r_.z), x(r_.x), y(r_.y), stream(new std::stringstream), url(url_) {}
+  request(fetch_callback &&cb_, const avecado::request &r_, std::string url_)
+    : callback(std::move(cb_)), req(r_), z(r_.z), x(r_.x), y(r_.y), url(url_)
+    , headers(nullptr), revalidating(false), host_index(0), retries(0), in_flight(false)
+    , handle(nullptr), partner(nullptr), is_hedge(false), hedge_queued(false) {}
 
   request(request &&r)
-    : promise(std::move(r.promise))
+    : callback(std::move(r.callback))
     , req(std::move(r.req))
     , z(r.z), x(r.x), y(r.y)
-    , stream(std::move(r.stream))
+    , body(std::move(r.body))
     , url(std::move(r.url))
     , base_date(std::move(r.base_date))
     , expires(std::move(r.expires))
     , last_modified(std::move(r.last_modified))
     , etag(std::move(r.etag))
-    , max_age(std::move(r.max_age)) {
+    , max_age(std::move(r.max_age))
+    , cached(std::move(r.cached))
+    , headers(r.headers)
+    , revalidating(r.revalidating)
+    , hosts(std::move(r.hosts))
+    , host_index(r.host_index)
+    , retries(r.retries)
+    , fetch_url(std::move(r.fetch_url))
+    , in_flight(r.in_flight)
+    , waiters(std::move(r.waiters))
+    , handle(r.handle)
+    , started(r.started)
+    , partner(r.partner)
+    , is_hedge(r.is_hedge)
+    , hedge_queued(r.hedge_queued)
+    , hedge_pos(r.hedge_pos) {
+    r.headers = nullptr;
+  }
+
+  ~request() {
+    curl_slist_free_all(headers);
   }
 
   bool expired() const {
-    if (expires) {
-      std::time_t now = time(nullptr);
-      return *expires < now;
-    }
-    return true;
+    return !cached || cached->expired();
   }
 
-  std::promise<fetch_response> promise;
+  // conditional requests can have different answers depending on the
+  // validators, so they can't share a transfer with other requests.
+  bool shareable() const {
+    return !req.etag && !req.if_modified_since;
+  }
+
+  // clear out everything from a failed attempt, so that the request
+  // can be tried again on another host.
+  void reset_attempt() {
+    body.clear();
+    base_date = boost::none;
+    expires = boost::none;
+    last_modified = boost::none;
+    etag = boost::none;
+    max_age = boost::none;
+    curl_slist_free_all(headers);
+    headers = nullptr;
+    revalidating = false;
+  }
+
+  fetch_callback callback;
   avecado::request req;
   unsigned int z, x, y;
-  std::unique_ptr<std::stringstream> stream;
+  // the response body, reserved up-front from the Content-Length
+  // so that it's received without re-allocation.
+  std::string body;
   std::string url;
+  // cache information from the response headers.
   boost::optional<std::time_t> base_date;
   boost::optional<std::time_t> expires;
   boost::optional<std::time_t> last_modified;
   boost::optional<std::string> etag;
   boost::optional<double> max_age;
+  // what was in the local cache for this URL, if anything.
+  boost::optional<cache_entry> cached;
+  // extra headers sent with this request. these are owned by the
+  // request, as curl doesn't copy them.
+  curl_slist *headers;
+  // true if the request was made conditional on the validators from
+  // the cache entry, rather than any from the caller.
+  bool revalidating;
+  // indexes of the URL patterns (hosts) to try, in order of
+  // preference, the index into that of the current attempt, and the
+  // number of times the request has been retried.
+  std::vector<unsigned int> hosts;
+  unsigned int host_index;
+  unsigned int retries;
+  // the URL actually being fetched, which may be on a different host
+  // from the one used for the cache key.
+  std::string fetch_url;
+  // true if this request is registered as the in-flight transfer for
+  // its URL, in which case other callers may be waiting on it. the
+  // waiters are protected by the impl's mutex.
+  bool in_flight;
+  std::vector<waiter> waiters;
+  // the curl handle of the current transfer, if one is running, and
+  // when it was started.
+  CURL *handle;
+  std::chrono::steady_clock::time_point started;
+  // when a request has been hedged, the original and the duplicate
+  // are each other's partners, until one of them finishes.
+  request *partner;
+  bool is_hedge;
+  // position in the list of requests which may need hedging.
+  bool hedge_queued;
+  std::list<request *>::iterator hedge_pos;
 };
 
+// mix the bits of a 64-bit integer, so that similar inputs give very
+// different outputs. this is the finaliser from splitmix64.
+uint64_t mix_bits(uint64_t v) {
+  v = (v ^ (v >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  v = (v ^ (v >> 27)) * UINT64_C(0x94d049bb133111eb);
+  return v ^ (v >> 31);
+}
+
+// order the hosts for a tile by rendezvous (highest random weight)
+// hashing. each tile consistently goes to the same host, spreading
+// the tiles evenly over them, and when a host is unavailable its
+// tiles are spread evenly over the others.
+std::vector<unsigned int> rank_hosts(unsigned int num_hosts, unsigned int z, unsigned int x, unsigned int y) {
+  const uint64_t tile_hash = mix_bits((uint64_t(z) << 58) ^ (uint64_t(x) << 29) ^ uint64_t(y));
+
+  std::vector<std::pair<uint64_t, unsigned int> > scores;
+  scores.reserve(num_hosts);
+  for (unsigned int i = 0; i < num_hosts; ++i) {
+    scores.push_back(std::make_pair(mix_bits(tile_hash ^ mix_bits(i + 1)), i));
+  }
+  std::sort(scores.begin(), scores.end(), std::greater<std::pair<uint64_t, unsigned int> >());
+
+  std::vector<unsigned int> hosts;
+  hosts.reserve(num_hosts);
+  for (const auto &score : scores) {
+    hosts.push_back(score.second);
+  }
+  return hosts;
+}
+
+// normalise the request by collapsing any Cache-control / Expires
+// headers into an absolute expiry time.
+void normalise_expiry(request *req) {
+  if (req->max_age) {
+    req->expires = time(nullptr) + *req->max_age;
+
+  } else if (bool(req->expires) && bool(req->base_date)) {
+    req->expires = time(nullptr) + (*req->expires - *req->base_date);
+
+  } else {
+    req->expires = boost::none;
+  }
+}
+
 bool parse_header_value(boost::iterator_range<const char *> &range) {
   // skip space following key
   while (bool(range) && (range.front() == ' ')) {
@@ -158,6 +462,7 @@ size_t header_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
   static const char header_expires[] = "Expires";
   static const char header_last_modified[] = "Last-Modified";
   static const char header_cache_control[] = "Cache-control";
+  static const char header_content_length[] = "Content-Length";
 
   request *req = static_cast<request *>(userdata);
   const size_t total_bytes = size * nmemb;
@@ -183,6 +488,18 @@ size_t header_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
     string_range range(ptr + STRLEN(last_modified), ptr + total_bytes);
     req->last_modified = parse_date(range);
 
+  } else if (HEADER_MATCH(content_length)) {
+    string_range range(ptr + STRLEN(content_length), ptr + total_bytes);
+    if (parse_header_value(range)) {
+      try {
+        const std::size_t length = boost::lexical_cast<std::size_t>(std::string(range.begin(), range.end()));
+        req->body.reserve(std::min<std::size_t>(length, MAX_BODY_RESERVE));
+      } catch (const boost::bad_lexical_cast &) {
+        // not worth failing the request over, it'll just grow as
+        // the body arrives.
+      }
+    }
+
   } else if (HEADER_MATCH(cache_control)) {
     string_range range(ptr + STRLEN(cache_control), ptr + total_bytes);
     if (parse_header_value(range)) {
@@ -250,10 +567,14 @@ struct statement {
     }
   }
 
-  void column_blob(int i, std::stringstream &stream) {
+  sqlite3_int64 column_int64(int i) {
+    return sqlite3_column_int64(ptr.get(), i);
+  }
+
+  void column_blob(int i, std::string &str) {
     const char *bytes = static_cast<const char *>(sqlite3_column_blob(ptr.get(), i));
     int sz = sqlite3_column_bytes(ptr.get(), i);
-    stream.write(bytes, sz);
+    str.assign(bytes, sz);
   }
 
   bool step() {
@@ -265,6 +586,21 @@ struct statement {
     return true;
   }
 
+  // reset the statement and its bindings so that it can be run
+  // again. prepared statements are kept around and re-used, as
+  // preparing them is a significant part of the cost of a query.
+  void reset() {
+    sqlite3_reset(ptr.get());
+    sqlite3_clear_bindings(ptr.get());
+  }
+
+  void bind_int64(int i, sqlite3_int64 v) {
+    int status = sqlite3_bind_int64(ptr.get(), i, v);
+    if (status != SQLITE_OK) {
+      throw std::runtime_error((boost::format("Argument bind failed: %1%") % sqlite3_errmsg(db_for_errors)).str());
+    }
+  }
+
   void bind_text(int i, const std::string &str) {
     int sz = str.size();
     char *strp = static_cast<char *>(malloc(sz));
@@ -308,15 +644,11 @@ struct statement {
     }
   }
 
-  void bind_blob(int i, std::stringstream &stream) {
-    std::string str = stream.str();
-    int sz = str.size();
-    char *strp = static_cast<char *>(malloc(sz));
-    if (strp == nullptr) { throw std::runtime_error("Unable to allocate memory for blob copy."); }
-    memcpy(strp, str.c_str(), sz);
-    int status = sqlite3_bind_blob(ptr.get(), i, strp, sz, &free);
+  // note: the blob isn't copied, so the string must not change or
+  // go away until the statement has been reset.
+  void bind_blob(int i, const std::string &str) {
+    int status = sqlite3_bind_blob(ptr.get(), i, str.data(), str.size(), SQLITE_STATIC);
     if (status != SQLITE_OK) {
-      free(strp);
       throw std::runtime_error((boost::format("Argument bind failed: %1%") % sqlite3_errmsg(db_for_errors)).str());
     }
   }
@@ -346,72 +678,485 @@ struct db {
       throw std::runtime_error((boost::format("Unable to open SQLite3 database \"%1%\": %2%") % loc % sqlite3_errmsg(ptr_)).str());
     }
     ptr.reset(ptr_);
+
+    // wait for locks held by other connections to the same cache,
+    // rather than failing immediately.
+    sqlite3_busy_timeout(ptr.get(), SQLITE_BUSY_TIMEOUT_MS);
   }
 
   statement prepare(const std::string &sql) {
     return statement(ptr.get(), sql);
   }
 
+  // execute one or more statements which don't return any rows.
+  void exec(const std::string &sql) {
+    char *errmsg = nullptr;
+    int status = sqlite3_exec(ptr.get(), sql.c_str(), nullptr, nullptr, &errmsg);
+    if (status != SQLITE_OK) {
+      std::string msg = (errmsg == nullptr) ? sqlite3_errmsg(ptr.get()) : errmsg;
+      sqlite3_free(errmsg);
+      throw std::runtime_error((boost::format("Unable to execute SQLite3 statement \"%1%\": %2%") % sql % msg).str());
+    }
+  }
+
 private:
   std::unique_ptr<sqlite3, sqlite_db_deleter> ptr;
 };
 
 } // namespace sqlite
 
+// cache of tiles fetched from the origin, stored in an SQLite
+// database.
+//
+// lookups come from the threads calling the fetcher, and each one
+// borrows a connection (with its prepared statements) from a pool of
+// readers, so that lookups don't serialise on a single connection.
+// the database is in WAL mode, so readers don't block the writer or
+// each other.
+//
+// writes come from the curl thread, which shouldn't be held up
+// waiting for the disk, so they're queued and applied by a background
+// thread in batches, one transaction per batch. writes which haven't
+// been committed yet are kept in a pending map, so that lookups still
+// see them.
+//
+// if a maximum size is given, the least recently used entries are
+// evicted after each batch until the cache is back under the limit.
 struct cache {
-  cache(const std::string &loc) 
-    : m_db(new sqlite::db(loc)) {
+  cache(const std::string &loc, std::size_t max_bytes)
+    : m_location(loc), m_max_bytes(max_bytes), m_db(new sqlite::db(loc)),
+      m_total_bytes(0), m_sequence(0), m_shutdown(false) {
+
+    // WAL lets readers carry on while a batch is being written, and
+    // with WAL it's safe to only sync at checkpoints - a crash may
+    // lose the last few writes, but can't corrupt the database.
+    m_db->exec("PRAGMA journal_mode=WAL");
+    m_db->exec("PRAGMA synchronous=NORMAL");
+
+    create_schema();
+
+    m_insert.reset(new sqlite::statement(m_db->prepare("insert or replace into cache (url, expires, last_modified, etag, body, size, last_access, not_found) values (?, ?, ?, ?, ?, ?, ?, ?)")));
+    m_refresh.reset(new sqlite::statement(m_db->prepare("update cache set expires=?, last_modified=?, etag=?, last_access=? where url=?")));
+    m_touch.reset(new sqlite::statement(m_db->prepare("update cache set last_access=? where url=?")));
+    m_size_of.reset(new sqlite::statement(m_db->prepare("select size from cache where url=?")));
+    m_oldest.reset(new sqlite::statement(m_db->prepare("select url, size from cache order by last_access asc, rowid asc limit ?")));
+    m_delete.reset(new sqlite::statement(m_db->prepare("delete from cache where url=?")));
+
+    sqlite::statement total(m_db->prepare("select coalesce(sum(size), 0) from cache"));
+    if (total.step()) {
+      m_total_bytes = total.column_int64(0);
+    }
+
+    m_writer = std::thread(&cache::writer_func, this);
+  }
+
+  ~cache() {
+    // flush anything still queued before going away.
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_shutdown = true;
+    }
+    m_cond.notify_one();
+    m_writer.join();
+  }
+
+  void lookup(std::unique_ptr<request> &req) {
+    boost::optional<cache_entry> pending_refresh;
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto itr = m_pending.find(req->url);
+      if (itr != m_pending.end()) {
+        if (itr->second.has_body) {
+          req->cached = itr->second.entry;
+          return;
+        }
+        pending_refresh = itr->second.entry;
+      }
+    }
+
+    boost::optional<std::time_t> last_access;
+    {
+      reader_lease r(*this);
+      sqlite::statement &s = r->select;
+      s.reset();
+      s.bind_text(1, req->url);
+
+      if (s.step()) {
+        cache_entry entry;
+        entry.expires = s.column_time(0);
+        entry.last_modified = s.column_time(1);
+        entry.etag = s.column_text(2);
+        entry.not_found = (s.column_int64(5) != 0);
+        if (!entry.not_found) {
+          std::string body;
+          s.column_blob(3, body);
+          entry.body = std::make_shared<const std::string>(std::move(body));
+        }
+        last_access = s.column_time(4);
+        req->cached = std::move(entry);
+      }
+      s.reset();
+    }
+
+    if (req->cached) {
+      if (pending_refresh) {
+        req->cached->expires = pending_refresh->expires;
+        req->cached->last_modified = pending_refresh->last_modified;
+        req->cached->etag = pending_refresh->etag;
+      }
+
+      const std::time_t now = time(nullptr);
+      if (!last_access || (now - *last_access) >= CACHE_TOUCH_INTERVAL) {
+        operation op;
+        op.type = operation::touch;
+        op.url = req->url;
+        op.access = now;
+        enqueue(std::move(op));
+      }
+    }
+  }
+
+  // note: the request's expiry must already have been normalised.
+  void write(request *req, body_ptr body) {
+    operation op;
+    op.type = operation::insert;
+    op.url = req->url;
+    op.entry.expires = req->expires;
+    op.entry.last_modified = req->last_modified;
+    op.entry.etag = req->etag;
+    op.entry.body = std::move(body);
+    op.access = time(nullptr);
+    enqueue(std::move(op));
+  }
+
+  // remember that the origin doesn't have the tile, until expires.
+  void write_not_found(const std::string &url, std::time_t expires) {
+    operation op;
+    op.type = operation::insert;
+    op.url = url;
+    op.entry.expires = expires;
+    op.entry.not_found = true;
+    op.access = time(nullptr);
+    enqueue(std::move(op));
+  }
+
+  // update the expiry and validators of an entry which the origin
+  // has confirmed is still current, without re-writing the body.
+  void refresh(request *req) {
+    operation op;
+    op.type = operation::refresh;
+    op.url = req->url;
+    op.entry.expires = req->expires;
+    op.entry.last_modified = req->last_modified;
+    op.entry.etag = req->etag;
+    op.access = time(nullptr);
+    enqueue(std::move(op));
+  }
 
-    // ensure that the table for the cache data exists
+private:
+  // a connection used for lookups, and its prepared statement.
+  struct reader {
+    explicit reader(const std::string &loc)
+      : db(loc),
+        select(db.prepare("select expires, last_modified, etag, body, last_access, not_found from cache where url=?")) {
+    }
+
+    // note: declared before the statement, so that the statement is
+    // finalized before the database is closed.
+    sqlite::db db;
+    sqlite::statement select;
+  };
+
+  // borrows a reader for the duration of a lookup, handing it back
+  // to the pool afterwards - even if the lookup throws.
+  struct reader_lease {
+    explicit reader_lease(cache &c) : m_cache(c), m_reader(c.borrow_reader()) {}
+    ~reader_lease() { m_cache.hand_back(std::move(m_reader)); }
+    reader *operator->() { return m_reader.get(); }
+
+  private:
+    cache &m_cache;
+    std::unique_ptr<reader> m_reader;
+  };
+
+  // a write waiting to be applied by the writer thread.
+  struct operation {
+    enum type_t { insert, refresh, touch } type;
+    std::string url;
+    // body is only used for inserts, and none of the entry is used
+    // for touches.
+    cache_entry entry;
+    std::time_t access;
+    uint64_t sequence;
+  };
+
+  // the most recent uncommitted insert or refresh of a URL. when it
+  // was a refresh, only the metadata in the entry is valid.
+  struct pending {
+    cache_entry entry;
+    bool has_body;
+    uint64_t sequence;
+  };
+
+  void create_schema() {
     sqlite::statement s(m_db->prepare("SELECT name FROM sqlite_master WHERE type='table' AND name='cache'"));
     if (!s.step()) {
       // table doesn't exist, so create it
-      m_db->prepare("CREATE TABLE cache (url TEXT PRIMARY KEY, expires INTEGER, last_modified INTEGER, etag TEXT, body BLOB)").step();
+      m_db->exec("CREATE TABLE cache (url TEXT PRIMARY KEY, expires INTEGER, last_modified INTEGER, etag TEXT, body BLOB, size INTEGER, last_access INTEGER, not_found INTEGER NOT NULL DEFAULT 0)");
+
+    } else {
+      // caches created by older versions don't have the columns
+      // needed for eviction, so add them and fill them in.
+      bool has_size = false, has_not_found = false;
+      {
+        sqlite::statement info(m_db->prepare("PRAGMA table_info(cache)"));
+        while (info.step()) {
+          boost::optional<std::string> name = info.column_text(1);
+          if (name && (*name == "size")) { has_size = true; }
+          if (name && (*name == "not_found")) { has_not_found = true; }
+        }
+      }
+
+      if (!has_size) {
+        m_db->exec("BEGIN");
+        m_db->exec("ALTER TABLE cache ADD COLUMN size INTEGER");
+        m_db->exec("ALTER TABLE cache ADD COLUMN last_access INTEGER");
+        m_db->exec((boost::format("UPDATE cache SET size=length(body), last_access=%1%") % sqlite3_int64(time(nullptr))).str());
+        m_db->exec("COMMIT");
+      }
+
+      // nor the flag for cached "not found" responses.
+      if (!has_not_found) {
+        m_db->exec("ALTER TABLE cache ADD COLUMN not_found INTEGER NOT NULL DEFAULT 0");
+      }
     }
+
+    m_db->exec("CREATE INDEX IF NOT EXISTS cache_last_access ON cache (last_access)");
   }
 
-  void lookup(std::unique_ptr<request> &req) {
-    sqlite::statement s(m_db->prepare("select expires, last_modified, etag, body from cache where url=?"));
-    s.bind_text(1, req->url);
+  std::unique_ptr<reader> borrow_reader() {
+    {
+      std::lock_guard<std::mutex> lock(m_readers_mutex);
+      if (!m_readers.empty()) {
+        std::unique_ptr<reader> r = std::move(m_readers.back());
+        m_readers.pop_back();
+        return r;
+      }
+    }
+
+    // none free, so open another connection. there's one of these
+    // for each thread which has concurrently looked something up.
+    return std::unique_ptr<reader>(new reader(m_location));
+  }
+
+  void hand_back(std::unique_ptr<reader> &&r) {
+    std::lock_guard<std::mutex> lock(m_readers_mutex);
+    m_readers.push_back(std::move(r));
+  }
 
-    if (s.step()) {
-      req->expires = s.column_time(0);
-      req->last_modified = s.column_time(1);
-      req->etag = s.column_text(2);
-      s.column_blob(3, *(req->stream));
+  void enqueue(operation &&op) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      op.sequence = ++m_sequence;
+
+      if (op.type == operation::insert) {
+        pending &p = m_pending[op.url];
+        p.entry = op.entry;
+        p.has_body = true;
+        p.sequence = op.sequence;
+
+      } else if (op.type == operation::refresh) {
+        // keep the body of a pending insert, if there is one.
+        auto itr = m_pending.find(op.url);
+        if (itr == m_pending.end()) {
+          itr = m_pending.insert(std::make_pair(op.url, pending())).first;
+          itr->second.has_body = false;
+        }
+        itr->second.entry.expires = op.entry.expires;
+        itr->second.entry.last_modified = op.entry.last_modified;
+        itr->second.entry.etag = op.entry.etag;
+        itr->second.sequence = op.sequence;
+      }
+
+      m_queue.push_back(std::move(op));
     }
+    m_cond.notify_one();
   }
 
-  void write(request *req) {
-    // first, normalise the request by collapsing any Cache-control / Expires headers.
-    if (req->max_age) {
-      req->expires = time(nullptr) + *req->max_age;
+  void writer_func() {
+    while (true) {
+      std::deque<operation> batch;
+
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this]() { return m_shutdown || !m_queue.empty(); });
+        if (m_queue.empty()) {
+          break;
+        }
+        // take everything which queued up while the last batch was
+        // being written.
+        batch.swap(m_queue);
+      }
+
+      try {
+        m_db->exec("BEGIN");
+        for (operation &op : batch) {
+          apply(op);
+        }
+        evict();
+        m_db->exec("COMMIT");
 
-    } else if (bool(req->expires) && bool(req->base_date)) {
-      req->expires = time(nullptr) + (*req->expires - *req->base_date);
+      } catch (const std::exception &e) {
+        // TODO: use logger
+        std::cerr << "Unable to write to tile cache: " << e.what() << "\n" << std::flush;
+        try {
+          m_db->exec("ROLLBACK");
+        } catch (...) {
+        }
+        // the running total may now be wrong, so re-read it.
+        resync_total();
+      }
+
+      // the batch is now visible to readers (or lost), so stop
+      // overlaying it - unless it has been superseded in the mean
+      // time.
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for (const operation &op : batch) {
+        auto itr = m_pending.find(op.url);
+        if ((itr != m_pending.end()) && (itr->second.sequence == op.sequence)) {
+          m_pending.erase(itr);
+        }
+      }
+    }
+  }
+
+  void apply(operation &op) {
+    if (op.type == operation::insert) {
+      m_size_of->reset();
+      m_size_of->bind_text(1, op.url);
+      if (m_size_of->step()) {
+        m_total_bytes -= m_size_of->column_int64(0);
+      }
+      m_size_of->reset();
+
+      // entries for missing tiles have no body, but still take up
+      // some space, so count them as the size of the URL to make sure
+      // they're evicted eventually.
+      const sqlite3_int64 size = op.entry.not_found ? op.url.size() : op.entry.body->size();
+      m_insert->reset();
+      m_insert->bind_text(1, op.url);
+      m_insert->bind_time(2, op.entry.expires);
+      m_insert->bind_time(3, op.entry.last_modified);
+      m_insert->bind_text(4, op.entry.etag);
+      // the operation holds on to the body until the statement has
+      // been reset, so it can be bound without a copy.
+      if (op.entry.body) {
+        m_insert->bind_blob(5, *op.entry.body);
+      }
+      m_insert->bind_int64(6, size);
+      m_insert->bind_time(7, op.access);
+      m_insert->bind_int64(8, op.entry.not_found ? 1 : 0);
+      m_insert->step();
+      m_insert->reset();
+      m_total_bytes += size;
+
+    } else if (op.type == operation::refresh) {
+      m_refresh->reset();
+      m_refresh->bind_time(1, op.entry.expires);
+      m_refresh->bind_time(2, op.entry.last_modified);
+      m_refresh->bind_text(3, op.entry.etag);
+      m_refresh->bind_time(4, op.access);
+      m_refresh->bind_text(5, op.url);
+      m_refresh->step();
+      m_refresh->reset();
 
     } else {
-      req->expires = boost::none;
+      m_touch->reset();
+      m_touch->bind_time(1, op.access);
+      m_touch->bind_text(2, op.url);
+      m_touch->step();
+      m_touch->reset();
     }
+  }
 
-    sqlite::statement s(m_db->prepare("insert or replace into cache (url, expires, last_modified, etag, body) values (?, ?, ?, ?, ?)"));
-    s.bind_text(1, req->url);
-    s.bind_time(2, req->expires);
-    s.bind_time(3, req->last_modified);
-    s.bind_text(4, req->etag);
-    s.bind_blob(5, *(req->stream));
-    s.step();
+  // delete least recently used entries until the cache is under 90%
+  // of its maximum size, so that eviction doesn't happen on every
+  // single write once the cache is full.
+  void evict() {
+    if ((m_max_bytes == 0) || (m_total_bytes <= sqlite3_int64(m_max_bytes))) {
+      return;
+    }
+
+    const sqlite3_int64 low_water = sqlite3_int64(m_max_bytes) / 10 * 9;
+
+    while (m_total_bytes > low_water) {
+      std::vector<std::pair<std::string, sqlite3_int64> > victims;
+      m_oldest->reset();
+      m_oldest->bind_int64(1, CACHE_EVICT_CHUNK);
+      while (m_oldest->step()) {
+        victims.push_back(std::make_pair(*m_oldest->column_text(0), m_oldest->column_int64(1)));
+      }
+      m_oldest->reset();
+
+      if (victims.empty()) {
+        break;
+      }
+
+      for (const auto &victim : victims) {
+        if (m_total_bytes <= low_water) {
+          break;
+        }
+        m_delete->reset();
+        m_delete->bind_text(1, victim.first);
+        m_delete->step();
+        m_delete->reset();
+        m_total_bytes -= victim.second;
+      }
+    }
   }
 
-private:
+  void resync_total() {
+    try {
+      sqlite::statement total(m_db->prepare("select coalesce(sum(size), 0) from cache"));
+      if (total.step()) {
+        m_total_bytes = total.column_int64(0);
+      }
+    } catch (...) {
+    }
+  }
+
+  const std::string m_location;
+  const std::size_t m_max_bytes;
+
+  std::mutex m_readers_mutex;
+  std::vector<std::unique_ptr<reader> > m_readers;
+
+  // the writer's connection and statements, only used by the writer
+  // thread once it has started. note: the database is declared first
+  // so that it's closed after the statements are finalized.
   std::unique_ptr<sqlite::db> m_db;
+  std::unique_ptr<sqlite::statement> m_insert, m_refresh, m_touch, m_size_of, m_oldest, m_delete;
+  sqlite3_int64 m_total_bytes;
+
+  // protects the queue, pending map and shutdown flag.
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  std::deque<operation> m_queue;
+  std::unordered_map<std::string, pending> m_pending;
+  uint64_t m_sequence;
+  bool m_shutdown;
+
+  std::thread m_writer;
 };
 
 #else /* HAVE_SQLITE3 */
 struct cache {
-  cache(const std::string &) { not_implemented(); }
+  cache(const std::string &, std::size_t) { not_implemented(); }
   void lookup(std::unique_ptr<request> &req) { not_implemented(); }
-  void write(request *req) { not_implemented(); }
+  void write(request *req, body_ptr body) { not_implemented(); }
+  void write_not_found(const std::string &url, std::time_t expires) { not_implemented(); }
+  void refresh(request *req) { not_implemented(); }
   void not_implemented() const { 
     throw std::runtime_error("Caching is not implemented because avecado was built without SQLite3 support.");
   }
@@ -421,116 +1166,387 @@ struct cache {
 } // anonymous namespace
 
 struct http::impl {
-  impl(std::vector<std::string> &&patterns);
+  impl(std::vector<std::string> &&patterns, const http_options &options);
   ~impl();
 
-  void start_request(std::promise<fetch_response> &&promise, const avecado::request &r);
+  void start_request(fetch_callback &&callback, const avecado::request &r);
+  void start_requests(const std::vector<avecado::request> &rs, std::vector<fetch_callback> &&callbacks);
 
-  void enable_cache(const std::string &cache_location);
+  void enable_cache(const std::string &cache_location, std::size_t max_bytes);
   void disable_cache();
+  void enable_memory_cache(std::size_t max_bytes);
+  void disable_memory_cache();
+  memory_cache_stats get_memory_cache_stats() const;
+  std::size_t background_refreshes() const { return m_background_refreshes.load(); }
 
 private:
+  // answer the request from the memory or local cache, if possible,
+  // otherwise return it to be sent to the origin.
+  std::unique_ptr<request> answer_locally(fetch_callback &&callback, const avecado::request &r);
+  // add the request to those for the curl thread to start, or to the
+  // waiters on the same URL. must be called with m_mutex held, and
+  // returns true if the curl thread needs waking.
+  bool queue_request(std::unique_ptr<request> &&req);
   void thread_func();
-  void run_curl_multi(CURLM *curl_multi, int *running_handles);
-  void perform_multi(CURLM *curl_multi, int *running_handles);
+  void add_new_requests();
+  void socket_action(curl_socket_t fd, int ev_bitmask);
+  void check_multi_info();
+  void wakeup();
+  int epoll_timeout() const;
+  static int socket_callback(CURL *curl, curl_socket_t fd, int what, void *userp, void *socketp);
+  static int timer_callback(CURLM *multi, long timeout_ms, void *userp);
   void handle_response(CURLcode res, CURL *curl);
+  // retrying failed requests after a delay.
+  void schedule_retry(request *req);
+  void start_due_retries();
+  // hedging slow requests with a duplicate on another host.
+  void start_due_hedges();
+  void record_latency(std::chrono::steady_clock::duration latency);
+  void dequeue_hedge(request *req);
+  // stop and delete the partner of a request.
+  void cancel(request *req);
+  // move the callbacks of one of a pair of hedged requests over to the
+  // other, so that it can answer them.
+  void take_over(request *from, request *to);
+  void start_transfer(request *req);
+  // call the callbacks of the request, and any waiting on it, with
+  // the response and then delete the request.
+  void finish(request *req, fetch_response &&response);
+  // decode the body and then finish the request, on the decode pool
+  // if there is one. the request mustn't be used by the curl thread
+  // after this.
+  void decode_and_finish(request *req, body_ptr body, bool remember_tile);
+  void host_succeeded(unsigned int host);
+  void host_failed(unsigned int host);
+  bool host_ejected(unsigned int host) const;
   void free_handle(CURL *curl);
   CURL *new_handle();
   boost::optional<fetch_result> new_request(CURL *curl, request *r);
-  std::string url_for(unsigned int z, unsigned int x, unsigned int y) const;
-  bool setup_response_tile(fetch_response &response, std::unique_ptr<std::stringstream> &stream, unsigned int z, unsigned int x, unsigned int y);
-
-  const std::vector<std::string> m_url_patterns;
+  void url_for(unsigned int host, unsigned int z, unsigned int x, unsigned int y, std::string &out) const;
+  bool setup_response_tile(fetch_response &response, const std::string &body, unsigned int z, unsigned int x, unsigned int y);
+  // if the memory cache is enabled, share the decoded tile in the
+  // response with it.
+  void remember(const std::string &url, fetch_response &response, boost::optional<std::time_t> expires);
+  // remember that the origin doesn't have the tile.
+  void remember_not_found(const std::string &url);
+
+  // the URL patterns, parsed once up-front.
+  const std::vector<url_template> m_url_templates;
+  const http_options m_options;
+  // health of each host (URL pattern), only used from the curl thread.
+  struct host_health {
+    host_health() : failures(0) {}
+    unsigned int failures;
+    std::chrono::steady_clock::time_point ejected_until;
+  };
+  std::vector<host_health> m_hosts;
   std::atomic<bool> m_shutdown;
   std::thread m_thread;
-  curl_slist *custom_headers;
+  // the curl multi handle and the epoll set of sockets which it is
+  // waiting on are only used from the curl thread, except for the
+  // eventfd, which is written by other threads to wake it up when
+  // there are new requests.
+  CURLM *m_multi;
+  int m_epoll_fd;
+  int m_wakeup_fd;
+  int m_running_handles;
+  // when curl next wants to be called because of a timeout, if at all.
+  boost::optional<std::chrono::steady_clock::time_point> m_deadline;
   std::mutex m_mutex;
   std::list<std::unique_ptr<request> > m_new_requests;
+  // requests which have been sent to the curl thread, by URL, so that
+  // callers asking for the same URL can wait on them instead of
+  // starting another transfer. protected by m_mutex.
+  std::unordered_map<std::string, request *> m_in_flight;
   std::queue<CURL*> m_handle_pool;
-  // note: m_cache is *shared* between threads, so it *must* be thread-safe
+  // requests waiting to be retried, by the time they are due, and
+  // the source of the jitter in the delays. only used from the curl
+  // thread.
+  std::multimap<std::chrono::steady_clock::time_point, request *> m_retries;
+  std::minstd_rand m_random;
+  // requests which may need hedging, oldest first, recent latencies
+  // of successful requests, and the latency after which to hedge, if
+  // enough is known. only used from the curl thread.
+  std::list<request *> m_hedge_queue;
+  std::vector<std::chrono::steady_clock::duration> m_latencies;
+  std::size_t m_latency_pos;
+  boost::optional<std::chrono::steady_clock::duration> m_hedge_after;
+  // note: m_cache is *shared* between threads, so it *must* be thread-safe.
+  // it can also be swapped out while the curl thread is running, so is
+  // only accessed through std::atomic_load / std::atomic_store.
   std::shared_ptr<cache> m_cache;
+  // likewise for the memory cache.
+  std::shared_ptr<memory_cache> m_memory_cache;
+  missing_tiles m_missing;
+  // null if tiles are decoded on the curl thread.
+  std::unique_ptr<decode_pool> m_decoders;
+  // number of background refreshes which have finished.
+  std::atomic<std::size_t> m_background_refreshes;
 };
 
-http::impl::impl(std::vector<std::string> &&patterns)
-  : m_url_patterns(patterns)
+http::impl::impl(std::vector<std::string> &&patterns, const http_options &options)
+  : m_url_templates(patterns.begin(), patterns.end())
+  , m_options(options)
+  , m_hosts(m_url_templates.size())
   , m_shutdown(false)
-  , m_thread(&impl::thread_func, this)
-  , custom_headers(nullptr) {
+  , m_thread()
+  , m_multi(nullptr)
+  , m_epoll_fd(-1)
+  , m_wakeup_fd(-1)
+  , m_running_handles(0)
+  , m_random(std::random_device()())
+  , m_latency_pos(0)
+  , m_background_refreshes(0) {
+
+  m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (m_epoll_fd < 0) {
+    throw std::runtime_error((boost::format("Unable to create epoll instance: %1%") % strerror(errno)).str());
+  }
+
+  m_wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (m_wakeup_fd < 0) {
+    int err = errno;
+    close(m_epoll_fd);
+    throw std::runtime_error((boost::format("Unable to create eventfd: %1%") % strerror(err)).str());
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = m_wakeup_fd;
+  if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup_fd, &ev) < 0) {
+    int err = errno;
+    close(m_wakeup_fd);
+    close(m_epoll_fd);
+    throw std::runtime_error((boost::format("Unable to add eventfd to epoll set: %1%") % strerror(err)).str());
+  }
+
+  m_multi = curl_multi_init();
+  curl_multi_setopt(m_multi, CURLMOPT_SOCKETFUNCTION, &impl::socket_callback);
+  curl_multi_setopt(m_multi, CURLMOPT_SOCKETDATA, this);
+  curl_multi_setopt(m_multi, CURLMOPT_TIMERFUNCTION, &impl::timer_callback);
+  curl_multi_setopt(m_multi, CURLMOPT_TIMERDATA, this);
+
+  // connections belong to the multi handle, so the size of its cache
+  // is what limits the number kept alive.
+  curl_multi_setopt(m_multi, CURLMOPT_MAXCONNECTS, long(m_options.handle_pool_size));
+  curl_multi_setopt(m_multi, CURLMOPT_MAX_HOST_CONNECTIONS, m_options.max_host_connections);
+  curl_multi_setopt(m_multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, m_options.max_total_connections);
+#ifdef CURL_CAN_MULTIPLEX
+  curl_multi_setopt(m_multi, CURLMOPT_PIPELINING, m_options.multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+#endif
+
+  if (m_options.decode_threads > 0) {
+    m_decoders.reset(new decode_pool(m_options.decode_threads));
+  }
+
+  // start the thread last, once everything it uses has been set up.
+  m_thread = std::thread(&impl::thread_func, this);
 }
 
 http::impl::~impl() {
   m_shutdown.store(true);
+  wakeup();
   m_thread.join();
-  curl_slist_free_all(custom_headers);
+  // the last responses may still be being decoded, and finishing
+  // them needs the rest of this object.
+  m_decoders.reset();
+  curl_multi_cleanup(m_multi);
+  close(m_wakeup_fd);
+  close(m_epoll_fd);
+}
+
+void http::impl::start_request(fetch_callback &&callback, const avecado::request &r) {
+  std::unique_ptr<request> req = answer_locally(std::move(callback), r);
+  if (!req) {
+    return;
+  }
+
+  bool wake = false;
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    wake = queue_request(std::move(req));
+  }
+  if (wake) {
+    wakeup();
+  }
 }
 
-void http::impl::start_request(std::promise<fetch_response> &&promise, const avecado::request &r) {
+void http::impl::start_requests(const std::vector<avecado::request> &rs, std::vector<fetch_callback> &&callbacks) {
+  std::vector<std::unique_ptr<request> > reqs;
+  reqs.reserve(rs.size());
+  for (std::size_t i = 0; i < rs.size(); ++i) {
+    std::unique_ptr<request> req = answer_locally(std::move(callbacks[i]), rs[i]);
+    if (req) {
+      reqs.emplace_back(std::move(req));
+    }
+  }
+
+  if (reqs.empty()) {
+    return;
+  }
+
+  // the whole batch is handed over to the curl thread at once, with
+  // one lock and at most one wake-up.
+  bool wake = false;
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (auto &req : reqs) {
+      wake |= queue_request(std::move(req));
+    }
+  }
+  if (wake) {
+    wakeup();
+  }
+}
+
+std::unique_ptr<request> http::impl::answer_locally(fetch_callback &&callback, const avecado::request &r) {
   if ((r.z < 0) || (r.x < 0) || (r.y < 0)) {
     fetch_result err;
     err.status = fetch_status::not_found;
     fetch_response response(err);
-    promise.set_value(std::move(response));
-
-  } else {
-    std::unique_ptr<request> req(new request(std::move(promise), r, url_for(r.z, r.x, r.y)));
+    callback(std::move(response));
+    return std::unique_ptr<request>();
+  }
 
-    if (m_cache) {
-      m_cache->lookup(req);
+  // the first pattern is always used for the cache key, so that the
+  // tile is cached in the same place whichever host it came from.
+  std::string url;
+  url_for(0, r.z, r.x, r.y, url);
+
+  // decoded tiles in memory are checked first, as they need
+  // neither I/O nor parsing.
+  std::shared_ptr<memory_cache> mc = std::atomic_load(&m_memory_cache);
+  if (mc) {
+    memory_cache::tile_data data = mc->get(url);
+    if (data) {
+      std::unique_ptr<tile> ptr(new tile(r.z, r.x, r.y, std::move(data)));
+      callback(fetch_response(std::move(ptr)));
+      return std::unique_ptr<request>();
     }
+  }
 
-    if (req->expired()) {
-      std::unique_lock<std::mutex> lock(m_mutex);
-      m_new_requests.emplace_back(std::move(req));
+  // as are tiles which are known not to exist.
+  if (m_missing.contains(url)) {
+    fetch_result err;
+    err.status = fetch_status::not_found;
+    callback(fetch_response(err));
+    return std::unique_ptr<request>();
+  }
 
-    } else {
+  std::unique_ptr<request> req(new request(std::move(callback), r, std::move(url)));
+  req->hosts = rank_hosts(m_url_templates.size(), r.z, r.x, r.y);
+
+  std::shared_ptr<cache> c = std::atomic_load(&m_cache);
+  if (c) {
+    c->lookup(req);
+  }
+
+  if (req->expired()) {
+    // an entry which expired only recently is served straight away,
+    // and refreshed in the background by a request without a
+    // callback. conditional requests always go to the origin, as
+    // their answer depends on the caller's validators.
+    if (req->cached && req->shareable() &&
+        req->cached->usable_stale(m_options.stale_while_revalidate_seconds)) {
       fetch_result err;
       err.status = fetch_status::server_error;
       fetch_response response(err);
 
-      setup_response_tile(response, req->stream, r.z, r.x, r.y);
+      setup_response_tile(response, *req->cached->body, r.z, r.x, r.y);
+      req->callback(std::move(response));
+      req->callback = fetch_callback();
+    }
+    return req;
+
+  } else if (req->cached->not_found) {
+    // keep it in memory too, so the next lookup is quicker.
+    m_missing.insert(req->url, *req->cached->expires);
+
+    fetch_result err;
+    err.status = fetch_status::not_found;
+    req->callback(fetch_response(err));
+
+  } else {
+    fetch_result err;
+    err.status = fetch_status::server_error;
+    fetch_response response(err);
+
+    setup_response_tile(response, *req->cached->body, r.z, r.x, r.y);
+    remember(req->url, response, req->cached->expires);
+
+    req->callback(std::move(response));
+  }
+
+  return std::unique_ptr<request>();
+}
 
-      req->promise.set_value(std::move(response));
+bool http::impl::queue_request(std::unique_ptr<request> &&req) {
+  // if the URL is already being fetched, then wait for that
+  // transfer rather than starting another.
+  if (req->shareable()) {
+    auto itr = m_in_flight.find(req->url);
+    if (itr != m_in_flight.end()) {
+      // a background refresh has nobody to answer, so there's nothing
+      // to wait for.
+      if (!req->callback) {
+        return false;
+      }
+      waiter w = { std::move(req->callback), req->z, req->x, req->y };
+      itr->second->waiters.emplace_back(std::move(w));
+      return false;
     }
+    m_in_flight.insert(std::make_pair(req->url, req.get()));
+    req->in_flight = true;
   }
+
+  // the curl thread only needs waking when the list goes from
+  // empty to non-empty, as it takes the whole list at once.
+  const bool was_empty = m_new_requests.empty();
+  m_new_requests.emplace_back(std::move(req));
+  return was_empty;
 }
 
 void http::impl::thread_func() {
-  CURLM *curl_multi = curl_multi_init();
-  int running_handles = 0;
+  struct epoll_event events[MAX_EPOLL_EVENTS];
 
-  while (m_shutdown.load() == false) {
-    std::list<std::unique_ptr<request> > requests;
-    {
-      std::unique_lock<std::mutex> lock(m_mutex);
-      requests.swap(m_new_requests);
+  // keep going after shutdown until the requests in flight have
+  // finished, so that their callbacks are all called.
+  while ((m_shutdown.load() == false) || (m_running_handles > 0) || !m_retries.empty()) {
+    add_new_requests();
+    start_due_retries();
+    start_due_hedges();
+
+    int num_events = epoll_wait(m_epoll_fd, events, MAX_EPOLL_EVENTS, epoll_timeout());
+    if ((num_events < 0) && (errno != EINTR)) {
+      // TODO: better error handling & reporting
+      std::cerr << "Error in epoll_wait: " << strerror(errno) << "\n" << std::flush;
     }
 
-    bool added = false;
-    for (auto &ptr : requests) {
-      request *req = ptr.release();
-      CURL *curl = new_handle();
-      boost::optional<fetch_result> err = new_request(curl, req);
+    for (int i = 0; i < num_events; ++i) {
+      const struct epoll_event &ev = events[i];
 
-      if (err) {
-        req->promise.set_value(fetch_response(*err));
-        delete req;
-        free_handle(curl);
+      if (ev.data.fd == m_wakeup_fd) {
+        // reset the eventfd counter, the new requests are picked
+        // up at the top of the loop.
+        uint64_t count = 0;
+        ssize_t ignored = read(m_wakeup_fd, &count, sizeof count);
+        (void)ignored;
 
       } else {
-        curl_multi_add_handle(curl_multi, curl);
-        added = true;
+        int ev_bitmask = 0;
+        if (ev.events & EPOLLIN)  { ev_bitmask |= CURL_CSELECT_IN; }
+        if (ev.events & EPOLLOUT) { ev_bitmask |= CURL_CSELECT_OUT; }
+        if (ev.events & (EPOLLERR | EPOLLHUP)) { ev_bitmask |= CURL_CSELECT_ERR; }
+        socket_action(ev.data.fd, ev_bitmask);
       }
     }
 
-    if (added) {
-      perform_multi(curl_multi, &running_handles);
+    if (m_deadline && (*m_deadline <= std::chrono::steady_clock::now())) {
+      m_deadline = boost::none;
+      socket_action(CURL_SOCKET_TIMEOUT, 0);
     }
 
-    run_curl_multi(curl_multi, &running_handles);
-  }
-
-  while (running_handles > 0) {
-    run_curl_multi(curl_multi, &running_handles);
+    check_multi_info();
   }
 
   while (!m_handle_pool.empty()) {
@@ -538,75 +1554,150 @@ void http::impl::thread_func() {
     m_handle_pool.pop();
     curl_easy_cleanup(curl);
   }
+}
+
+void http::impl::add_new_requests() {
+  std::list<std::unique_ptr<request> > requests;
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    requests.swap(m_new_requests);
+  }
 
-  curl_multi_cleanup(curl_multi);
+  for (auto &ptr : requests) {
+    start_transfer(ptr.release());
+  }
 }
 
-void http::impl::run_curl_multi(CURLM *curl_multi, int *running_handles) {
-  struct timeval timeout;
-  long timeout_ms = 0;
+void http::impl::start_transfer(request *req) {
+  CURL *curl = new_handle();
+  boost::optional<fetch_result> err = new_request(curl, req);
 
-  curl_multi_timeout(curl_multi, &timeout_ms);
-  if (timeout_ms < 0) {
-    // no curl timeout, so set a default
-    timeout.tv_sec = 0L;
-    timeout.tv_usec = 100000L;
+  if (err) {
+    free_handle(curl);
+    if (req->partner) {
+      // leave the partner to answer.
+      request *other = req->partner;
+      other->partner = nullptr;
+      if (!req->is_hedge) { take_over(req, other); }
+      delete req;
+
+    } else {
+      finish(req, fetch_response(*err));
+    }
 
   } else {
-    timeout.tv_sec = timeout_ms / 1000L;
-    timeout.tv_usec = (timeout_ms % 1000L) * 1000L;
+    // this will call the timer callback, asking for the new
+    // transfer to be kicked off as soon as possible. curl won't
+    // count it as running until then, so count it now to stop the
+    // thread exiting during shutdown.
+    curl_multi_add_handle(m_multi, curl);
+    ++m_running_handles;
   }
+}
 
-  int bits_set = 0;
-  if (timeout_ms != 0) {
-    int max_fd = 0;
-    fd_set read_fd_set, write_fd_set, exc_fd_set;
+void http::impl::socket_action(curl_socket_t fd, int ev_bitmask) {
+  CURLMcode res = curl_multi_socket_action(m_multi, fd, ev_bitmask, &m_running_handles);
+  if (res != CURLM_OK) {
+    // TODO: better error handling & reporting
+    std::cerr << "Error in curl_multi_socket_action: " << curl_multi_strerror(res) << "\n" << std::flush;
+  }
+}
 
-    FD_ZERO(&read_fd_set);
-    FD_ZERO(&write_fd_set);
-    FD_ZERO(&exc_fd_set);
+void http::impl::check_multi_info() {
+  int msgs_in_queue = 0;
+  CURLMsg *msg = nullptr;
+
+  while ((msg = curl_multi_info_read(m_multi, &msgs_in_queue)) != nullptr) {
+    if (msg->msg == CURLMSG_DONE) {
+      CURL *curl = msg->easy_handle;
+      CURLcode result = msg->data.result;
+      curl_multi_remove_handle(m_multi, curl);
+      handle_response(result, curl);
+      free_handle(curl);
+    }
+  }
+}
 
-    CURLMcode res = curl_multi_fdset(curl_multi, &read_fd_set, &write_fd_set, &exc_fd_set, &max_fd);
-    if (res != CURLM_OK) {
-      // TODO: better error handling & reporting
-      std::cerr << "Error in curl_multi_fdset.\n" << std::flush;
+void http::impl::wakeup() {
+  uint64_t one = 1;
+  ssize_t written = write(m_wakeup_fd, &one, sizeof one);
+  // a failure with EAGAIN means the counter is saturated, which can
+  // only happen if the thread already has a wakeup pending.
+  if ((written < 0) && (errno != EAGAIN)) {
+    std::cerr << "Unable to wake up curl thread: " << strerror(errno) << "\n" << std::flush;
+  }
+}
 
-    } else {
-      if (max_fd > 0) {
-        bits_set = select(max_fd + 1, &read_fd_set, &write_fd_set, &exc_fd_set, &timeout);
+int http::impl::epoll_timeout() const {
+  // wake up for whichever is soonest of curl's own timeout, the next
+  // retry and the next request which might need hedging.
+  boost::optional<std::chrono::steady_clock::time_point> deadline = m_deadline;
+  if (!m_retries.empty()) {
+    auto due = m_retries.begin()->first;
+    if (!deadline || (due < *deadline)) { deadline = due; }
+  }
+  if (m_hedge_after && !m_hedge_queue.empty()) {
+    auto due = m_hedge_queue.front()->started + *m_hedge_after;
+    if (!deadline || (due < *deadline)) { deadline = due; }
+  }
 
-        // TODO: handle this error better...
-        if (bits_set < 0) {
-          std::cerr << "Error in select: " << strerror(errno) << "\n" << std::flush;
-        }
-      }
-    }
+  if (!deadline) {
+    // nothing to do until there's socket activity or new requests,
+    // so wait indefinitely.
+    return -1;
   }
 
-  perform_multi(curl_multi, running_handles);
+  // round up, so as not to wake up just before the deadline.
+  auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+    *deadline - std::chrono::steady_clock::now() + std::chrono::microseconds(999)).count();
+  return (remaining > 0) ? int(remaining) : 0;
 }
 
-void http::impl::perform_multi(CURLM *curl_multi, int *running_handles) {
-  int msgs_in_queue = 0;
-  CURLMcode res = CURLM_OK;
-  bool any_done = false;
+int http::impl::socket_callback(CURL *, curl_socket_t fd, int what, void *userp, void *socketp) {
+  impl *self = static_cast<impl *>(userp);
 
-  do {
-    do {
-      res = curl_multi_perform(curl_multi, running_handles);
-    } while (res == CURLM_CALL_MULTI_PERFORM);
+  if (what == CURL_POLL_REMOVE) {
+    // the socket may already have been closed, which removes it from
+    // the epoll set anyway, so errors are expected here.
+    epoll_ctl(self->m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    curl_multi_assign(self->m_multi, fd, nullptr);
 
-    CURLMsg *msg = nullptr;
-    any_done = false;
-    while ((msg = curl_multi_info_read(curl_multi, &msgs_in_queue)) != nullptr) {
-      if (msg->msg == CURLMSG_DONE) {
-        handle_response(msg->data.result, msg->easy_handle);
-        curl_multi_remove_handle(curl_multi, msg->easy_handle);
-        free_handle(msg->easy_handle);
-        any_done = true;
+  } else {
+    struct epoll_event ev;
+    ev.events = 0;
+    if (what & CURL_POLL_IN)  { ev.events |= EPOLLIN; }
+    if (what & CURL_POLL_OUT) { ev.events |= EPOLLOUT; }
+    ev.data.fd = fd;
+
+    // curl lets us associate a pointer with the socket, which is
+    // used here just to remember whether the socket is in the set.
+    if (socketp == nullptr) {
+      if (epoll_ctl(self->m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        std::cerr << "Unable to add socket to epoll set: " << strerror(errno) << "\n" << std::flush;
+        return -1;
       }
+      curl_multi_assign(self->m_multi, fd, self);
+
+    } else if (epoll_ctl(self->m_epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+      std::cerr << "Unable to modify socket in epoll set: " << strerror(errno) << "\n" << std::flush;
+      return -1;
     }
-  } while (any_done);
+  }
+
+  return 0;
+}
+
+int http::impl::timer_callback(CURLM *, long timeout_ms, void *userp) {
+  impl *self = static_cast<impl *>(userp);
+
+  if (timeout_ms < 0) {
+    self->m_deadline = boost::none;
+
+  } else {
+    self->m_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+  }
+
+  return 0;
 }
 
 void http::impl::handle_response(CURLcode res, CURL *curl) {
@@ -614,11 +1705,59 @@ void http::impl::handle_response(CURLcode res, CURL *curl) {
 
   request *req = nullptr;
   CURLcode res2 = curl_easy_getinfo(curl, CURLINFO_PRIVATE, &req);
+  req->handle = nullptr;
+  dequeue_hedge(req);
 
   fetch_result fres;
   fres.status = fetch_status::server_error;
   fetch_response response(fres);
 
+  long status_code = 0;
+  if (res == CURLE_OK) {
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status_code);
+  }
+
+  // connection failures, timeouts and server errors count against the
+  // host, and are worth trying on another host. anything else is an
+  // answer about the tile itself.
+  const unsigned int host = req->hosts[req->host_index];
+  if (((res != CURLE_OK) && (res != CURLE_REMOTE_FILE_NOT_FOUND)) || (status_code >= 500)) {
+    host_failed(host);
+
+    if (req->partner) {
+      // the other of the hedged pair is still running and may yet
+      // succeed, so leave it to answer.
+      request *other = req->partner;
+      other->partner = nullptr;
+      if (!req->is_hedge) { take_over(req, other); }
+      delete req;
+      return;
+    }
+
+    if (req->retries < m_options.max_retries) {
+      schedule_retry(req);
+      return;
+    }
+
+    // out of retries, but a recently expired copy is better than an
+    // error. it isn't remembered in memory, as it has expired.
+    if (req->cached && req->cached->usable_stale(m_options.stale_if_error_seconds)) {
+      decode_and_finish(req, req->cached->body, false);
+      return;
+    }
+
+  } else {
+    host_succeeded(host);
+    record_latency(std::chrono::steady_clock::now() - req->started);
+
+    if (req->partner) {
+      // this one answered first, so the other can be stopped.
+      if (req->is_hedge) { take_over(req->partner, req); }
+      cancel(req->partner);
+      req->partner = nullptr;
+    }
+  }
+
   if (res != CURLE_OK) {
     if (res == CURLE_REMOTE_FILE_NOT_FOUND) {
       fres.status = fetch_status::not_found;
@@ -626,19 +1765,37 @@ void http::impl::handle_response(CURLcode res, CURL *curl) {
     response = fetch_response(fres);
 
   } else {
-    long status_code = 0;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status_code);
-
     if (status_code == 200) {
-      setup_response_tile(response, req->stream, req->z, req->x, req->y);
-      if (m_cache) {
-        m_cache->write(req);
+      normalise_expiry(req);
+      // the body is moved, not copied, into the cache, and shared
+      // with the decoder.
+      body_ptr body = std::make_shared<const std::string>(std::move(req->body));
+      std::shared_ptr<cache> c = std::atomic_load(&m_cache);
+      if (c) {
+        c->write(req, body);
+      }
+      decode_and_finish(req, body, true);
+      return;
+
+    } else if ((status_code == 304) && req->revalidating) {
+      // the cached copy is still current, so serve that and refresh
+      // its expiry. the validators are kept from the cache entry
+      // unless the origin sent new ones.
+      normalise_expiry(req);
+      if (!req->etag) { req->etag = req->cached->etag; }
+      if (!req->last_modified) { req->last_modified = req->cached->last_modified; }
+      std::shared_ptr<cache> c = std::atomic_load(&m_cache);
+      if (c) {
+        c->refresh(req);
       }
+      decode_and_finish(req, req->cached->body, true);
+      return;
 
-    } else if ((status_code == 0) && bal::starts_with(req->url, "file:")) {
-      setup_response_tile(response, req->stream, req->z, req->x, req->y);
+    } else if ((status_code == 0) && bal::starts_with(req->fetch_url, "file:")) {
       // don't cache if this was a local file - that would just be
       // a waste of disk space.
+      decode_and_finish(req, std::make_shared<const std::string>(std::move(req->body)), false);
+      return;
 
     } else {
       switch (status_code) {
@@ -650,19 +1807,226 @@ void http::impl::handle_response(CURLcode res, CURL *curl) {
         fres.status = fetch_status::server_error;
       }
       response = fetch_response(fres);
+
+      if (status_code == 404) {
+        remember_not_found(req->url);
+      }
     }
   }
 
-  req->promise.set_value(std::move(response));
+  finish(req, std::move(response));
+}
+
+void http::impl::decode_and_finish(request *req, body_ptr body, bool remember_tile) {
+  auto decode = [this, req, body, remember_tile]() {
+    fetch_result err;
+    err.status = fetch_status::server_error;
+    fetch_response response(err);
+
+    setup_response_tile(response, *body, req->z, req->x, req->y);
+    if (remember_tile) {
+      remember(req->url, response, req->expires);
+    }
+    finish(req, std::move(response));
+  };
+
+  if (m_decoders) {
+    m_decoders->post(decode);
+  } else {
+    decode();
+  }
+}
+
+void http::impl::finish(request *req, fetch_response &&response) {
+  std::vector<waiter> waiters;
+  if (req->in_flight) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_in_flight.erase(req->url);
+    waiters.swap(req->waiters);
+  }
+
+  if (!waiters.empty()) {
+    if (response.is_left()) {
+      // the waiters all share the one decoded tile.
+      std::shared_ptr<const vector_tile::Tile> data = response.left()->share();
+      for (waiter &w : waiters) {
+        std::unique_ptr<tile> ptr(new tile(w.z, w.x, w.y, data));
+        w.callback(fetch_response(std::move(ptr)));
+      }
+
+    } else {
+      for (waiter &w : waiters) {
+        w.callback(fetch_response(response.right()));
+      }
+    }
+  }
+
+  // background refreshes don't have a callback.
+  if (req->callback) {
+    req->callback(std::move(response));
+  } else {
+    ++m_background_refreshes;
+  }
+  delete req;
+}
+
+void http::impl::schedule_retry(request *req) {
+  // the next host in order of preference, skipping over any which
+  // have been ejected, unless they all have.
+  const unsigned int num_hosts = req->hosts.size();
+  unsigned int next = (req->host_index + 1) % num_hosts;
+  for (unsigned int i = 0; i < num_hosts; ++i) {
+    const unsigned int candidate = (req->host_index + 1 + i) % num_hosts;
+    if (!host_ejected(req->hosts[candidate])) {
+      next = candidate;
+      break;
+    }
+  }
+
+  // "full jitter" exponential backoff, so that retries from lots of
+  // requests which failed together are spread out.
+  long max_delay = m_options.retry_base_delay_ms << std::min(req->retries, 16u);
+  max_delay = std::min(max_delay, m_options.retry_max_delay_ms);
+  const long delay = (max_delay > 0) ? long(m_random() % (max_delay + 1)) : 0;
+
+  req->host_index = next;
+  req->retries += 1;
+  req->reset_attempt();
+  m_retries.insert(std::make_pair(std::chrono::steady_clock::now() + std::chrono::milliseconds(delay), req));
+}
+
+void http::impl::start_due_retries() {
+  const auto now = std::chrono::steady_clock::now();
+  while (!m_retries.empty() && (m_retries.begin()->first <= now)) {
+    request *req = m_retries.begin()->second;
+    m_retries.erase(m_retries.begin());
+    start_transfer(req);
+  }
+}
+
+void http::impl::start_due_hedges() {
+  if (!m_hedge_after || m_shutdown.load()) {
+    return;
+  }
+
+  const auto now = std::chrono::steady_clock::now();
+  while (!m_hedge_queue.empty() && (m_hedge_queue.front()->started + *m_hedge_after <= now)) {
+    request *req = m_hedge_queue.front();
+    dequeue_hedge(req);
+
+    // the duplicate goes to the next host, if there is more than one,
+    // but doesn't count as a retry.
+    request *hedge = new request(fetch_callback(), req->req, req->url);
+    hedge->hosts = req->hosts;
+    hedge->host_index = (req->host_index + 1) % req->hosts.size();
+    hedge->retries = req->retries;
+    hedge->cached = req->cached;
+    hedge->is_hedge = true;
+    hedge->partner = req;
+    req->partner = hedge;
+    start_transfer(hedge);
+  }
+}
+
+void http::impl::record_latency(std::chrono::steady_clock::duration latency) {
+  if (!m_options.hedge_percentile) {
+    return;
+  }
+
+  if (m_latencies.size() < HEDGE_LATENCY_SAMPLES) {
+    m_latencies.push_back(latency);
+  } else {
+    m_latencies[m_latency_pos] = latency;
+  }
+  m_latency_pos = (m_latency_pos + 1) % HEDGE_LATENCY_SAMPLES;
+
+  // re-calculate the threshold every so often, once there are enough
+  // samples for it to mean something.
+  if ((m_latencies.size() >= HEDGE_MIN_SAMPLES) && (m_latency_pos % HEDGE_MIN_SAMPLES == 0)) {
+    std::vector<std::chrono::steady_clock::duration> sorted(m_latencies);
+    const double percentile = std::max(0.0, std::min(1.0, *m_options.hedge_percentile));
+    const std::size_t n = std::min(sorted.size() - 1, std::size_t(percentile * sorted.size()));
+    std::nth_element(sorted.begin(), sorted.begin() + n, sorted.end());
+    m_hedge_after = std::max<std::chrono::steady_clock::duration>(
+      sorted[n], std::chrono::milliseconds(m_options.hedge_min_delay_ms));
+  }
+}
+
+void http::impl::dequeue_hedge(request *req) {
+  if (req->hedge_queued) {
+    m_hedge_queue.erase(req->hedge_pos);
+    req->hedge_queued = false;
+  }
+}
+
+void http::impl::cancel(request *req) {
+  if (req->handle != nullptr) {
+    curl_multi_remove_handle(m_multi, req->handle);
+    free_handle(req->handle);
+    // curl only updates the count of running handles from
+    // socket_action, so get it to re-count now. otherwise, during
+    // shutdown, the thread could wait forever for the transfer which
+    // was just removed.
+    socket_action(CURL_SOCKET_TIMEOUT, 0);
+  }
+  dequeue_hedge(req);
   delete req;
 }
 
-bool http::impl::setup_response_tile(fetch_response &response, std::unique_ptr<std::stringstream> &stream, unsigned int z, unsigned int x, unsigned int y) {
+void http::impl::take_over(request *from, request *to) {
+  to->callback = std::move(from->callback);
+  if (from->in_flight) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_in_flight[from->url] = to;
+    to->waiters = std::move(from->waiters);
+    to->in_flight = true;
+    from->in_flight = false;
+  }
+}
+
+void http::impl::host_succeeded(unsigned int host) {
+  m_hosts[host].failures = 0;
+}
+
+void http::impl::host_failed(unsigned int host) {
+  host_health &health = m_hosts[host];
+  if (++health.failures >= HOST_EJECT_FAILURES) {
+    health.failures = 0;
+    health.ejected_until = std::chrono::steady_clock::now() + std::chrono::seconds(HOST_EJECT_SECONDS);
+  }
+}
+
+bool http::impl::host_ejected(unsigned int host) const {
+  return m_hosts[host].ejected_until > std::chrono::steady_clock::now();
+}
+
+void http::impl::remember(const std::string &url, fetch_response &response, boost::optional<std::time_t> expires) {
+  std::shared_ptr<memory_cache> mc = std::atomic_load(&m_memory_cache);
+  if (mc && response.is_left()) {
+    mc->put(url, response.left()->share(), expires);
+  }
+}
+
+void http::impl::remember_not_found(const std::string &url) {
+  if (m_options.not_found_ttl_seconds <= 0) {
+    return;
+  }
+
+  const std::time_t expires = time(nullptr) + m_options.not_found_ttl_seconds;
+  m_missing.insert(url, expires);
+
+  std::shared_ptr<cache> c = std::atomic_load(&m_cache);
+  if (c) {
+    c->write_not_found(url, expires);
+  }
+}
+
+bool http::impl::setup_response_tile(fetch_response &response, const std::string &body, unsigned int z, unsigned int x, unsigned int y) {
   std::unique_ptr<tile> ptr(new tile(z, x, y));
   bool ok = true;
 
   try {
-    (*stream) >> (*ptr);
+    ptr->from_buffer(body.data(), body.size());
     response = fetch_response(std::move(ptr));
 
   } catch (...) {
@@ -673,7 +2037,7 @@ bool http::impl::setup_response_tile(fetch_response &response, std::unique_ptr<s
 }
 
 void http::impl::free_handle(CURL *curl) {
-  if (m_handle_pool.size() > MAX_POOL_SIZE) {
+  if (m_handle_pool.size() >= m_options.handle_pool_size) {
     curl_easy_cleanup(curl);
 
   } else {
@@ -699,13 +2063,31 @@ boost::optional<fetch_result> http::impl::new_request(CURL *curl, request *r) {
   fetch_result err;
   err.status = fetch_status::server_error;
 
-  CURLcode res = curl_easy_setopt(curl, CURLOPT_URL, r->url.c_str());
+  // on the first attempt, skip over hosts which have been ejected,
+  // unless they all have.
+  if ((r->retries == 0) && !r->is_hedge) {
+    for (unsigned int i = 0; i < r->hosts.size(); ++i) {
+      if (!host_ejected(r->hosts[i])) {
+        std::swap(r->hosts[0], r->hosts[i]);
+        break;
+      }
+    }
+  }
+
+  const unsigned int host = r->hosts[r->host_index];
+  if (host == 0) {
+    r->fetch_url = r->url;
+  } else {
+    url_for(host, r->z, r->x, r->y, r->fetch_url);
+  }
+
+  CURLcode res = curl_easy_setopt(curl, CURLOPT_URL, r->fetch_url.c_str());
   if (res != CURLE_OK) { return err; }
 
   res = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
   if (res != CURLE_OK) { return err; }
 
-  res = curl_easy_setopt(curl, CURLOPT_WRITEDATA, r->stream.get());
+  res = curl_easy_setopt(curl, CURLOPT_WRITEDATA, &r->body);
   if (res != CURLE_OK) { return err; }
 
   res = curl_easy_setopt(curl, CURLOPT_PRIVATE, r);
@@ -717,63 +2099,158 @@ boost::optional<fetch_result> http::impl::new_request(CURL *curl, request *r) {
   res = curl_easy_setopt(curl, CURLOPT_HEADERDATA, r);
   if (res != CURLE_OK) { return err; }
 
+  // the caller's own validators take precedence. if the caller didn't
+  // send any, then an expired cache entry can be revalidated with the
+  // validators which were stored along with it.
   if (r->req.etag) {
     std::string header = (boost::format("If-None-Match: \"%1%\"") % (*r->req.etag)).str();
-    custom_headers = curl_slist_append(custom_headers, header.c_str());
+    r->headers = curl_slist_append(r->headers, header.c_str());
 
   } else if (r->req.if_modified_since) {
     std::string header = (boost::format("If-Modified-Since: %1%") % make_http_date(*r->req.if_modified_since)).str();
-    custom_headers = curl_slist_append(custom_headers, header.c_str());
+    r->headers = curl_slist_append(r->headers, header.c_str());
+
+  } else if (r->cached && r->cached->revalidatable()) {
+    if (r->cached->etag) {
+      // the stored ETag is exactly as the origin sent it, including
+      // any quotes, so it can be sent back as-is.
+      std::string header = (boost::format("If-None-Match: %1%") % (*r->cached->etag)).str();
+      r->headers = curl_slist_append(r->headers, header.c_str());
+    }
+    if (r->cached->last_modified) {
+      std::string header = (boost::format("If-Modified-Since: %1%")
+                            % make_http_date(boost::posix_time::from_time_t(*r->cached->last_modified))).str();
+      r->headers = curl_slist_append(r->headers, header.c_str());
+    }
+    r->revalidating = true;
   }
-  res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, custom_headers);
+
+  // note: always set this, even if null, as the handle may have been
+  // used for a previous request with different headers.
+  res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, r->headers);
   if (res != CURLE_OK) { return err; }
 
+  // curl's timeouts would otherwise use signals, which isn't safe
+  // with threads.
+  res = curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  if (res != CURLE_OK) { return err; }
+
+  res = curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, m_options.connect_timeout_ms);
+  if (res != CURLE_OK) { return err; }
+
+  res = curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, m_options.timeout_ms);
+  if (res != CURLE_OK) { return err; }
+
+#ifdef CURL_CAN_MULTIPLEX
+  if (m_options.multiplex) {
+    // HTTP/2 is only negotiated over TLS, so plain HTTP upstreams
+    // carry on using HTTP/1.1. waiting for a connection which is
+    // still being set up to see whether it can be multiplexed avoids
+    // opening a new connection for each of a burst of requests.
+    res = curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, long(CURL_HTTP_VERSION_2TLS));
+    if (res != CURLE_OK) { return err; }
+
+    res = curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    if (res != CURLE_OK) { return err; }
+  }
+#endif
+
+  r->handle = curl;
+  r->started = std::chrono::steady_clock::now();
+
+  // only the original request can be hedged, and only once.
+  if (m_options.hedge_percentile && !r->is_hedge && (r->partner == nullptr)) {
+    r->hedge_pos = m_hedge_queue.insert(m_hedge_queue.end(), r);
+    r->hedge_queued = true;
+  }
+
   return boost::none;
 }
 
-std::string http::impl::url_for(unsigned int z, unsigned int x, unsigned int y) const {
-  using namespace boost::xpressive;
-
-  if (m_url_patterns.empty()) {
+void http::impl::url_for(unsigned int host, unsigned int z, unsigned int x, unsigned int y, std::string &out) const {
+  if (m_url_templates.empty()) {
     throw std::runtime_error("no URL patterns in fetcher");
   }
 
-  sregex var = "{" >> (s1 = range('x','z')) >> "}";
-  return regex_replace(m_url_patterns[0], var, formatter(z, x, y));
+  m_url_templates[host].build(z, x, y, out);
 }
 
-void http::impl::enable_cache(const std::string &cache_location) {
-  m_cache = std::make_shared<cache>(cache_location);
+void http::impl::enable_cache(const std::string &cache_location, std::size_t max_bytes) {
+  std::atomic_store(&m_cache, std::make_shared<cache>(cache_location, max_bytes));
 }
 
 void http::impl::disable_cache() {
-  m_cache.reset();
+  std::atomic_store(&m_cache, std::shared_ptr<cache>());
+}
+
+void http::impl::enable_memory_cache(std::size_t max_bytes) {
+  std::atomic_store(&m_memory_cache, std::make_shared<memory_cache>(max_bytes));
+}
+
+void http::impl::disable_memory_cache() {
+  std::atomic_store(&m_memory_cache, std::shared_ptr<memory_cache>());
+}
+
+memory_cache_stats http::impl::get_memory_cache_stats() const {
+  std::shared_ptr<memory_cache> mc = std::atomic_load(&m_memory_cache);
+  return mc ? mc->stats() : memory_cache_stats();
+}
+
+http_options::http_options()
+  : connect_timeout_ms(10000), timeout_ms(60000),
+    max_retries(2), retry_base_delay_ms(50), retry_max_delay_ms(2000),
+    hedge_percentile(), hedge_min_delay_ms(10),
+    handle_pool_size(64), max_host_connections(0), max_total_connections(0),
+    multiplex(true), not_found_ttl_seconds(300),
+    stale_while_revalidate_seconds(0), stale_if_error_seconds(0),
+    decode_threads(std::min(std::max(std::thread::hardware_concurrency(), 1u), DEFAULT_MAX_DECODE_THREADS)) {
 }
 
 http::http(const std::string &base_url, const std::string &ext)
-  : m_impl(new impl(singleton(base_url, ext))) {
+  : m_impl(new impl(singleton(base_url, ext), http_options())) {
 }
 
 http::http(std::vector<std::string> &&patterns)
-  : m_impl(new impl(std::move(patterns))) {
+  : m_impl(new impl(std::move(patterns), http_options())) {
+}
+
+http::http(std::vector<std::string> &&patterns, const http_options &options)
+  : m_impl(new impl(std::move(patterns), options)) {
 }
 
 http::~http() {
 }
 
-std::future<fetch_response> http::operator()(const avecado::request &r) {
-  std::promise<fetch_response> promise;
-  std::future<fetch_response> future = promise.get_future();
-  m_impl->start_request(std::move(promise), r);
-  return future;
+void http::fetch(const avecado::request &r, fetch_callback callback) {
+  m_impl->start_request(std::move(callback), r);
 }
 
-void http::enable_cache(const std::string &cache_location) {
-  m_impl->enable_cache(cache_location);
+void http::fetch_many(const std::vector<avecado::request> &rs, fetch_many_callback callback) {
+  m_impl->start_requests(rs, gather(rs.size(), std::move(callback)));
+}
+
+void http::enable_cache(const std::string &cache_location, std::size_t max_bytes) {
+  m_impl->enable_cache(cache_location, max_bytes);
 }
 
 void http::disable_cache() {
   m_impl->disable_cache();
 }
 
+void http::enable_memory_cache(std::size_t max_bytes) {
+  m_impl->enable_memory_cache(max_bytes);
+}
+
+void http::disable_memory_cache() {
+  m_impl->disable_memory_cache();
+}
+
+memory_cache_stats http::get_memory_cache_stats() const {
+  return m_impl->get_memory_cache_stats();
+}
+
+std::size_t http::background_refreshes() const {
+  return m_impl->background_refreshes();
+}
+
 } } // namespace avecado::fetch
@@ -0,0 +1,190 @@
+#include "fetch/mbtiles.hpp"
+#include "config.h"
+
+#include <boost/format.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+
+#include <mutex>
+#include <vector>
+
+#ifdef HAVE_SQLITE3
+#include <sqlite3.h>
+#endif
+
+// maximum number of idle connections to keep open for re-use. there
+// is one connection for each thread fetching at the same time, and
+// any more than this are closed when they're finished with.
+#define MAX_IDLE_CONNECTIONS (16)
+
+namespace bal = boost::algorithm;
+
+namespace avecado { namespace fetch {
+
+namespace {
+
+// "mbtiles:///srv/tiles.mbtiles" is the same as "/srv/tiles.mbtiles".
+std::string strip_scheme(const std::string &path) {
+  if (bal::starts_with(path, "mbtiles://")) {
+    return path.substr(10);
+  }
+  return path;
+}
+
+fetch_response error(fetch_status status) {
+  fetch_result err;
+  err.status = status;
+  return fetch_response(err);
+}
+
+#ifdef HAVE_SQLITE3
+struct sqlite_db_deleter {
+  void operator()(sqlite3 *ptr) const { sqlite3_close(ptr); }
+};
+
+struct sqlite_statement_finalizer {
+  void operator()(sqlite3_stmt *ptr) const { sqlite3_finalize(ptr); }
+};
+
+// a read-only connection to the file, with the tile lookup already
+// prepared, used by one thread at a time.
+struct connection {
+  explicit connection(const std::string &path) {
+    sqlite3 *db_ = nullptr;
+    int status = sqlite3_open_v2(path.c_str(), &db_, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
+    db.reset(db_);
+    if (status != SQLITE_OK) {
+      throw std::runtime_error((boost::format("Unable to open MBTiles file \"%1%\": %2%")
+                                % path % ((db_ == nullptr) ? sqlite3_errstr(status) : sqlite3_errmsg(db_))).str());
+    }
+
+    const std::string sql = "select tile_data from tiles where zoom_level=? and tile_column=? and tile_row=?";
+    sqlite3_stmt *stmt_ = nullptr;
+    status = sqlite3_prepare_v2(db.get(), sql.c_str(), sql.size(), &stmt_, nullptr);
+    if (status != SQLITE_OK) {
+      throw std::runtime_error((boost::format("Unable to read tiles from MBTiles file \"%1%\": %2%")
+                                % path % sqlite3_errmsg(db.get())).str());
+    }
+    select.reset(stmt_);
+  }
+
+  fetch_response lookup(const request &r) {
+    // MBTiles uses the TMS scheme, counting rows from the south.
+    const sqlite3_int64 row = (sqlite3_int64(1) << r.z) - 1 - r.y;
+
+    sqlite3_stmt *stmt = select.get();
+    sqlite3_bind_int64(stmt, 1, r.z);
+    sqlite3_bind_int64(stmt, 2, r.x);
+    sqlite3_bind_int64(stmt, 3, row);
+
+    fetch_response response = error(fetch_status::not_found);
+    int status = sqlite3_step(stmt);
+    if (status == SQLITE_ROW) {
+      // the blob is only valid until the statement is reset, but the
+      // tile can be decoded straight from it without a copy.
+      const char *bytes = static_cast<const char *>(sqlite3_column_blob(stmt, 0));
+      int sz = sqlite3_column_bytes(stmt, 0);
+
+      std::unique_ptr<tile> ptr(new tile(r.z, r.x, r.y));
+      try {
+        ptr->from_buffer(bytes, sz);
+        response = fetch_response(std::move(ptr));
+
+      } catch (...) {
+        response = error(fetch_status::server_error);
+      }
+
+    } else if (status != SQLITE_DONE) {
+      response = error(fetch_status::server_error);
+    }
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return response;
+  }
+
+  std::unique_ptr<sqlite3, sqlite_db_deleter> db;
+  std::unique_ptr<sqlite3_stmt, sqlite_statement_finalizer> select;
+};
+#endif /* HAVE_SQLITE3 */
+
+} // anonymous namespace
+
+#ifdef HAVE_SQLITE3
+struct mbtiles::impl {
+  explicit impl(const std::string &path)
+    : m_path(path) {
+    // open the first connection straight away, so that a missing or
+    // broken file is reported by the constructor.
+    m_idle.emplace_back(new connection(m_path));
+  }
+
+  std::unique_ptr<connection> borrow() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (!m_idle.empty()) {
+        std::unique_ptr<connection> conn(std::move(m_idle.back()));
+        m_idle.pop_back();
+        return conn;
+      }
+    }
+    return std::unique_ptr<connection>(new connection(m_path));
+  }
+
+  void hand_back(std::unique_ptr<connection> conn) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_idle.size() < MAX_IDLE_CONNECTIONS) {
+      m_idle.push_back(std::move(conn));
+    }
+  }
+
+  void fetch(const request &r, fetch_callback callback) {
+    std::unique_ptr<connection> conn;
+    try {
+      conn = borrow();
+
+    } catch (...) {
+      callback(error(fetch_status::server_error));
+      return;
+    }
+
+    fetch_response response = conn->lookup(r);
+    hand_back(std::move(conn));
+    callback(std::move(response));
+  }
+
+  const std::string m_path;
+  std::mutex m_mutex;
+  std::vector<std::unique_ptr<connection> > m_idle;
+};
+
+#else /* HAVE_SQLITE3 */
+struct mbtiles::impl {
+  explicit impl(const std::string &) {
+    throw std::runtime_error("MBTiles are not supported because avecado was built without SQLite3 support.");
+  }
+
+  void fetch(const request &, fetch_callback callback) {
+    callback(error(fetch_status::not_implemented));
+  }
+};
+#endif /* HAVE_SQLITE3 */
+
+mbtiles::mbtiles(const std::string &path)
+  : m_impl(new impl(strip_scheme(path))) {
+}
+
+mbtiles::~mbtiles() {
+}
+
+void mbtiles::fetch(const request &r, fetch_callback callback) {
+  // rows are flipped, so coordinates past the edge of the world
+  // can't be looked up.
+  if ((r.z < 0) || (r.z > 30) || (r.x < 0) || (r.y < 0) || (r.y >= (1 << r.z))) {
+    callback(error(fetch_status::not_found));
+    return;
+  }
+
+  m_impl->fetch(r, std::move(callback));
+}
+
+} } // namespace avecado::fetch
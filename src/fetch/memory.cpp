@@ -0,0 +1,46 @@
+#include "fetch/memory.hpp"
+
+namespace avecado { namespace fetch {
+
+namespace {
+
+std::string key_for(int z, int x, int y) {
+  std::string key = std::to_string(z);
+  key.push_back('/');
+  key.append(std::to_string(x));
+  key.push_back('/');
+  key.append(std::to_string(y));
+  return key;
+}
+
+} // anonymous namespace
+
+memory::memory(std::size_t max_bytes, long ttl_seconds)
+  : m_cache(max_bytes), m_ttl_seconds(ttl_seconds) {
+}
+
+memory::~memory() {
+}
+
+void memory::fetch(const request &r, fetch_callback callback) {
+  memory_cache::tile_data data = m_cache.get(key_for(r.z, r.x, r.y));
+  if (!data) {
+    fetch_result err;
+    err.status = fetch_status::not_found;
+    callback(fetch_response(err));
+    return;
+  }
+
+  std::unique_ptr<tile> ptr(new tile(r.z, r.x, r.y, std::move(data)));
+  callback(fetch_response(std::move(ptr)));
+}
+
+void memory::put(tile &t) {
+  m_cache.put(key_for(t.z, t.x, t.y), t.share(), std::time_t(time(nullptr) + m_ttl_seconds));
+}
+
+memory_cache_stats memory::stats() const {
+  return m_cache.stats();
+}
+
+} } // namespace avecado::fetch
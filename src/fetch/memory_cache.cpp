@@ -0,0 +1,86 @@
+#include "fetch/memory_cache.hpp"
+#include "vector_tile.pb.h"
+
+namespace avecado { namespace fetch {
+
+memory_cache_stats::memory_cache_stats()
+  : hits(0), misses(0), evictions(0), entries(0), bytes(0) {
+}
+
+memory_cache::memory_cache(std::size_t max_bytes)
+  : m_max_bytes(max_bytes) {
+}
+
+memory_cache::~memory_cache() {
+}
+
+memory_cache::tile_data memory_cache::get(const std::string &key) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  auto itr = m_index.find(key);
+  if (itr == m_index.end()) {
+    ++m_stats.misses;
+    return tile_data();
+  }
+
+  if (itr->second->expires < time(nullptr)) {
+    erase(itr->second);
+    ++m_stats.misses;
+    return tile_data();
+  }
+
+  // move to the front, as it's now the most recently used.
+  m_lru.splice(m_lru.begin(), m_lru, itr->second);
+  ++m_stats.hits;
+  return itr->second->data;
+}
+
+void memory_cache::put(const std::string &key, tile_data data, boost::optional<std::time_t> expires) {
+  if (!data || !expires || (*expires < time(nullptr))) {
+    return;
+  }
+
+  // the encoded size is a reasonable proxy for the memory used by
+  // the decoded tile, and much cheaper to calculate.
+  const std::size_t bytes = data->ByteSize();
+  if (bytes > m_max_bytes) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  auto itr = m_index.find(key);
+  if (itr != m_index.end()) {
+    erase(itr->second);
+  }
+
+  while (!m_lru.empty() && (m_stats.bytes + bytes > m_max_bytes)) {
+    erase(std::prev(m_lru.end()));
+    ++m_stats.evictions;
+  }
+
+  entry e;
+  e.key = key;
+  e.data = std::move(data);
+  e.expires = *expires;
+  e.bytes = bytes;
+  m_lru.push_front(std::move(e));
+  m_index[key] = m_lru.begin();
+
+  m_stats.bytes += bytes;
+  ++m_stats.entries;
+}
+
+memory_cache_stats memory_cache::stats() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_stats;
+}
+
+void memory_cache::erase(lru_list::iterator itr) {
+  m_stats.bytes -= itr->bytes;
+  --m_stats.entries;
+  m_index.erase(itr->key);
+  m_lru.erase(itr);
+}
+
+} } // namespace avecado::fetch
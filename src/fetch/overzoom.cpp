@@ -1,49 +1,447 @@
 #include "fetch/overzoom.hpp"
 
+#include <boost/format.hpp>
+
+#include <ctime>
+
+// how long to keep a decoded parent tile around for re-use. it only
+// needs to be long enough to cover a burst of requests for its
+// children.
+#define PARENT_CACHE_SECONDS (60)
+
+// how long, after finding a missing tile, to speculatively fetch the
+// mask zoom for other tiles near it, and how many such hints to keep.
+#define MISSING_HINT_SECONDS (300)
+#define MISSING_HINT_MAX (4096)
+
 namespace avecado { namespace fetch {
 
-overzoom::overzoom(std::unique_ptr<fetcher> &&source, int max_zoom, boost::optional<int> mask_zoom)
+namespace {
+
+// conditional requests can get different answers, so they can't
+// share the fetch or the cached tile.
+bool shareable(const request &r) {
+  return !r.etag && !r.if_modified_since;
+}
+
+std::string tile_key(const request &r) {
+  return (boost::format("%1%/%2%/%3%") % r.z % r.x % r.y).str();
+}
+
+bool is_missing(const fetch_response &resp) {
+  return resp.is_right() && (resp.right().status == fetch_status::not_found);
+}
+
+// a tile being fetched at the same time as its mask zoom tile. the
+// answer for the tile wins, unless it's missing, in which case the
+// mask zoom tile's answer is used - whichever arrives first.
+struct mask_race {
+  explicit mask_race(fetch_callback cb)
+    : callback(std::move(cb)), missing(false), answered(false) {}
+
+  void tile_answered(fetch_response &&resp) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!is_missing(resp)) {
+      answered = true;
+      lock.unlock();
+      callback(std::move(resp));
+
+    } else if (mask) {
+      answered = true;
+      std::unique_ptr<fetch_response> m(std::move(mask));
+      lock.unlock();
+      callback(std::move(*m));
+
+    } else {
+      missing = true;
+    }
+  }
+
+  void mask_answered(fetch_response &&resp) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (answered) {
+      return;
+
+    } else if (missing) {
+      answered = true;
+      lock.unlock();
+      callback(std::move(resp));
+
+    } else {
+      mask.reset(new fetch_response(std::move(resp)));
+    }
+  }
+
+  std::mutex mutex;
+  fetch_callback callback;
+  std::unique_ptr<fetch_response> mask;
+  bool missing, answered;
+};
+
+} // anonymous namespace
+
+overzoom::overzoom(std::unique_ptr<fetcher> &&source, int max_zoom, boost::optional<int> mask_zoom,
+                   std::size_t parent_cache_bytes)
   : m_source(std::move(source))
   , m_max_zoom(max_zoom)
-  , m_mask_zoom(mask_zoom) {
+  , m_mask_zoom(mask_zoom)
+  , m_speculation(mask_speculation::never) {
+  if (parent_cache_bytes > 0) {
+    m_parents.reset(new memory_cache(parent_cache_bytes));
+  }
 }
 
 overzoom::~overzoom() {
 }
 
-std::future<fetch_response> overzoom::operator()(const request &r) {
+void overzoom::fetch(const request &r, fetch_callback callback) {
   request req(r);
 
-  if (req.z > m_max_zoom) {
-    // zoom "out" to max zoom, as we're guaranteed not to find
-    // any tiles a z > max zoom.
+  // zoom "out" to max zoom, as we're guaranteed not to find any
+  // tiles a z > max zoom. the tile is then a parent which can be
+  // shared with other requests.
+  const bool is_parent = (req.z > m_max_zoom);
+  if (is_parent) {
     req.x >>= (req.z - m_max_zoom);
     req.y >>= (req.z - m_max_zoom);
     req.z = m_max_zoom;
   }
 
-  std::future<fetch_response> upstream_future((*m_source)(req));
+  boost::optional<request> mask = mask_for(req);
+
+  // the fallback to the mask zoom is chained on to the upstream
+  // response, rather than waiting for it on another thread. or, when
+  // the tile is likely to be missing, both are fetched at once.
+  fetch_callback upstream_callback;
+  std::shared_ptr<mask_race> race;
+  if (mask && should_speculate(*mask)) {
+    race = std::make_shared<mask_race>(callback);
+    upstream_callback = [this, mask, race](fetch_response &&resp) {
+      note_response(*mask, resp);
+      race->tile_answered(std::move(resp));
+    };
 
-  return std::async([this, req](std::future<fetch_response> &&fut) -> fetch_response {
-      fetch_response resp(fut.get());
+  } else {
+    upstream_callback = [this, req, mask, callback](fetch_response &&resp) {
+      if (mask) { note_response(*mask, resp); }
+      masked(req, callback, std::move(resp));
+    };
+  }
 
-      // if the tile isn't available, we try again, at the mask
-      // zoom level (as long as it's zoomed 'out').
-      if (bool(m_mask_zoom) &&
-          (req.z > *m_mask_zoom) &&
-          resp.is_right() &&
-          (resp.right().status == fetch_status::not_found)) {
-        const int mask_zoom = *m_mask_zoom;
-        request masked(req);
-        masked.x >>= masked.z - mask_zoom;
-        masked.y >>= masked.z - mask_zoom;
-        masked.z = mask_zoom;
+  if (is_parent) {
+    fetch_parent(req, upstream_callback);
+  } else {
+    m_source->fetch(req, upstream_callback);
+  }
 
-        resp = ((*m_source)(masked)).get();
+  if (race) {
+    fetch_parent(*mask, [race](fetch_response &&resp) {
+        race->mask_answered(std::move(resp));
+      });
+  }
+}
+
+// a fetch_many in progress.
+struct overzoom::batch {
+  explicit batch(fetch_many_callback cb) : callback(std::move(cb)) {}
+
+  // the distinct tiles to fetch, whether each is the parent of a
+  // requested tile, and so can go in the parent cache, and the answer
+  // for each once it's known.
+  std::vector<request> tiles;
+  std::vector<bool> is_parent;
+  std::vector<std::unique_ptr<fetch_response> > answers;
+  // which of the tiles each request wants.
+  std::vector<std::size_t> tile_for;
+  fetch_many_callback callback;
+};
+
+void overzoom::fetch_many(const std::vector<request> &rs, fetch_many_callback callback) {
+  std::shared_ptr<batch> b = std::make_shared<batch>(std::move(callback));
+  std::map<std::string, std::size_t> index;
+
+  for (const request &r : rs) {
+    request req(r);
+    const bool is_parent = (req.z > m_max_zoom);
+    if (is_parent) {
+      req.x >>= (req.z - m_max_zoom);
+      req.y >>= (req.z - m_max_zoom);
+      req.z = m_max_zoom;
+    }
+
+    std::size_t i = b->tiles.size();
+    if (shareable(req)) {
+      auto res = index.insert(std::make_pair(tile_key(req), i));
+      if (!res.second) {
+        i = res.first->second;
+        b->tile_for.push_back(i);
+        if (is_parent) {
+          b->is_parent[i] = true;
+        }
+        continue;
       }
+    }
+
+    b->tiles.push_back(req);
+    b->is_parent.push_back(is_parent);
+    b->tile_for.push_back(i);
+  }
+  b->answers.resize(b->tiles.size());
+
+  // parents which are already in the cache don't need fetching.
+  std::vector<request> upstream;
+  std::vector<std::size_t> which;
+  for (std::size_t i = 0; i < b->tiles.size(); ++i) {
+    const request &req = b->tiles[i];
+    if (m_parents && b->is_parent[i] && shareable(req)) {
+      memory_cache::tile_data data = m_parents->get(tile_key(req));
+      if (data) {
+        std::unique_ptr<tile> ptr(new tile(req.z, req.x, req.y, std::move(data)));
+        b->answers[i].reset(new fetch_response(std::move(ptr)));
+        continue;
+      }
+    }
+    upstream.push_back(req);
+    which.push_back(i);
+  }
+
+  m_source->fetch_many(upstream, [this, b, which](std::vector<fetch_response> &&resps) {
+      batch_fetched(b, which, std::move(resps));
+    });
+}
+
+void overzoom::batch_fetched(std::shared_ptr<batch> b, const std::vector<std::size_t> &which, std::vector<fetch_response> &&resps) {
+  const std::time_t now = std::time(nullptr);
+  for (std::size_t k = 0; k < which.size(); ++k) {
+    const std::size_t i = which[k];
+    fetch_response &resp = resps[k];
+    if (m_parents && b->is_parent[i] && shareable(b->tiles[i]) && resp.is_left()) {
+      m_parents->put(tile_key(b->tiles[i]), resp.left()->share(), now + PARENT_CACHE_SECONDS);
+    }
+    b->answers[i].reset(new fetch_response(std::move(resp)));
+  }
+
+  // missing tiles fall back to the mask zoom, as for fetch(). many
+  // tiles are likely to share each mask zoom tile, which is only
+  // fetched once. for each tile, mask_for is the index of its mask
+  // zoom tile, or npos if it doesn't need one.
+  const std::size_t npos = std::size_t(-1);
+  std::map<std::string, std::size_t> index;
+  std::vector<request> masks;
+  std::vector<std::size_t> mask_for_tile;
+
+  for (std::size_t i = 0; i < b->tiles.size(); ++i) {
+    boost::optional<request> mask = mask_for(b->tiles[i]);
+    if (mask) {
+      note_response(*mask, *b->answers[i]);
+    }
+    if (!mask || !is_missing(*b->answers[i])) {
+      mask_for_tile.push_back(npos);
+      continue;
+    }
+
+    auto res = index.insert(std::make_pair(tile_key(*mask), masks.size()));
+    if (res.second) {
+      masks.push_back(*mask);
+    }
+    mask_for_tile.push_back(res.first->second);
+  }
+
+  if (masks.empty()) {
+    batch_finished(b);
+    return;
+  }
+
+  std::vector<fetch_callback> callbacks = gather(masks.size(), [this, b, mask_for_tile](std::vector<fetch_response> &&resps) {
+      batch_masks_fetched(b, mask_for_tile, std::move(resps));
+    });
+  for (std::size_t j = 0; j < masks.size(); ++j) {
+    fetch_parent(masks[j], std::move(callbacks[j]));
+  }
+}
+
+void overzoom::batch_masks_fetched(std::shared_ptr<batch> b, const std::vector<std::size_t> &which, std::vector<fetch_response> &&resps) {
+  for (std::size_t i = 0; i < which.size(); ++i) {
+    if (which[i] == std::size_t(-1)) {
+      continue;
+    }
+
+    fetch_response &mask = resps[which[i]];
+    if (mask.is_left()) {
+      const tile &t = *mask.left();
+      std::unique_ptr<tile> ptr(new tile(t.z, t.x, t.y, mask.left()->share()));
+      b->answers[i].reset(new fetch_response(std::move(ptr)));
+
+    } else {
+      b->answers[i].reset(new fetch_response(mask.right()));
+    }
+  }
+
+  batch_finished(b);
+}
+
+void overzoom::batch_finished(std::shared_ptr<batch> b) {
+  std::vector<std::size_t> uses(b->tiles.size(), 0);
+  for (std::size_t i : b->tile_for) {
+    ++uses[i];
+  }
+
+  std::vector<fetch_response> results;
+  results.reserve(b->tile_for.size());
+  for (std::size_t i : b->tile_for) {
+    fetch_response &answer = *b->answers[i];
+    if (answer.is_right()) {
+      results.emplace_back(answer.right());
+
+    } else if (uses[i] == 1) {
+      results.emplace_back(std::move(answer));
+
+    } else {
+      // requests for the same tile share its data.
+      const tile &t = *answer.left();
+      std::unique_ptr<tile> ptr(new tile(t.z, t.x, t.y, answer.left()->share()));
+      results.emplace_back(std::move(ptr));
+    }
+  }
+
+  b->callback(std::move(results));
+}
+
+memory_cache_stats overzoom::parent_cache_stats() const {
+  return m_parents ? m_parents->stats() : memory_cache_stats();
+}
+
+void overzoom::set_mask_speculation(mask_speculation mode) {
+  m_speculation.store(mode);
+}
+
+void overzoom::masked(const request &req, fetch_callback callback, fetch_response &&resp) {
+  // if the tile isn't available, we try again, at the mask
+  // zoom level (as long as it's zoomed 'out').
+  boost::optional<request> mask = mask_for(req);
+  if (mask && is_missing(resp)) {
+    fetch_parent(*mask, callback);
+
+  } else {
+    callback(std::move(resp));
+  }
+}
+
+boost::optional<request> overzoom::mask_for(const request &req) const {
+  if (!m_mask_zoom || (req.z <= *m_mask_zoom)) {
+    return boost::none;
+  }
+
+  const int mask_zoom = *m_mask_zoom;
+  request mask(req);
+  mask.x >>= mask.z - mask_zoom;
+  mask.y >>= mask.z - mask_zoom;
+  mask.z = mask_zoom;
+  return mask;
+}
+
+bool overzoom::should_speculate(const request &mask) {
+  const mask_speculation mode = m_speculation.load();
+  if (mode != mask_speculation::hinted) {
+    return mode == mask_speculation::always;
+  }
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto itr = m_missing.find(tile_key(mask));
+  return (itr != m_missing.end()) && (itr->second >= std::time(nullptr));
+}
+
+void overzoom::note_response(const request &mask, const fetch_response &resp) {
+  if ((m_speculation.load() != mask_speculation::hinted) || !is_missing(resp)) {
+    return;
+  }
+
+  const std::time_t now = std::time(nullptr);
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_missing[tile_key(mask)] = now + MISSING_HINT_SECONDS;
+
+  if (m_missing.size() > MISSING_HINT_MAX) {
+    for (auto itr = m_missing.begin(); itr != m_missing.end(); ) {
+      if (itr->second < now) {
+        itr = m_missing.erase(itr);
+      } else {
+        ++itr;
+      }
+    }
+    // still too many current hints, so start again rather than let
+    // them grow without bound.
+    if (m_missing.size() > MISSING_HINT_MAX) {
+      m_missing.clear();
+    }
+  }
+}
+
+void overzoom::fetch_parent(const request &req, fetch_callback callback) {
+  if (!shareable(req)) {
+    m_source->fetch(req, callback);
+    return;
+  }
+
+  const std::string key = tile_key(req);
+
+  if (m_parents) {
+    memory_cache::tile_data data = m_parents->get(key);
+    if (data) {
+      std::unique_ptr<tile> ptr(new tile(req.z, req.x, req.y, std::move(data)));
+      callback(fetch_response(std::move(ptr)));
+      return;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto itr = m_in_flight.find(key);
+    if (itr != m_in_flight.end()) {
+      itr->second.push_back(std::move(callback));
+      return;
+    }
+    m_in_flight[key];
+  }
+
+  m_source->fetch(req, [this, req, key, callback](fetch_response &&resp) {
+      parent_fetched(req, key, callback, std::move(resp));
+    });
+}
+
+void overzoom::parent_fetched(const request &req, const std::string &key, fetch_callback callback, fetch_response &&resp) {
+  std::vector<fetch_callback> waiters;
+  std::shared_ptr<const vector_tile::Tile> data;
+
+  if (resp.is_left()) {
+    data = resp.left()->share();
+    if (m_parents) {
+      m_parents->put(key, data, std::time(nullptr) + PARENT_CACHE_SECONDS);
+    }
+  }
+
+  // note: the tile is cached before the fetch is unregistered, so
+  // that there's no window in which another request for it would
+  // start a new fetch.
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto itr = m_in_flight.find(key);
+    if (itr != m_in_flight.end()) {
+      waiters.swap(itr->second);
+      m_in_flight.erase(itr);
+    }
+  }
+
+  for (fetch_callback &waiter : waiters) {
+    if (data) {
+      std::unique_ptr<tile> ptr(new tile(req.z, req.x, req.y, data));
+      waiter(fetch_response(std::move(ptr)));
+
+    } else {
+      waiter(fetch_response(resp.right()));
+    }
+  }
 
-      return resp;
-    }, std::move(upstream_future));
+  callback(std::move(resp));
 }
 
 } } // namespace avecado::fetch
@@ -0,0 +1,135 @@
+#include "fetch/tiered.hpp"
+
+#include <stdexcept>
+
+namespace avecado { namespace fetch {
+
+namespace {
+
+// whether the next tier should be tried after this response. a tier
+// which knows the tile hasn't been modified, or that the request is
+// bad, has answered for all of them.
+bool try_next_tier(const fetch_response &response) {
+  if (response.is_left()) {
+    return false;
+  }
+
+  switch (response.right().status) {
+  case fetch_status::not_found:
+  case fetch_status::server_error:
+  case fetch_status::not_implemented:
+    return true;
+  default:
+    return false;
+  }
+}
+
+} // anonymous namespace
+
+tiered::tiered(std::vector<std::unique_ptr<fetcher> > &&tiers)
+  : m_tiers(std::move(tiers)) {
+  if (m_tiers.empty()) {
+    throw std::runtime_error("A tiered fetcher needs at least one tier.");
+  }
+
+  for (const auto &tier : m_tiers) {
+    m_stores.push_back(dynamic_cast<tile_store *>(tier.get()));
+  }
+}
+
+tiered::~tiered() {
+}
+
+void tiered::fetch(const request &r, fetch_callback callback) {
+  fetch_from(0, r, std::move(callback));
+}
+
+void tiered::fetch_from(std::size_t tier, const request &r, fetch_callback callback) {
+  m_tiers[tier]->fetch(r, [this, tier, r, callback](fetch_response &&response) mutable {
+      fetched(tier, r, callback, std::move(response));
+    });
+}
+
+void tiered::fetched(std::size_t tier, const request &r, fetch_callback &callback, fetch_response &&response) {
+  if ((tier + 1 < m_tiers.size()) && try_next_tier(response)) {
+    fetch_from(tier + 1, r, std::move(callback));
+    return;
+  }
+
+  if (response.is_left()) {
+    write_back(tier, *response.left());
+  }
+
+  callback(std::move(response));
+}
+
+// a fetch_many in progress.
+struct tiered::batch {
+  batch(const std::vector<request> &rs, fetch_many_callback cb)
+    : requests(rs), answers(rs.size()), callback(std::move(cb)) {}
+
+  const std::vector<request> requests;
+  std::vector<std::unique_ptr<fetch_response> > answers;
+  fetch_many_callback callback;
+};
+
+void tiered::fetch_many(const std::vector<request> &rs, fetch_many_callback callback) {
+  std::shared_ptr<batch> b = std::make_shared<batch>(rs, std::move(callback));
+  std::vector<std::size_t> all(rs.size());
+  for (std::size_t i = 0; i < rs.size(); ++i) {
+    all[i] = i;
+  }
+  fetch_many_from(0, b, std::move(all));
+}
+
+void tiered::fetch_many_from(std::size_t tier, std::shared_ptr<batch> b, std::vector<std::size_t> &&which) {
+  std::vector<request> rs;
+  rs.reserve(which.size());
+  for (std::size_t i : which) {
+    rs.push_back(b->requests[i]);
+  }
+
+  m_tiers[tier]->fetch_many(rs, [this, tier, b, which](std::vector<fetch_response> &&resps) {
+      fetched_many(tier, b, which, std::move(resps));
+    });
+}
+
+void tiered::fetched_many(std::size_t tier, std::shared_ptr<batch> b, const std::vector<std::size_t> &which, std::vector<fetch_response> &&resps) {
+  const bool last = (tier + 1 == m_tiers.size());
+  std::vector<std::size_t> next;
+
+  for (std::size_t k = 0; k < which.size(); ++k) {
+    fetch_response &response = resps[k];
+    if (!last && try_next_tier(response)) {
+      next.push_back(which[k]);
+      continue;
+    }
+
+    if (response.is_left()) {
+      write_back(tier, *response.left());
+    }
+    b->answers[which[k]].reset(new fetch_response(std::move(response)));
+  }
+
+  if (!next.empty()) {
+    fetch_many_from(tier + 1, b, std::move(next));
+    return;
+  }
+
+  std::vector<fetch_response> results;
+  results.reserve(b->answers.size());
+  for (auto &answer : b->answers) {
+    results.emplace_back(std::move(*answer));
+  }
+  b->callback(std::move(results));
+}
+
+void tiered::write_back(std::size_t tier, tile &t) {
+  for (std::size_t i = 0; i < tier; ++i) {
+    if (m_stores[i] != nullptr) {
+      m_stores[i]->put(t);
+    }
+  }
+}
+
+} } // namespace avecado::fetch
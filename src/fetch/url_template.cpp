@@ -0,0 +1,158 @@
+#include "fetch/url_template.hpp"
+
+#include <cstdint>
+
+namespace avecado { namespace fetch {
+
+namespace {
+
+const char subdomains[] = "abc";
+const std::size_t num_subdomains = sizeof(subdomains) - 1;
+
+void append_number(std::uint64_t val, std::string &out) {
+  // enough for any 64-bit number.
+  char buf[20];
+  char *end = buf + sizeof buf;
+  char *ptr = end;
+
+  do {
+    *--ptr = '0' + (val % 10);
+    val /= 10;
+  } while (val > 0);
+
+  out.append(ptr, end);
+}
+
+// the row counted from the south rather than the north. the
+// arithmetic is done in 64 bits, so that it doesn't overflow above
+// z31. a row which is outside the zoom level doesn't have a flipped
+// equivalent, so it's left as it is for the origin to say it doesn't
+// exist.
+void append_flipped_y(unsigned int z, unsigned int y, std::string &out) {
+  if (z < 64) {
+    const std::uint64_t extent = std::uint64_t(1) << z;
+    if (y < extent) {
+      append_number(extent - 1 - y, out);
+      return;
+    }
+  }
+  append_number(y, out);
+}
+
+void append_quadkey(unsigned int z, unsigned int x, unsigned int y, std::string &out) {
+  for (unsigned int i = z; i > 0; --i) {
+    // the coordinates only have 32 bits, so any digits for zoom
+    // levels above that are all zero.
+    const unsigned int bit = i - 1;
+    char digit = '0';
+    if (bit < 32) {
+      if ((x >> bit) & 1u) { digit += 1; }
+      if ((y >> bit) & 1u) { digit += 2; }
+    }
+    out.push_back(digit);
+  }
+}
+
+} // anonymous namespace
+
+url_template::url_template(const std::string &pattern)
+  : m_pattern(pattern), m_length_hint(0) {
+
+  std::size_t start = 0;
+  std::size_t pos = 0;
+
+  while ((pos = m_pattern.find('{', pos)) != std::string::npos) {
+    std::size_t close = m_pattern.find('}', pos);
+    if (close == std::string::npos) {
+      break;
+    }
+
+    // an unmatched brace, e.g: "{x/{y}", is part of the literal.
+    std::size_t next_open = m_pattern.find('{', pos + 1);
+    if (next_open < close) {
+      pos = next_open;
+      continue;
+    }
+
+    const std::string name = m_pattern.substr(pos + 1, close - pos - 1);
+    segment_type type = literal;
+    if      (name == "z")       { type = var_z; }
+    else if (name == "x")       { type = var_x; }
+    else if (name == "y")       { type = var_y; }
+    else if (name == "-y")      { type = var_flipped_y; }
+    else if (name == "s")       { type = var_subdomain; }
+    else if (name == "q")       { type = var_quadkey; }
+    else if (name == "quadkey") { type = var_quadkey; }
+
+    if (type == literal) {
+      // not a variable we know about, so it stays part of the literal.
+      pos = close + 1;
+      continue;
+    }
+
+    if (pos > start) {
+      segment lit = { literal, start, pos - start };
+      m_segments.push_back(lit);
+      m_length_hint += lit.length;
+    }
+    segment var = { type, 0, 0 };
+    m_segments.push_back(var);
+    m_length_hint += 8;
+
+    start = pos = close + 1;
+  }
+
+  if (start < m_pattern.size()) {
+    segment lit = { literal, start, m_pattern.size() - start };
+    m_segments.push_back(lit);
+    m_length_hint += lit.length;
+  }
+}
+
+void url_template::build(unsigned int z, unsigned int x, unsigned int y, std::string &out) const {
+  out.clear();
+  out.reserve(m_length_hint);
+
+  for (const segment &seg : m_segments) {
+    switch (seg.type) {
+    case literal:
+      out.append(m_pattern, seg.offset, seg.length);
+      break;
+    case var_z:
+      append_number(z, out);
+      break;
+    case var_x:
+      append_number(x, out);
+      break;
+    case var_y:
+      append_number(y, out);
+      break;
+    case var_flipped_y:
+      append_flipped_y(z, y, out);
+      break;
+    case var_subdomain:
+      out.push_back(subdomains[(x + y) % num_subdomains]);
+      break;
+    case var_quadkey:
+      append_quadkey(z, x, y, out);
+      break;
+    }
+  }
+}
+
+bool url_template::has_variables() const {
+  for (const segment &seg : m_segments) {
+    if (seg.type != literal) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string url_template::operator()(unsigned int z, unsigned int x, unsigned int y) const {
+  std::string out;
+  build(z, x, y, out);
+  return out;
+}
+
+} } // namespace avecado::fetch
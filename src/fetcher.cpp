@@ -1,5 +1,7 @@
 #include "fetcher.hpp"
 
+#include <atomic>
+
 namespace avecado {
 
 request::request(int z_, int x_, int y_)
@@ -10,4 +12,78 @@ request::request(int z_, int x_, int y_)
 fetcher::~fetcher() {
 }
 
+tile_store::~tile_store() {
+}
+
+std::future<fetch_response> fetcher::operator()(const request &r) {
+  // the promise is shared, as std::function needs a copyable callback.
+  std::shared_ptr<std::promise<fetch_response> > promise =
+    std::make_shared<std::promise<fetch_response> >();
+  std::future<fetch_response> future = promise->get_future();
+  fetch(r, [promise](fetch_response &&response) {
+      promise->set_value(std::move(response));
+    });
+  return future;
+}
+
+std::future<std::vector<fetch_response> > fetcher::operator()(const std::vector<request> &requests) {
+  std::shared_ptr<std::promise<std::vector<fetch_response> > > promise =
+    std::make_shared<std::promise<std::vector<fetch_response> > >();
+  std::future<std::vector<fetch_response> > future = promise->get_future();
+  fetch_many(requests, [promise](std::vector<fetch_response> &&responses) {
+      promise->set_value(std::move(responses));
+    });
+  return future;
+}
+
+void fetcher::fetch_many(const std::vector<request> &requests, fetch_many_callback callback) {
+  std::vector<fetch_callback> callbacks = gather(requests.size(), std::move(callback));
+  for (std::size_t i = 0; i < requests.size(); ++i) {
+    fetch(requests[i], std::move(callbacks[i]));
+  }
+}
+
+namespace {
+
+struct gathered {
+  gathered(std::size_t n, fetch_many_callback cb)
+    : remaining(n), callback(std::move(cb)) {
+    // placeholders, each replaced by the response.
+    fetch_result placeholder;
+    placeholder.status = fetch_status::server_error;
+    responses.reserve(n);
+    for (std::size_t i = 0; i < n; ++i) {
+      responses.emplace_back(placeholder);
+    }
+  }
+
+  // each response goes in its own slot, so only the count needs to
+  // be synchronised.
+  std::vector<fetch_response> responses;
+  std::atomic<std::size_t> remaining;
+  fetch_many_callback callback;
+};
+
+} // anonymous namespace
+
+std::vector<fetch_callback> fetcher::gather(std::size_t n, fetch_many_callback callback) {
+  std::vector<fetch_callback> callbacks;
+  if (n == 0) {
+    callback(std::vector<fetch_response>());
+    return callbacks;
+  }
+
+  std::shared_ptr<gathered> state = std::make_shared<gathered>(n, std::move(callback));
+  callbacks.reserve(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    callbacks.emplace_back([state, i](fetch_response &&response) {
+        state->responses[i] = std::move(response);
+        if (state->remaining.fetch_sub(1) == 1) {
+          state->callback(std::move(state->responses));
+        }
+      });
+  }
+  return callbacks;
+}
+
 } // namespace avecado
@@ -0,0 +1,189 @@
+#include "http_server/batch.hpp"
+#include "http_server/reply.hpp"
+#include "http_server/request.hpp"
+#include "http_server/request_handler.hpp"
+
+#include <boost/lexical_cast.hpp>
+#include <boost/format.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/classification.hpp>
+
+namespace http {
+namespace server3 {
+
+const char batch_boundary[] = "avecado-batch-boundary";
+
+namespace {
+
+// the largest zoom level which tiles are served at, matching the
+// check in mapnik_request_handler.
+const int max_batch_zoom = 30;
+
+// parse either a single non-negative coordinate, or an inclusive
+// range of them separated by a '-'.
+bool parse_range(const std::string &str, int &lo, int &hi) {
+  std::string::size_type dash = str.find('-');
+
+  try {
+    if (dash == std::string::npos) {
+      lo = hi = boost::lexical_cast<int>(str);
+
+    } else {
+      lo = boost::lexical_cast<int>(str.substr(0, dash));
+      hi = boost::lexical_cast<int>(str.substr(dash + 1));
+    }
+
+  } catch (...) {
+    return false;
+  }
+
+  return (lo >= 0) && (lo <= hi);
+}
+
+bool parse_item(std::string item, std::vector<std::string> &paths) {
+  if (boost::algorithm::ends_with(item, ".pbf")) {
+    item.resize(item.size() - 4);
+  }
+
+  std::vector<std::string> splits;
+  boost::algorithm::split(splits, item, boost::algorithm::is_any_of("/"));
+  if (splits.size() != 3) {
+    return false;
+  }
+
+  int z = 0, x0 = 0, x1 = 0, y0 = 0, y1 = 0;
+  try {
+    z = boost::lexical_cast<int>(splits[0]);
+  } catch (...) {
+    return false;
+  }
+
+  if (!parse_range(splits[1], x0, x1) ||
+      !parse_range(splits[2], y0, y1)) {
+    return false;
+  }
+
+  // a range has to be within the zoom levels and coordinates which
+  // the tile handler will serve. a single tile outside them is left
+  // to be answered as not found, like any other missing tile.
+  if ((x0 != x1) || (y0 != y1)) {
+    if ((z < 0) || (z > max_batch_zoom)) {
+      return false;
+    }
+    const std::size_t extent = std::size_t(1) << z;
+    if ((std::size_t(x1) >= extent) || (std::size_t(y1) >= extent)) {
+      return false;
+    }
+  }
+
+  // check the size of the range before expanding it, so that a
+  // silly request doesn't make us allocate lots of memory. each side
+  // is checked against the room left on its own first, so that
+  // working out the size can't overflow.
+  if (paths.size() >= max_batch_size) {
+    return false;
+  }
+  const std::size_t room = max_batch_size - paths.size();
+  const std::size_t x_span = std::size_t(x1) - std::size_t(x0) + 1;
+  const std::size_t y_span = std::size_t(y1) - std::size_t(y0) + 1;
+  if ((x_span > room) || (y_span > room) || (x_span * y_span > room)) {
+    return false;
+  }
+
+  for (std::size_t j = 0; j < y_span; ++j) {
+    for (std::size_t i = 0; i < x_span; ++i) {
+      paths.push_back((boost::format("/%1%/%2%/%3%.pbf") % z % (x0 + int(i)) % (y0 + int(j))).str());
+    }
+  }
+
+  return true;
+}
+
+} // anonymous namespace
+
+bool is_batch_request(const request &req) {
+  const std::string &uri = req.uri;
+  return (uri.compare(0, uri.find('?'), "/batch") == 0);
+}
+
+bool parse_batch(const std::string &uri, std::vector<std::string> &paths) {
+  std::string decoded;
+  if (!request_handler::url_decode(uri, decoded)) {
+    return false;
+  }
+
+  std::string::size_type query_start = decoded.find('?');
+  if ((query_start == std::string::npos) ||
+      (decoded.compare(0, query_start, "/batch") != 0)) {
+    return false;
+  }
+
+  std::vector<std::string> params;
+  boost::algorithm::split(params, decoded.substr(query_start + 1),
+                          boost::algorithm::is_any_of("&"));
+
+  bool found = false;
+  for (const auto &param : params) {
+    if (boost::algorithm::starts_with(param, "tiles=")) {
+      std::vector<std::string> items;
+      boost::algorithm::split(items, param.substr(6), boost::algorithm::is_any_of(","));
+
+      for (const auto &item : items) {
+        if (!parse_item(item, paths)) {
+          return false;
+        }
+      }
+      found = true;
+    }
+  }
+
+  return found && !paths.empty();
+}
+
+void batch_reply_header(reply &rep) {
+  rep.status = reply::ok;
+  rep.is_hard_error = false;
+  rep.content.clear();
+  rep.headers.resize(3);
+  rep.headers[0].name = "Content-Type";
+  rep.headers[0].value = (boost::format("multipart/mixed; boundary=%1%") % batch_boundary).str();
+  rep.headers[1].name = "Access-Control-Allow-Origin";
+  rep.headers[1].value = "*";
+  rep.headers[2].name= "Access-Control-Allow-Methods";
+  rep.headers[2].value = "GET";
+}
+
+void append_batch_part(const std::string &path, const reply &rep, std::string &out) {
+  out.append("--");
+  out.append(batch_boundary);
+  out.append("\r\nContent-Location: ");
+  out.append(path);
+  out.append("\r\nX-Tile-Status: ");
+  out.append(boost::lexical_cast<std::string>(int(rep.status)));
+  out.append("\r\n");
+
+  // the CORS headers are already present on the enclosing response,
+  // but the rest are relevant to the part itself.
+  for (const auto &h : rep.headers) {
+    if (!boost::algorithm::istarts_with(h.name, "Access-Control-")) {
+      out.append(h.name);
+      out.append(": ");
+      out.append(h.value);
+      out.append("\r\n");
+    }
+  }
+
+  out.append("\r\n");
+  out.append(rep.content);
+  out.append("\r\n");
+}
+
+void append_batch_end(std::string &out) {
+  out.append("--");
+  out.append(batch_boundary);
+  out.append("--\r\n");
+}
+
+} // namespace server3
+} // namespace http
@@ -12,15 +12,19 @@
 #include <vector>
 #include <boost/bind.hpp>
 #include "http_server/request_handler.hpp"
+#include "http_server/batch.hpp"
 
 namespace http {
 namespace server3 {
 
 connection::connection(boost::asio::io_service& io_service,
                        boost::thread_specific_ptr<request_handler>& handler_ptr)
-  : strand_(io_service),
+  : io_service_(io_service),
+    strand_(io_service),
     socket_(io_service),
-    request_handler_ptr_(handler_ptr)
+    request_handler_ptr_(handler_ptr),
+    batch_remaining_(0),
+    batch_failed_(false)
 {
 }
 
@@ -49,11 +53,18 @@ void connection::handle_read(const boost::system::error_code& e,
 
     if (result)
     {
-      request_handler_ptr_->handle_request(request_, reply_);
-      boost::asio::async_write(socket_, reply_.to_buffers(),
-          strand_.wrap(
-            boost::bind(&connection::handle_write, shared_from_this(),
-              boost::asio::placeholders::error)));
+      if (is_batch_request(request_))
+      {
+        start_batch();
+      }
+      else
+      {
+        request_handler_ptr_->handle_request(request_, reply_);
+        boost::asio::async_write(socket_, reply_.to_buffers(),
+            strand_.wrap(
+              boost::bind(&connection::handle_write, shared_from_this(),
+                boost::asio::placeholders::error)));
+      }
     }
     else if (!result)
     {
@@ -81,6 +92,10 @@ void connection::handle_read(const boost::system::error_code& e,
 
 void connection::handle_write(const boost::system::error_code& e)
 {
+  // the reply has been written, so its storage can be re-used by the
+  // next reply made on this thread.
+  request_handler_ptr_->recycle(reply_);
+
   if (!e)
   {
     // Initiate graceful connection closure.
@@ -94,5 +109,121 @@ void connection::handle_write(const boost::system::error_code& e)
   // destructor closes the socket.
 }
 
+void connection::start_batch()
+{
+  std::vector<std::string> paths;
+  if (!parse_batch(request_.uri, paths))
+  {
+    reply_ = reply::stock_reply(reply::bad_request);
+    boost::asio::async_write(socket_, reply_.to_buffers(),
+        strand_.wrap(
+          boost::bind(&connection::handle_write, shared_from_this(),
+            boost::asio::placeholders::error)));
+    return;
+  }
+
+  // the status line and headers go first, then each tile is written as
+  // a separate part of a multipart response as soon as it is ready.
+  batch_reply_header(reply_);
+  boost::shared_ptr<std::string> header(new std::string);
+  for (const auto &buf : reply_.to_buffers())
+  {
+    header->append(boost::asio::buffer_cast<const char *>(buf),
+                   boost::asio::buffer_size(buf));
+  }
+
+  batch_remaining_ = paths.size();
+  queue_batch_write(header, false);
+
+  // post each tile as a separate job so that they are rendered in
+  // parallel by all the threads of the pool.
+  for (const auto &path : paths)
+  {
+    io_service_.post(boost::bind(&connection::handle_batch_item,
+                                 shared_from_this(), path));
+  }
+}
+
+void connection::handle_batch_item(const std::string& path)
+{
+  request item_request(request_);
+  item_request.uri = path;
+  reply item_reply;
+
+  try
+  {
+    request_handler_ptr_->handle_request(item_request, item_reply);
+  }
+  catch (...)
+  {
+    item_reply = reply::stock_reply(reply::internal_server_error);
+  }
+
+  boost::shared_ptr<std::string> chunk(new std::string);
+  append_batch_part(path, item_reply, *chunk);
+
+  strand_.post(boost::bind(&connection::queue_batch_write,
+                           shared_from_this(), chunk, true));
+}
+
+void connection::queue_batch_write(const boost::shared_ptr<std::string>& chunk,
+                                   bool is_item)
+{
+  if (is_item)
+  {
+    --batch_remaining_;
+  }
+
+  if (batch_failed_)
+  {
+    return;
+  }
+
+  const bool idle = batch_writes_.empty();
+  batch_writes_.push_back(chunk);
+
+  if (is_item && (batch_remaining_ == 0))
+  {
+    boost::shared_ptr<std::string> end(new std::string);
+    append_batch_end(*end);
+    batch_writes_.push_back(end);
+  }
+
+  if (idle)
+  {
+    boost::asio::async_write(socket_, boost::asio::buffer(*batch_writes_.front()),
+        strand_.wrap(
+          boost::bind(&connection::handle_batch_write, shared_from_this(),
+            boost::asio::placeholders::error)));
+  }
+}
+
+void connection::handle_batch_write(const boost::system::error_code& e)
+{
+  if (e)
+  {
+    // there's no point writing anything else, but the outstanding
+    // items still hold a reference to the connection, so it will
+    // be destroyed once they have all finished.
+    batch_failed_ = true;
+    batch_writes_.clear();
+    return;
+  }
+
+  batch_writes_.pop_front();
+
+  if (!batch_writes_.empty())
+  {
+    boost::asio::async_write(socket_, boost::asio::buffer(*batch_writes_.front()),
+        strand_.wrap(
+          boost::bind(&connection::handle_batch_write, shared_from_this(),
+            boost::asio::placeholders::error)));
+  }
+  else if (batch_remaining_ == 0)
+  {
+    handle_write(e);
+  }
+}
+
 } // namespace server3
 } // namespace http
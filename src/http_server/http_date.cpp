@@ -0,0 +1,89 @@
+#include "http_server/http_date.hpp"
+
+#include <mutex>
+#include <cstring>
+
+namespace http {
+namespace server3 {
+
+namespace {
+
+const char day_names[7][4] = {
+  "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+
+const char month_names[12][4] = {
+  "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+inline char *put_2digits(char *out, int val) {
+  *out++ = '0' + (val / 10) % 10;
+  *out++ = '0' + val % 10;
+  return out;
+}
+
+inline char *put_name(char *out, const char *name) {
+  *out++ = name[0];
+  *out++ = name[1];
+  *out++ = name[2];
+  return out;
+}
+
+// the most recently formatted date, shared between all threads so
+// that the formatting is done at most once per second.
+struct shared_date {
+  std::mutex mutex;
+  std::time_t time;
+  char buf[http_date_length + 1];
+
+  shared_date() : time(-1) { buf[0] = '\0'; }
+};
+
+shared_date g_date;
+
+// each thread keeps its own copy, so that the common case of the
+// date not having changed doesn't need to take the lock.
+thread_local std::time_t t_time = -1;
+thread_local char t_buf[http_date_length + 1];
+
+} // anonymous namespace
+
+void format_http_date(std::time_t t, char *buf) {
+  struct tm tt;
+  gmtime_r(&t, &tt);
+
+  char *out = buf;
+  out = put_name(out, day_names[tt.tm_wday]);
+  *out++ = ','; *out++ = ' ';
+  out = put_2digits(out, tt.tm_mday);
+  *out++ = ' ';
+  out = put_name(out, month_names[tt.tm_mon]);
+  *out++ = ' ';
+  out = put_2digits(out, (tt.tm_year + 1900) / 100);
+  out = put_2digits(out, (tt.tm_year + 1900) % 100);
+  *out++ = ' ';
+  out = put_2digits(out, tt.tm_hour);
+  *out++ = ':';
+  out = put_2digits(out, tt.tm_min);
+  *out++ = ':';
+  out = put_2digits(out, tt.tm_sec);
+  std::memcpy(out, " GMT", 5);
+}
+
+const char *current_http_date() {
+  const std::time_t now = std::time(nullptr);
+
+  if (now != t_time) {
+    std::unique_lock<std::mutex> lock(g_date.mutex);
+    if (now != g_date.time) {
+      format_http_date(now, g_date.buf);
+      g_date.time = now;
+    }
+    std::memcpy(t_buf, g_date.buf, sizeof t_buf);
+    t_time = now;
+  }
+
+  return t_buf;
+}
+
+} // namespace server3
+} // namespace http
@@ -5,19 +5,45 @@
 
 #include "http_server/mapnik_handler_factory.hpp"
 #include "http_server/mapnik_request_handler.hpp"
+#include "util.hpp"
+
+#include <iostream>
+#include <limits>
+#include <boost/format.hpp>
+#include <mapnik/load_map.hpp>
 
 namespace http {
 namespace server3 {
 
 mapnik_handler_factory::mapnik_handler_factory(const mapnik_server_options &opts)
-  : options_(opts) {
+  : options_(opts), map_() {
+  std::cout << "Loading mapnik map..." << std::endl;
+  avecado::util::stopwatch timer;
+  mapnik::load_map(map_, options_.map_file);
+  std::cout << "Mapnik map loaded in " << timer.elapsed_ms() << " ms." << std::endl;
+
+  // the copies of the map share its datasources, so they're always
+  // pooled. without a limit, the pool grows to one instance for each
+  // thread rendering at the same time, and no thread has to wait.
+  avecado::pool_datasources(map_, (options_.datasource_pool_size > 0) ?
+                            options_.datasource_pool_size :
+                            std::numeric_limits<std::size_t>::max());
 }
 
 mapnik_handler_factory::~mapnik_handler_factory() {
 }
 
 void mapnik_handler_factory::thread_setup(boost::thread_specific_ptr<request_handler> &ptr, const std::string &port) {
-  ptr.reset(new mapnik_request_handler(options_, port));
+  avecado::util::stopwatch timer;
+  ptr.reset(new mapnik_request_handler(options_, port, map_));
+  // format the message first, so that it isn't interleaved with the
+  // same message from the other threads starting up.
+  std::cout << (boost::format("Mapnik map copied for thread in %1% ms.\n")
+                % timer.elapsed_ms()).str() << std::flush;
+}
+
+avecado::datasource_pool_stats mapnik_handler_factory::pool_stats() const {
+  return avecado::pooled_datasource_stats(map_);
 }
 
 } // namespace server3
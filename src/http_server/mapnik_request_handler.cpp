@@ -8,58 +8,42 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 
-#include <sstream>
 #include <string>
-#include <ctime>
-#include <chrono>
-#include <iomanip>
-#include <boost/lexical_cast.hpp>
-#include <boost/algorithm/string/predicate.hpp>
+#include <cstdio>
+#include <algorithm>
 #include <boost/format.hpp>
 
 #include "http_server/mapnik_request_handler.hpp"
 #include "http_server/parse_path.hpp"
+#include "http_server/http_date.hpp"
 #include "http_server/reply.hpp"
 #include "http_server/request.hpp"
 
-#include <mapnik/load_map.hpp>
-
 // for vector tile creation
 #include "avecado.hpp"
 #include "tilejson.hpp"
 #include "util.hpp"
 
 namespace {
-std::string make_http_date() {
-  std::stringstream out;
-  std::time_t t = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-  struct tm tt;
-  gmtime_r(&t, &tt);
-  char *oldlocale = setlocale(LC_TIME, NULL);
-  setlocale(LC_TIME, "C");
-  char buf[30];
-  strftime(buf, 30, "%a, %d %b %Y %H:%M:%S GMT", &tt);
-  setlocale(LC_TIME, oldlocale);
-  return std::string(buf);
-}
-
-std::string strip_query_params(const std::string &str) {
-  return str.substr(0, str.find('?'));
+// sets the header to the decimal representation of the number without
+// going through a temporary string.
+void set_header_value(http::server3::header &h, std::size_t value) {
+  char buf[24];
+  int len = snprintf(buf, sizeof buf, "%zu", value);
+  h.value.assign(buf, len);
 }
 } // anonymous namespace
 
 namespace http {
 namespace server3 {
 
-mapnik_request_handler::mapnik_request_handler(const mapnik_server_options &options, std::string port)
-  : map_(),
+mapnik_request_handler::mapnik_request_handler(const mapnik_server_options &options, std::string port,
+                                               const mapnik::Map &map)
+  : map_(map),
     options_(options),
     port_(port),
     max_age_value_((boost::format("max-age = %1%") % options_.max_age).str())
 {
-  std::cout << "Loading mapnik map..." << std::endl;
-  mapnik::load_map(map_, options_.map_file);
-  std::cout << "Mapnik map loaded." << std::endl;
 }
 
 void mapnik_request_handler::handle_request(const request& req, reply& rep)
@@ -70,9 +54,12 @@ void mapnik_request_handler::handle_request(const request& req, reply& rep)
 
 void mapnik_request_handler::handle_request_impl(const request &req, reply &rep)
 {
-  // Decode url to path.
-  std::string request_path;
-  if (!url_decode(strip_query_params(req.uri), request_path))
+  // Decode url to path, ignoring any query parameters. the path is
+  // decoded into a buffer which is re-used between requests.
+  const char *uri_begin = req.uri.data();
+  const char *uri_end = uri_begin + req.uri.size();
+  const char *query = std::find(uri_begin, uri_end, '?');
+  if (!url_decode(uri_begin, query, request_path_))
   {
     rep = reply::stock_reply(reply::bad_request);
     return;
@@ -80,11 +67,11 @@ void mapnik_request_handler::handle_request_impl(const request &req, reply &rep)
 
   try {
     // serve tilejson
-    if (request_path == "/tile.json") {
+    if (request_path_ == "/tile.json") {
       handle_request_json(req, rep);
 
     } else {
-      handle_request_tile(req, rep, request_path);
+      handle_request_tile(req, rep, request_path_);
     }
 
   } catch (...) {
@@ -99,9 +86,9 @@ void mapnik_request_handler::handle_request_json(const request &req, reply &rep)
   rep.status = reply::ok;
   rep.is_hard_error = false;
   rep.content = std::move(json);
-  rep.headers.resize(6);
+  reuse_headers(rep, 6);
   rep.headers[0].name = "Content-Length";
-  rep.headers[0].value = boost::lexical_cast<std::string>(rep.content.size());
+  set_header_value(rep.headers[0], rep.content.size());
   rep.headers[1].name = "Content-Type";
   rep.headers[1].value = "application/json";
   rep.headers[2].name = "Access-Control-Allow-Origin";
@@ -111,7 +98,7 @@ void mapnik_request_handler::handle_request_json(const request &req, reply &rep)
   rep.headers[4].name = "Cache-control";
   rep.headers[4].value = max_age_value_;
   rep.headers[5].name = "Date";
-  rep.headers[5].value = make_http_date();
+  rep.headers[5].value.assign(current_http_date(), http_date_length);
 }
 
 void mapnik_request_handler::handle_request_tile(const request &req, reply &rep,
@@ -139,9 +126,10 @@ void mapnik_request_handler::handle_request_tile(const request &req, reply &rep,
     return;
   }
 
-  // setup map parameters
-  map_.resize(256, 256);
-  map_.zoom_to_box(avecado::util::box_for_tile(z, x, y));
+  // the extent and size of the tile are passed separately, so that
+  // the map itself isn't modified.
+  const mapnik::request map_request =
+    avecado::util::request_for_tile(z, x, y, 256, options_.buffer_size);
 
   boost::optional<const avecado::post_processor &> pp = boost::none;
   if (options_.post_processor) {
@@ -152,18 +140,22 @@ void mapnik_request_handler::handle_request_tile(const request &req, reply &rep,
 
   // actually making the vector tile
   bool painted = avecado::make_vector_tile(
-    tile, options_.path_multiplier, map_, options_.buffer_size,
+    tile, options_.path_multiplier, map_, map_request,
     options_.scale_factor, options_.offset_x, options_.offset_y,
     options_.tolerance, options_.image_format, options_.scaling_method,
     options_.scale_denominator, pp);
 
   // Fill out the reply to be sent to the client.
+  rep.content = painted ? tile.get_data(options_.compression_level) : "";
+  fill_tile_reply(rep);
+}
+
+void mapnik_request_handler::fill_tile_reply(reply &rep) {
   rep.status = reply::ok;
   rep.is_hard_error = false;
-  rep.content = painted ? tile.get_data(options_.compression_level) : "";
-  rep.headers.resize(7);
+  reuse_headers(rep, 7);
   rep.headers[0].name = "Content-Length";
-  rep.headers[0].value = boost::lexical_cast<std::string>(rep.content.size());
+  set_header_value(rep.headers[0], rep.content.size());
   rep.headers[1].name = "Content-Type";
   rep.headers[1].value = "application/octet-stream";
   rep.headers[2].name = "Access-Control-Allow-Origin";
@@ -173,7 +165,7 @@ void mapnik_request_handler::handle_request_tile(const request &req, reply &rep,
   rep.headers[4].name = "Cache-control";
   rep.headers[4].value = max_age_value_;
   rep.headers[5].name = "Date";
-  rep.headers[5].value = make_http_date();
+  rep.headers[5].value.assign(current_http_date(), http_date_length);
   // make sure that the response header is set appropriately for the level
   // of compression that we are applying, so that the client doesn't have
   // to inspect the file and try to figure out if it's supposed to be
@@ -1,41 +1,65 @@
 #include "http_server/parse_path.hpp"
 
-#include <boost/lexical_cast.hpp>
-#include <boost/algorithm/string/split.hpp>
-#include <boost/algorithm/string/classification.hpp>
+#include <cstring>
+#include <limits>
 
 namespace http {
 namespace server3 {
 
-bool parse_path(const std::string &path, int &z, int &x, int &y)
+namespace {
+
+// parse a '/' followed by a non-negative decimal number, advancing
+// `itr` past the number.
+bool parse_segment(const char *&itr, const char *end, int &val) {
+  if ((itr == end) || (*itr != '/')) {
+    return false;
+  }
+  ++itr;
+
+  const char *start = itr;
+  val = 0;
+  while ((itr != end) && (*itr >= '0') && (*itr <= '9')) {
+    // reject anything which would overflow an int.
+    const int digit = *itr - '0';
+    if (val > (std::numeric_limits<int>::max() - digit) / 10) {
+      return false;
+    }
+    val = 10 * val + digit;
+    ++itr;
+  }
+
+  // must have had at least one digit
+  return itr != start;
+}
+
+} // anonymous namespace
+
+bool parse_path(const char *begin, const char *end, int &z, int &x, int &y)
 {
-  std::vector<std::string> splits;
-  boost::algorithm::split(splits, path, boost::algorithm::is_any_of("/."));
-  
   // we're expecting a leading /, then 3 numbers separated by /,
   // then ".pbf" at the end.
-  if (splits.size() != 5) {
-    return false;
-  }
+  const char *itr = begin;
+  int zz = 0, xx = 0, yy = 0;
 
-  if (splits[0] != "") {
+  if (!parse_segment(itr, end, zz) ||
+      !parse_segment(itr, end, xx) ||
+      !parse_segment(itr, end, yy)) {
     return false;
   }
 
-  if (splits[4] != "pbf") {
+  if ((end - itr != 4) || (std::memcmp(itr, ".pbf", 4) != 0)) {
     return false;
   }
 
-  try {
-    z = boost::lexical_cast<int>(splits[1]);
-    x = boost::lexical_cast<int>(splits[2]);
-    y = boost::lexical_cast<int>(splits[3]);
-
-    return true;
+  z = zz;
+  x = xx;
+  y = yy;
+  return true;
+}
 
-  } catch (...) {
-    return false;
-  }
+bool parse_path(const std::string &path, int &z, int &x, int &y)
+{
+  return parse_path(path.data(), path.data() + path.size(), z, x, y);
 }
 
 } }
@@ -8,41 +8,19 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 
-#include <sstream>
 #include <string>
-#include <ctime>
-#include <chrono>
-#include <iomanip>
-#include <boost/lexical_cast.hpp>
-#include <boost/algorithm/string/predicate.hpp>
-#include <boost/format.hpp>
 
 #include "http_server/request_handler.hpp"
-#include "http_server/parse_path.hpp"
 #include "http_server/reply.hpp"
 #include "http_server/request.hpp"
 
-// for vector tile creation
-#include "avecado.hpp"
-#include "tilejson.hpp"
-#include "util.hpp"
-
 namespace {
-std::string make_http_date() {
-  std::stringstream out;
-  std::time_t t = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-  struct tm tt;
-  gmtime_r(&t, &tt);
-  char *oldlocale = setlocale(LC_TIME, NULL);
-  setlocale(LC_TIME, "C");
-  char buf[30];
-  strftime(buf, 30, "%a, %d %b %Y %H:%M:%S GMT", &tt);
-  setlocale(LC_TIME, oldlocale);
-  return std::string(buf);
-}
-
-std::string strip_query_params(const std::string &str) {
-  return str.substr(0, str.find('?'));
+// returns the value of a hex digit, or -1 if it isn't one.
+inline int hex_value(char c) {
+  if ((c >= '0') && (c <= '9')) { return c - '0'; }
+  if ((c >= 'a') && (c <= 'f')) { return c - 'a' + 10; }
+  if ((c >= 'A') && (c <= 'F')) { return c - 'A' + 10; }
+  return -1;
 }
 } // anonymous namespace
 
@@ -53,16 +31,20 @@ request_handler::~request_handler() {
 }
 
 bool request_handler::url_decode(const std::string& in, std::string& out) {
+  return url_decode(in.data(), in.data() + in.size(), out);
+}
+
+bool request_handler::url_decode(const char *begin, const char *end, std::string& out) {
   out.clear();
-  out.reserve(in.size());
-  for (std::size_t i = 0; i < in.size(); ++i) {
-    if (in[i] == '%') {
-      if (i + 3 <= in.size()) {
-        int value = 0;
-        std::istringstream is(in.substr(i + 1, 2));
-        if (is >> std::hex >> value) {
-          out += static_cast<char>(value);
-          i += 2;
+  out.reserve(end - begin);
+  for (const char *itr = begin; itr != end; ++itr) {
+    if (*itr == '%') {
+      if (end - itr >= 3) {
+        int hi = hex_value(itr[1]);
+        int lo = hex_value(itr[2]);
+        if ((hi >= 0) && (lo >= 0)) {
+          out += static_cast<char>(16 * hi + lo);
+          itr += 2;
 
         } else {
           return false;
@@ -72,15 +54,32 @@ bool request_handler::url_decode(const std::string& in, std::string& out) {
         return false;
       }
 
-    } else if (in[i] == '+') {
+    } else if (*itr == '+') {
       out += ' ';
 
     } else {
-      out += in[i];
+      out += *itr;
     }
   }
   return true;
 }
 
+void request_handler::recycle(reply& rep) {
+  // only keep the largest set of headers seen, there's no need to keep
+  // more than one around as each thread only makes one reply at a time.
+  if (rep.headers.capacity() > spare_headers_.capacity()) {
+    spare_headers_.swap(rep.headers);
+  }
+}
+
+void request_handler::reuse_headers(reply& rep, std::size_t n) {
+  if (rep.headers.capacity() < spare_headers_.capacity()) {
+    rep.headers.swap(spare_headers_);
+  }
+  // note: resize keeps the existing strings, and with them the storage
+  // which they have already allocated.
+  rep.headers.resize(n);
+}
+
 } // namespace server3
 } // namespace http
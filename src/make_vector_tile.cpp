@@ -2,6 +2,7 @@
 #include "vector_tile.pb.h"
 
 #include <mapnik/map.hpp>
+#include <mapnik/request.hpp>
 #include <mapnik/feature.hpp>
 
 #include "vector_tile_processor.hpp"
@@ -21,16 +22,34 @@ bool make_vector_tile(tile &tile,
                       mapnik::scaling_method_e scaling_method,
                       double scale_denominator,
                       boost::optional<const post_processor &> pp) {
-  
-  typedef backend backend_type;
-  typedef mapnik::vector_tile_impl::processor<backend_type> renderer_type;
-  
-  backend_type backend(tile.mapnik_tile(), path_multiplier, map, pp);
-  
+
   mapnik::request request(map.width(),
                           map.height(),
                           map.get_current_extent());
   request.set_buffer_size(buffer_size);
+
+  return make_vector_tile(tile, path_multiplier, map, request, scale_factor,
+                          offset_x, offset_y, tolerance, image_format,
+                          scaling_method, scale_denominator, pp);
+}
+
+bool make_vector_tile(tile &tile,
+                      unsigned int path_multiplier,
+                      mapnik::Map const& map,
+                      mapnik::request const& request,
+                      double scale_factor,
+                      unsigned int offset_x,
+                      unsigned int offset_y,
+                      unsigned int tolerance,
+                      const std::string &image_format,
+                      mapnik::scaling_method_e scaling_method,
+                      double scale_denominator,
+                      boost::optional<const post_processor &> pp) {
+  
+  typedef backend backend_type;
+  typedef mapnik::vector_tile_impl::processor<backend_type> renderer_type;
+  
+  backend_type backend(tile.mapnik_tile(), path_multiplier, request, pp);
   
   renderer_type ren(backend,
                     map,
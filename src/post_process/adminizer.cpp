@@ -628,7 +628,7 @@ public:
   adminizer(pt::ptree const& config);
   virtual ~adminizer();
 
-  virtual void process(std::vector<mapnik::feature_ptr> &layer, mapnik::Map const& map) const;
+  virtual void process(std::vector<mapnik::feature_ptr> &layer, mapnik::request const& request) const;
 
 private:
   std::vector<entry> make_entries(const mapnik::box2d<double> &env) const;
@@ -787,7 +787,7 @@ void adminizer::adminize_feature(mapnik::feature_ptr &&f,
   }
 }
 
-void adminizer::process(std::vector<mapnik::feature_ptr> &layer, mapnik::Map const& map) const {
+void adminizer::process(std::vector<mapnik::feature_ptr> &layer, mapnik::request const& request) const {
   // build extent of all features in layer
   mapnik::box2d<double> env = envelope(layer);
 
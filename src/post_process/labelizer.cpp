@@ -12,10 +12,10 @@ public:
   labelizer() {}
   virtual ~labelizer() {}
 
-  virtual void process(std::vector<mapnik::feature_ptr> &layer, mapnik::Map const& map) const;
+  virtual void process(std::vector<mapnik::feature_ptr> &layer, mapnik::request const& request) const;
 };
 
-void labelizer::process(std::vector<mapnik::feature_ptr> &layer, mapnik::Map const& map) const {
+void labelizer::process(std::vector<mapnik::feature_ptr> &layer, mapnik::request const& request) const {
   // TODO: labelize!
 }
 
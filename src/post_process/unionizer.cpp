@@ -495,7 +495,7 @@ public:
     const double angle_union_sample_ratio);
   virtual ~unionizer() {}
 
-  virtual void process(vector<mapnik::feature_ptr> &layer, mapnik::Map const& map) const;
+  virtual void process(vector<mapnik::feature_ptr> &layer, mapnik::request const& request) const;
 
 private:
 
@@ -515,14 +515,14 @@ unionizer::unionizer(const union_heuristic heuristic, const tag_strategy strateg
   m_match_tags(match_tags), m_preserve_direction_tags(preserve_direction_tags), m_angle_union_sample_ratio(angle_union_sample_ratio) {
 }
 
-void unionizer::process(vector<mapnik::feature_ptr>& layer, mapnik::Map const& map) const {
+void unionizer::process(vector<mapnik::feature_ptr>& layer, mapnik::request const& request) const {
   //if they are using an angle union heuristic they need to know the distance along the feature
   //to use for estimating an angle that represents the curve leaving the union point
   //so we let them say how many units in each axis we should travel before we have enough data
   //to make an approximation. this is rife with assumptions (non constant units per pixel as
   //you vary the x or y coordinates) but hopefully works well enough for commonly used projections
-  double width_units = map.get_current_extent().width() * m_angle_union_sample_ratio;
-  double height_units = map.get_current_extent().height() * m_angle_union_sample_ratio;
+  double width_units = request.extent().width() * m_angle_union_sample_ratio;
+  double height_units = request.extent().height() * m_angle_union_sample_ratio;
 
   //TODO: this could be a lot more efficient and is currently only implemented for ease of reading.
   //we could instead of getting the candidates every time only compute them once and make new ones
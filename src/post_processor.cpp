@@ -14,7 +14,7 @@ namespace {
   //turn a zoom level into mapnik scale which is units per pixel:
   //https://github.com/mapnik/mapnik/wiki/ScaleAndPpi
   const double WORLD_CIRCUMFERENCE_METERS = 40075016.68;
-  double meters_per_pixel(const mapnik::Map& m, const double z) {
+  double meters_per_pixel(const mapnik::request& m, const double z) {
     //if we fit the whole world into a tile this size
     //this is how many meters per pixel per axis we would have
     //most often width and height will be 256 pixels
@@ -52,7 +52,7 @@ public:
   void load(pt::ptree const& config);
   size_t process_layer(std::vector<mapnik::feature_ptr> & layer,
                      const std::string &layer_name,
-                     mapnik::Map const& map) const;
+                     mapnik::request const& request) const;
 private:
   layer_map_t m_layer_processes;
 };
@@ -92,19 +92,19 @@ void post_processor::pimpl::load(pt::ptree const& config) {
 // Find post-processes for given layer at scale and run them
 size_t post_processor::pimpl::process_layer(std::vector<mapnik::feature_ptr> & layer,
                                           const std::string &layer_name,
-                                          mapnik::Map const& map) const {
+                                          mapnik::request const& request) const {
   size_t ran = 0;
   layer_map_t::const_iterator layer_itr = m_layer_processes.find(layer_name);
   if (layer_itr != m_layer_processes.end()) {
     scale_range_vec_t const& scale_ranges = layer_itr->second;
     // TODO: Consider ways to optimize scale range look up
     for (auto range : scale_ranges) {
-      double min_scale = meters_per_pixel(map, range.maxzoom);
-      double max_scale = meters_per_pixel(map, range.minzoom);
-      if (map.scale() >= min_scale && map.scale() <= max_scale) {
+      double min_scale = meters_per_pixel(request, range.maxzoom);
+      double max_scale = meters_per_pixel(request, range.minzoom);
+      if (request.scale() >= min_scale && request.scale() <= max_scale) {
         // TODO: unserialize geometry objects to pass through izers
         for (auto p : range.processes) {
-          p->process(layer, map);
+          p->process(layer, request);
           ++ran;
         }
         break;
@@ -127,10 +127,17 @@ void post_processor::load(pt::ptree const& config) {
   m_impl.swap(impl);
 }
 
+size_t post_processor::process_layer(std::vector<mapnik::feature_ptr> &layer,
+                                   const std::string &layer_name,
+                                   mapnik::request const& request) const {
+  return m_impl->process_layer(layer, layer_name, request);
+}
+
 size_t post_processor::process_layer(std::vector<mapnik::feature_ptr> &layer,
                                    const std::string &layer_name,
                                    mapnik::Map const& map) const {
-  return m_impl->process_layer(layer, layer_name, map);
+  mapnik::request request(map.width(), map.height(), map.get_current_extent());
+  return m_impl->process_layer(layer, layer_name, request);
 }
 
 } // namespace avecado
@@ -25,9 +25,9 @@ str mk_tile(object py_map,
             double scale_denominator,
             object post_processor) {
 
-  mapnik::Map &map = extract<mapnik::Map &>(py_map);
-  map.resize(256, 256);
-  map.zoom_to_box(avecado::util::box_for_tile(z, x, y));
+  const mapnik::Map &map = extract<const mapnik::Map &>(py_map);
+  const mapnik::request request =
+    avecado::util::request_for_tile(z, x, y, 256, buffer_size);
 
   boost::optional<const avecado::post_processor &> pp = boost::none;
   if (!post_processor.is_none()) {
@@ -52,7 +52,7 @@ str mk_tile(object py_map,
     throw std::runtime_error(err.str());
   }
 
-  avecado::make_vector_tile(tile, path_multiplier, map, buffer_size,
+  avecado::make_vector_tile(tile, path_multiplier, map, request,
                             scale_factor, offset_x, offset_y,
                             tolerance, image_format, scaling_method,
                             scale_denominator, pp);
@@ -61,7 +61,7 @@ void process_layers(std::vector<mapnik::layer> const &layers,
 } // anonymous namespace
 
 bool render_vector_tile(mapnik::image_rgba8 &image,
-                        tile &avecado_tile,
+                        tile const &avecado_tile,
                         mapnik::Map const &map,
                         double scale_factor,
                         unsigned int buffer_size) {
@@ -96,4 +96,26 @@ bool render_vector_tile(mapnik::image_rgba8 &image,
   return true;
 }
 
+bool render_vector_tile(mapnik::image_rgba8 &image,
+                        tile &avecado_tile,
+                        unsigned int z, unsigned int x, unsigned int y,
+                        util::cut_cache &cache,
+                        mapnik::Map const &map,
+                        double scale_factor,
+                        unsigned int buffer_size) {
+  if (z <= avecado_tile.z) {
+    return render_vector_tile(image, avecado_tile, map, scale_factor, buffer_size);
+  }
+
+  // the buffer is in pixels, but the cut wants it as a fraction of
+  // the size of the tile being rendered.
+  const double buffer = (map.width() > 0) ? (double(buffer_size) / map.width()) : 0.0;
+
+  tile cut(avecado_tile.z, avecado_tile.x, avecado_tile.y,
+           cache.cut(avecado_tile.share(), avecado_tile.z, avecado_tile.x, avecado_tile.y,
+                     z, x, y, buffer));
+
+  return render_vector_tile(image, cut, map, scale_factor, buffer_size);
+}
+
 } // namespace avecado
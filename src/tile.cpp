@@ -10,6 +10,11 @@ tile::tile(unsigned int z_, unsigned int x_, unsigned int y_)
   : z(z_), x(x_), y(y_), m_mapnik_tile(new vector_tile::Tile) {
 }
 
+tile::tile(unsigned int z_, unsigned int x_, unsigned int y_,
+           std::shared_ptr<const vector_tile::Tile> data)
+  : z(z_), x(x_), y(y_), m_shared_tile(std::move(data)) {
+}
+
 tile::~tile() {
 }
 
@@ -20,20 +25,43 @@ std::string tile::get_data(int compression_level) const {
 }
 
 void tile::from_string(const std::string &str) {
-  tile t(z, x, y);
-  std::istringstream buffer(str);
-  buffer >> t;
-  m_mapnik_tile.swap(t.m_mapnik_tile);
+  from_buffer(str.data(), str.size());
+}
+
+void tile::from_buffer(const char *data, std::size_t size) {
+  std::unique_ptr<vector_tile::Tile> t(new vector_tile::Tile);
+  google::protobuf::io::ArrayInputStream stream(data, int(size));
+  google::protobuf::io::GzipInputStream gz_stream(&stream);
+
+  if (!t->ParseFromZeroCopyStream(&gz_stream)) {
+    throw std::runtime_error("Unable to read tile from buffer.");
+  }
+
+  m_mapnik_tile.swap(t);
+  m_shared_tile.reset();
 }
 
 vector_tile::Tile const &tile::mapnik_tile() const {
-  return *m_mapnik_tile;
+  return m_mapnik_tile ? *m_mapnik_tile : *m_shared_tile;
 }
 
 vector_tile::Tile &tile::mapnik_tile() {
+  if (!m_mapnik_tile) {
+    // copy-on-write, so that other holders of the shared data don't
+    // see the modifications.
+    m_mapnik_tile.reset(new vector_tile::Tile(*m_shared_tile));
+    m_shared_tile.reset();
+  }
   return *m_mapnik_tile;
 }
 
+std::shared_ptr<const vector_tile::Tile> tile::share() {
+  if (m_mapnik_tile) {
+    m_shared_tile = std::shared_ptr<const vector_tile::Tile>(std::move(m_mapnik_tile));
+  }
+  return m_shared_tile;
+}
+
 std::istream &operator>>(std::istream &in, tile &t) {
   google::protobuf::io::IstreamInputStream stream(&in);
   google::protobuf::io::GzipInputStream gz_stream(&stream);
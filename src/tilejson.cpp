@@ -1,6 +1,11 @@
 #include "tilejson.hpp"
 #include "fetch/overzoom.hpp"
 #include "fetch/http.hpp"
+#include "fetch/directory.hpp"
+#include "fetch/mbtiles.hpp"
+#include "fetch/memory.hpp"
+#include "fetch/tiered.hpp"
+#include "fetch/url_template.hpp"
 
 #include <boost/format.hpp>
 #include <boost/algorithm/string/predicate.hpp>
@@ -17,6 +22,10 @@
 
 #include <unordered_set>
 
+// default number of seconds to keep tiles in the memory cache, if
+// the TileJSON asks for one without saying for how long.
+#define DEFAULT_MEMORY_CACHE_SECONDS (300)
+
 namespace bpt = boost::property_tree;
 namespace bal = boost::algorithm;
 
@@ -141,9 +150,62 @@ std::unique_ptr<fetcher> make_tilejson_fetcher(const bpt::ptree &conf) {
     patterns.push_back(pattern.second.data());
   }
 
-  // construct fetchers
-  std::unique_ptr<fetcher> http(new fetch::http(std::move(patterns)));
-  std::unique_ptr<fetcher> overzoom(new fetch::overzoom(std::move(http), max_zoom, mask_zoom));
+  if (patterns.empty()) {
+    throw std::runtime_error("TileJSON doesn't have any tile URLs.");
+  }
+
+  // construct fetchers. local tiles are read directly, rather than
+  // going through curl. they're all the same tiles, so only the first
+  // pattern is used.
+  std::unique_ptr<fetcher> source;
+  if (bal::starts_with(patterns.front(), "file:")) {
+    source.reset(new fetch::directory(patterns.front()));
+
+  } else if (bal::starts_with(patterns.front(), "mbtiles:")) {
+    source.reset(new fetch::mbtiles(patterns.front()));
+
+  } else {
+    source.reset(new fetch::http(std::move(patterns)));
+  }
+
+  // optional tiers in front of the source, which aren't part of the
+  // TileJSON spec: "memoryCache" is the number of bytes of decoded
+  // tiles to keep in memory, for "memoryCacheSeconds", and
+  // "localTiles" is a directory or MBTiles file to look in before
+  // going to the source. a directory can be given as a pattern, with
+  // the same variables as the tile URLs, or as just a path, in which
+  // case the tiles are laid out as {z}/{x}/{y}.pbf under it. tiles
+  // from the source are written back to the memory cache and
+  // directory, but MBTiles are read-only.
+  std::vector<std::unique_ptr<fetcher> > tiers;
+
+  std::size_t memory_bytes = conf.get<std::size_t>("memoryCache", 0);
+  if (memory_bytes > 0) {
+    long memory_seconds = conf.get<long>("memoryCacheSeconds", DEFAULT_MEMORY_CACHE_SECONDS);
+    tiers.emplace_back(new fetch::memory(memory_bytes, memory_seconds));
+  }
+
+  boost::optional<std::string> local = conf.get_optional<std::string>("localTiles");
+  if (local) {
+    if (bal::starts_with(*local, "mbtiles:") || bal::ends_with(*local, ".mbtiles")) {
+      tiers.emplace_back(new fetch::mbtiles(*local));
+    } else if (fetch::url_template(*local).has_variables()) {
+      tiers.emplace_back(new fetch::directory(*local));
+    } else {
+      std::string dir = *local;
+      while ((dir.size() > 1) && bal::ends_with(dir, "/")) {
+        dir.erase(dir.size() - 1);
+      }
+      tiers.emplace_back(new fetch::directory(dir + "/{z}/{x}/{y}.pbf"));
+    }
+  }
+
+  if (!tiers.empty()) {
+    tiers.push_back(std::move(source));
+    source.reset(new fetch::tiered(std::move(tiers)));
+  }
+
+  std::unique_ptr<fetcher> overzoom(new fetch::overzoom(std::move(source), max_zoom, mask_zoom));
 
   return overzoom;
 }
@@ -16,5 +16,12 @@ mapnik::box2d<double> box_for_tile(int z, int x, int y) {
     half_world - y * scale);
 }
 
+mapnik::request request_for_tile(int z, int x, int y,
+                                 unsigned int size, int buffer_size) {
+  mapnik::request request(size, size, box_for_tile(z, x, y));
+  request.set_buffer_size(buffer_size);
+  return request;
+}
+
 } } // namespace avecado::util
 
@@ -1,6 +1,8 @@
 #include "util_tile.hpp"
 #include "vector_tile.pb.h"
 
+#include <algorithm>
+
 namespace avecado { namespace util {
 
 namespace {
@@ -104,4 +106,162 @@ bool is_interesting(const vector_tile::Tile_Layer &l) {
   }
 }
 
+namespace {
+
+// the bounds of a feature's geometry, in tile coordinates.
+struct bounds {
+  int32_t minx, miny, maxx, maxy;
+  bool empty;
+
+  bounds() : minx(0), miny(0), maxx(0), maxy(0), empty(true) {}
+
+  inline void add(int32_t x, int32_t y) {
+    if (empty) {
+      minx = maxx = x;
+      miny = maxy = y;
+      empty = false;
+
+    } else {
+      minx = std::min(minx, x); maxx = std::max(maxx, x);
+      miny = std::min(miny, y); maxy = std::max(maxy, y);
+    }
+  }
+};
+
+bounds feature_bounds(const vector_tile::Tile_Feature &f) {
+  const uint32_t geometry_size = f.geometry_size();
+  static const uint32_t cmd_bits = 3;
+
+  uint32_t repeat = 0, cmd = 0;
+  int32_t x = 0, y = 0;
+  bounds b;
+
+  for (uint32_t i = 0; i < geometry_size; ) {
+    if (repeat == 0) {
+      uint32_t entry = f.geometry(i++);
+      cmd = entry & ((1 << cmd_bits) - 1);
+      repeat = entry >> cmd_bits;
+
+    } else {
+      if ((cmd == 1) || (cmd == 2)) {
+        // a truncated geometry would otherwise read past the end.
+        if (i + 1 >= geometry_size) { break; }
+        int32_t dx = f.geometry(i++);
+        int32_t dy = f.geometry(i++);
+        dx = ((dx >> 1) ^ (-(dx & 1)));
+        dy = ((dy >> 1) ^ (-(dy & 1)));
+        x += dx;
+        y += dy;
+        b.add(x, y);
+      }
+      --repeat;
+    }
+  }
+
+  return b;
+}
+
+} // anonymous namespace
+
+void cut_tile(const vector_tile::Tile &in, unsigned int dz, unsigned int dx, unsigned int dy,
+              double buffer, vector_tile::Tile &out) {
+  out.Clear();
+
+  for (const vector_tile::Tile_Layer &layer : in.layers()) {
+    // the descendant's extent plus buffer, in the layer's coordinates.
+    const double size = double(layer.extent()) / double(1u << dz);
+    const double minx = (dx - buffer) * size, maxx = (dx + 1 + buffer) * size;
+    const double miny = (dy - buffer) * size, maxy = (dy + 1 + buffer) * size;
+
+    vector_tile::Tile_Layer *cut_layer = nullptr;
+
+    for (const vector_tile::Tile_Feature &feature : layer.features()) {
+      const bounds b = feature_bounds(feature);
+      if (b.empty || (b.maxx < minx) || (b.minx > maxx) || (b.maxy < miny) || (b.miny > maxy)) {
+        continue;
+      }
+
+      // layers are only added once they have a feature, so that
+      // layers with nothing left in them are dropped.
+      if (cut_layer == nullptr) {
+        cut_layer = out.add_layers();
+        cut_layer->set_version(layer.version());
+        cut_layer->set_name(layer.name());
+        cut_layer->set_extent(layer.extent());
+        // the features refer to keys and values by index, so these
+        // are kept whole.
+        cut_layer->mutable_keys()->CopyFrom(layer.keys());
+        cut_layer->mutable_values()->CopyFrom(layer.values());
+      }
+      *cut_layer->add_features() = feature;
+    }
+  }
+}
+
+cut_cache::cut_cache(std::size_t max_entries)
+  : m_max_entries(max_entries), m_hits(0), m_misses(0) {
+}
+
+cut_cache::~cut_cache() {
+}
+
+cut_cache::tile_data cut_cache::cut(tile_data data, unsigned int z, unsigned int x, unsigned int y,
+                                    unsigned int cz, unsigned int cx, unsigned int cy, double buffer) {
+  if (cz <= z) {
+    return data;
+  }
+
+  const key_type key(data.get(), cz, cx, cy, buffer);
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto itr = m_index.find(key);
+    if (itr != m_index.end()) {
+      m_lru.splice(m_lru.begin(), m_lru, itr->second);
+      ++m_hits;
+      return itr->second->cut;
+    }
+    ++m_misses;
+  }
+
+  // cut from the cut of the ancestor two levels up, unless that's
+  // the original tile, so that the cuts for all the descendants of
+  // that ancestor can share it.
+  tile_data source = data;
+  if (cz - z > 2) {
+    source = cut(data, z, x, y, cz - 2, cx >> 2, cy >> 2, buffer);
+  }
+
+  const unsigned int dz = cz - z;
+  const unsigned int mask = (1u << dz) - 1;
+  std::shared_ptr<vector_tile::Tile> result = std::make_shared<vector_tile::Tile>();
+  cut_tile(*source, dz, cx & mask, cy & mask, buffer, *result);
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_index.find(key) == m_index.end()) {
+    entry e;
+    e.key = key;
+    e.original = data;
+    e.cut = result;
+    m_lru.push_front(std::move(e));
+    m_index[key] = m_lru.begin();
+
+    while (m_lru.size() > m_max_entries) {
+      m_index.erase(m_lru.back().key);
+      m_lru.pop_back();
+    }
+  }
+
+  return result;
+}
+
+std::size_t cut_cache::hits() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_hits;
+}
+
+std::size_t cut_cache::misses() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_misses;
+}
+
 } } // namespace avecado::util
@@ -0,0 +1,94 @@
+#include "common.hpp"
+#include "datasource_pool.hpp"
+#include "util.hpp"
+
+#include <iostream>
+#include <future>
+#include <chrono>
+
+#include <mapnik/datasource_cache.hpp>
+#include <mapnik/featureset.hpp>
+#include <mapnik/layer.hpp>
+#include <mapnik/query.hpp>
+
+#include "config.h"
+
+namespace {
+
+mapnik::featureset_ptr query(const mapnik::Map &map) {
+  const mapnik::layer &layer = map.layers().at(0);
+  return layer.datasource()->features(mapnik::query(avecado::util::box_for_tile(0, 0, 0)));
+}
+
+void test_pooled_features() {
+  mapnik::Map map = test::make_map("test/single_line.xml", 256, 0, 0, 0);
+  avecado::pool_datasources(map, 2);
+
+  mapnik::featureset_ptr fs = query(map);
+  test::assert_equal<bool>(bool(fs), true, "featureset");
+  mapnik::feature_ptr feat = fs->next();
+  test::assert_equal<bool>(bool(feat), true, "feature");
+  test::assert_equal<std::string>(feat->get("name").to_string(), "null highway", "name");
+
+  avecado::datasource_pool_stats stats = avecado::pooled_datasource_stats(map);
+  test::assert_equal<std::size_t>(stats.borrows, 1, "borrows");
+  test::assert_equal<std::size_t>(stats.waits, 0, "waits");
+  test::assert_equal<std::size_t>(stats.instances, 1, "instances");
+}
+
+void test_pool_grows_to_cap() {
+  mapnik::Map map = test::make_map("test/single_line.xml", 256, 0, 0, 0);
+  avecado::pool_datasources(map, 2);
+
+  // holding on to the featuresets keeps the datasources borrowed.
+  mapnik::featureset_ptr fs1 = query(map);
+  mapnik::featureset_ptr fs2 = query(map);
+
+  avecado::datasource_pool_stats stats = avecado::pooled_datasource_stats(map);
+  test::assert_equal<std::size_t>(stats.instances, 2, "instances");
+  test::assert_equal<std::size_t>(stats.waits, 0, "waits");
+
+  // a copy of the map shares the same pool, so the third query has
+  // to wait until one of the others is handed back.
+  mapnik::Map copy(map);
+  std::future<mapnik::featureset_ptr> third =
+    std::async(std::launch::async, &query, std::cref(copy));
+  test::assert_equal<bool>(third.wait_for(std::chrono::milliseconds(100)) == std::future_status::timeout,
+                           true, "third query should wait");
+
+  fs1.reset();
+  test::assert_equal<bool>(bool(third.get()), true, "third featureset");
+
+  stats = avecado::pooled_datasource_stats(map);
+  test::assert_equal<std::size_t>(stats.instances, 2, "instances after wait");
+  test::assert_equal<std::size_t>(stats.borrows, 3, "borrows");
+  test::assert_equal<std::size_t>(stats.waits, 1, "waits");
+}
+
+void test_pool_twice_is_noop() {
+  mapnik::Map map = test::make_map("test/single_line.xml", 256, 0, 0, 0);
+  avecado::pool_datasources(map, 1);
+  mapnik::datasource_ptr ds = map.layers().at(0).datasource();
+  avecado::pool_datasources(map, 1);
+  test::assert_equal<bool>(ds == map.layers().at(0).datasource(), true, "datasource replaced");
+}
+
+} // anonymous namespace
+
+int main() {
+  int tests_failed = 0;
+
+  std::cout << "== Testing datasource pool ==" << std::endl << std::endl;
+
+  // need datasource cache set up so that input plugins are available
+  mapnik::datasource_cache::instance().register_datasources(MAPNIK_DEFAULT_INPUT_PLUGIN_DIR);
+
+#define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
+  RUN_TEST(test_pooled_features);
+  RUN_TEST(test_pool_grows_to_cap);
+  RUN_TEST(test_pool_twice_is_noop);
+
+  std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
@@ -0,0 +1,154 @@
+#include "common.hpp"
+#include "fetch/directory.hpp"
+#include "vector_tile.pb.h"
+
+#include <boost/format.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <fstream>
+#include <iostream>
+
+namespace bfs = boost::filesystem;
+using avecado::fetch_status;
+
+namespace {
+
+// write a tile with a single layer named after its coordinates, so
+// that it's possible to tell which file it was read from.
+void write_tile(const bfs::path &dir, int z, int x, int y) {
+  avecado::tile tile(z, x, y);
+  tile.mapnik_tile().add_layers()->set_name((boost::format("%1%/%2%/%3%") % z % x % y).str());
+  tile.mapnik_tile().mutable_layers(0)->set_version(1);
+
+  const bfs::path file = dir / std::to_string(z) / std::to_string(x) / (std::to_string(y) + ".pbf");
+  bfs::create_directories(file.parent_path());
+  std::ofstream out(file.native());
+  out << tile.get_data();
+}
+
+std::string pattern_for(const bfs::path &dir) {
+  return (boost::format("file://%1%/{z}/{x}/{y}.pbf") % dir.native()).str();
+}
+
+fetch_status status_of(avecado::fetch_response &response) {
+  test::assert_equal<bool>(response.is_right(), true, "should be an error");
+  return response.right().status;
+}
+
+void test_fetch_tile() {
+  test::temp_dir dir;
+  write_tile(dir.path(), 3, 2, 1);
+  write_tile(dir.path(), 3, 1, 2);
+
+  avecado::fetch::directory fetch(pattern_for(dir.path()));
+  avecado::fetch_response response(fetch(avecado::request(3, 2, 1)).get());
+
+  test::assert_equal<bool>(response.is_left(), true, "should find tile");
+  const avecado::tile &tile = *response.left();
+  test::assert_equal<int>(tile.z, 3, "tile z");
+  test::assert_equal<int>(tile.x, 2, "tile x");
+  test::assert_equal<int>(tile.y, 1, "tile y");
+  test::assert_equal<int>(tile.mapnik_tile().layers_size(), 1, "number of layers");
+  test::assert_equal<std::string>(tile.mapnik_tile().layers(0).name(), "3/2/1", "layer name");
+}
+
+void test_plain_path() {
+  test::temp_dir dir;
+  write_tile(dir.path(), 0, 0, 0);
+
+  avecado::fetch::directory fetch((dir.path() / "{z}" / "{x}" / "{y}.pbf").native());
+  avecado::fetch_response response(fetch(avecado::request(0, 0, 0)).get());
+  test::assert_equal<bool>(response.is_left(), true, "should find tile");
+}
+
+void test_file_url_forms() {
+  test::temp_dir dir;
+  const bfs::path base = dir.path() / "with space";
+  write_tile(base, 3, 2, 1);
+
+  const std::string escaped = (dir.path() / "with%20space").native();
+  const char *prefixes[] = { "file://", "file://localhost", "file:", "FILE://" };
+  for (const char *prefix : prefixes) {
+    const std::string pattern = std::string(prefix) + escaped + "/{z}/{x}/{y}.pbf";
+    avecado::fetch::directory fetch(pattern);
+    avecado::fetch_response response(fetch(avecado::request(3, 2, 1)).get());
+    test::assert_equal<bool>(response.is_left(), true, (boost::format("should find tile through %1%") % pattern).str());
+  }
+
+  bool threw = false;
+  try {
+    avecado::fetch::directory fetch("file://example.com/srv/{z}/{x}/{y}.pbf");
+  } catch (const std::exception &) {
+    threw = true;
+  }
+  test::assert_equal<bool>(threw, true, "should not read tiles from another host");
+}
+
+void test_missing_tile() {
+  test::temp_dir dir;
+  write_tile(dir.path(), 3, 2, 1);
+
+  avecado::fetch::directory fetch(pattern_for(dir.path()));
+  avecado::fetch_response missing(fetch(avecado::request(3, 2, 2)).get());
+  test::assert_equal<int>(int(status_of(missing)), int(fetch_status::not_found), "missing file");
+
+  avecado::fetch_response no_dir(fetch(avecado::request(4, 2, 1)).get());
+  test::assert_equal<int>(int(status_of(no_dir)), int(fetch_status::not_found), "missing directory");
+
+  avecado::fetch_response negative(fetch(avecado::request(3, -1, 1)).get());
+  test::assert_equal<int>(int(status_of(negative)), int(fetch_status::not_found), "negative coordinate");
+}
+
+void test_corrupt_tile() {
+  test::temp_dir dir;
+  write_tile(dir.path(), 0, 0, 0);
+
+  // as if the file were only partly written.
+  const bfs::path file = dir.path() / "0" / "0" / "0.pbf";
+  bfs::resize_file(file, bfs::file_size(file) / 2);
+
+  avecado::fetch::directory fetch(pattern_for(dir.path()));
+  avecado::fetch_response response(fetch(avecado::request(0, 0, 0)).get());
+  test::assert_equal<int>(int(status_of(response)), int(fetch_status::server_error), "corrupt tile");
+}
+
+void test_not_modified() {
+  using boost::posix_time::hours;
+  using boost::posix_time::second_clock;
+
+  test::temp_dir dir;
+  write_tile(dir.path(), 0, 0, 0);
+
+  avecado::fetch::directory fetch(pattern_for(dir.path()));
+
+  avecado::request later(0, 0, 0);
+  later.if_modified_since = second_clock::universal_time() + hours(1);
+  avecado::fetch_response not_modified(fetch(later).get());
+  test::assert_equal<int>(int(status_of(not_modified)), int(fetch_status::not_modified), "unmodified tile");
+
+  avecado::request earlier(0, 0, 0);
+  earlier.if_modified_since = second_clock::universal_time() - hours(1);
+  avecado::fetch_response modified(fetch(earlier).get());
+  test::assert_equal<bool>(modified.is_left(), true, "modified tile");
+}
+
+} // anonymous namespace
+
+int main() {
+  int tests_failed = 0;
+
+  std::cout << "== Testing directory fetcher ==" << std::endl << std::endl;
+
+#define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
+  RUN_TEST(test_fetch_tile);
+  RUN_TEST(test_plain_path);
+  RUN_TEST(test_file_url_forms);
+  RUN_TEST(test_missing_tile);
+  RUN_TEST(test_corrupt_tile);
+  RUN_TEST(test_not_modified);
+
+  std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
@@ -6,6 +6,10 @@
 #include "logging/logger.hpp"
 #include "http_server/server.hpp"
 #include "http_server/mapnik_handler_factory.hpp"
+#include "http_server/batch.hpp"
+#include "http_server/http_date.hpp"
+#include "http_server/parse_path.hpp"
+#include "http_server/request_handler.hpp"
 #include "vector_tile.pb.h"
 
 #include <google/protobuf/io/zero_copy_stream_impl.h>
@@ -17,7 +21,13 @@
 
 #include <mapnik/datasource_cache.hpp>
 
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
 #include <iostream>
+#include <mutex>
+#include <set>
 
 #include <curl/curl.h>
 
@@ -54,6 +64,7 @@ mapnik_server_options default_mapnik_options(const std::string &map_file, int co
   options.map_file = map_file;
   options.max_age = 60;
   options.compression_level = compression_level;
+  options.datasource_pool_size = 0;
   return options;
 }
 
@@ -289,6 +300,167 @@ void test_tile_is_not_compressed() {
   test::assert_equal<bool>(read_ok, true, "tile was plain PBF");
 }
 
+void test_batch_parse() {
+  using http::server3::parse_batch;
+
+  std::vector<std::string> paths;
+  test::assert_equal<bool>(parse_batch("/batch?tiles=0/0/0,1/0-1/0-1.pbf", paths), true, "parse batch");
+  test::assert_equal<size_t>(paths.size(), 5, "number of tiles in batch");
+  test::assert_equal<std::string>(paths[0], "/0/0/0.pbf", "first tile path");
+  test::assert_equal<std::string>(paths[4], "/1/1/1.pbf", "last tile path");
+
+  paths.clear();
+  test::assert_equal<bool>(parse_batch("/batch?tiles=0/0/0%2C1/1/0", paths), true, "parse URL-encoded batch");
+  test::assert_equal<size_t>(paths.size(), 2, "number of tiles in URL-encoded batch");
+
+  paths.clear();
+  test::assert_equal<bool>(parse_batch("/batch?tiles=0/a/0", paths), false, "non-numeric batch");
+  paths.clear();
+  test::assert_equal<bool>(parse_batch("/batch?tiles=1/1-0/0", paths), false, "backwards range");
+  paths.clear();
+  test::assert_equal<bool>(parse_batch("/batch?tiles=20/0-99/0-99", paths), false, "over-sized batch");
+  paths.clear();
+  test::assert_equal<bool>(parse_batch("/batch", paths), false, "empty batch");
+
+  // ranges as wide as an int can be, or outside the zoom level.
+  paths.clear();
+  test::assert_equal<bool>(parse_batch("/batch?tiles=0/0-2147483647/0", paths), false, "huge range");
+  paths.clear();
+  test::assert_equal<bool>(parse_batch("/batch?tiles=30/0-1073741823/0-1073741823", paths), false, "huge area");
+  paths.clear();
+  test::assert_equal<bool>(parse_batch("/batch?tiles=1/0-2/0", paths), false, "range outside zoom level");
+  paths.clear();
+  test::assert_equal<bool>(parse_batch("/batch?tiles=31/0-15/0-15", paths), false, "range above max zoom");
+  paths.clear();
+  test::assert_equal<bool>(parse_batch("/batch?tiles=30/1073741823/1073741823", paths), true, "largest tile");
+  test::assert_equal<std::string>(paths[0], "/30/1073741823/1073741823.pbf", "largest tile path");
+  paths.clear();
+  test::assert_equal<bool>(parse_batch("/batch?tiles=30/1073741822-1073741823/1073741822-1073741823", paths), true, "largest range corner");
+  test::assert_equal<size_t>(paths.size(), 4, "number of tiles in largest range corner");
+
+  // the limit is on the whole batch, not each item.
+  paths.clear();
+  test::assert_equal<bool>(parse_batch("/batch?tiles=20/0-15/0-15", paths), true, "full batch");
+  test::assert_equal<size_t>(paths.size(), 256, "number of tiles in full batch");
+  paths.clear();
+  test::assert_equal<bool>(parse_batch("/batch?tiles=20/0-15/0-15,0/0/0", paths), false, "over-full batch");
+}
+
+void test_parse_path() {
+  using http::server3::parse_path;
+  int z = -1, x = -1, y = -1;
+
+  test::assert_equal<bool>(parse_path("/1/2/3.pbf", z, x, y), true, "valid path");
+  test::assert_equal<int>(z, 1, "z");
+  test::assert_equal<int>(x, 2, "x");
+  test::assert_equal<int>(y, 3, "y");
+
+  test::assert_equal<bool>(parse_path("/01/002/0003.pbf", z, x, y), true, "leading zeros");
+  test::assert_equal<int>(z, 1, "z with leading zeros");
+  test::assert_equal<int>(x, 2, "x with leading zeros");
+  test::assert_equal<int>(y, 3, "y with leading zeros");
+
+  test::assert_equal<bool>(parse_path("/30/1073741823/1073741823.pbf", z, x, y), true, "largest tile");
+  test::assert_equal<int>(z, 30, "largest tile z");
+  test::assert_equal<int>(x, 1073741823, "largest tile x");
+  test::assert_equal<int>(y, 1073741823, "largest tile y");
+  test::assert_equal<bool>(parse_path("/0/0000000000000000000001/0.pbf", z, x, y), true, "many leading zeros");
+  test::assert_equal<int>(x, 1, "x with many leading zeros");
+  test::assert_equal<bool>(parse_path("/0/2147483647/0.pbf", z, x, y), true, "INT_MAX");
+  test::assert_equal<int>(x, 2147483647, "INT_MAX x");
+  test::assert_equal<bool>(parse_path("/0/2147483648/0.pbf", z, x, y), false, "overflowing int");
+  test::assert_equal<bool>(parse_path("/0/99999999999999999999/0.pbf", z, x, y), false, "overflowing int by a lot");
+
+  test::assert_equal<bool>(parse_path("/1/2/3", z, x, y), false, "missing .pbf");
+  test::assert_equal<bool>(parse_path("/1/2/3.png", z, x, y), false, "other extension");
+  test::assert_equal<bool>(parse_path("/1/2/3.pbf?x=1", z, x, y), false, "trailing junk");
+  test::assert_equal<bool>(parse_path("/1/2/3/4.pbf", z, x, y), false, "too many segments");
+  test::assert_equal<bool>(parse_path("/1/2/.pbf", z, x, y), false, "empty segment");
+  test::assert_equal<bool>(parse_path("/1/-2/3.pbf", z, x, y), false, "negative coordinate");
+  test::assert_equal<bool>(parse_path("1/2/3.pbf", z, x, y), false, "no leading slash");
+}
+
+void test_url_decode() {
+  using http::server3::request_handler;
+  std::string out;
+
+  test::assert_equal<bool>(request_handler::url_decode("%41", out), true, "escape");
+  test::assert_equal<std::string>(out, "A", "decoded escape");
+  test::assert_equal<bool>(request_handler::url_decode("%2fa%2F", out), true, "either case escape");
+  test::assert_equal<std::string>(out, "/a/", "decoded either case escape");
+  test::assert_equal<bool>(request_handler::url_decode("a+b", out), true, "plus");
+  test::assert_equal<std::string>(out, "a b", "plus is a space");
+  test::assert_equal<bool>(request_handler::url_decode("%4", out), false, "truncated escape");
+  test::assert_equal<bool>(request_handler::url_decode("%zz", out), false, "non-hex escape");
+}
+
+void test_format_http_date() {
+  char buf[http::server3::http_date_length + 1];
+
+  http::server3::format_http_date(784111777, buf);
+  test::assert_equal<std::string>(buf, "Sun, 06 Nov 1994 08:49:37 GMT", "RFC 1123 example");
+  http::server3::format_http_date(0, buf);
+  test::assert_equal<std::string>(buf, "Thu, 01 Jan 1970 00:00:00 GMT", "epoch");
+  http::server3::format_http_date(951782400, buf);
+  test::assert_equal<std::string>(buf, "Tue, 29 Feb 2000 00:00:00 GMT", "leap day");
+  http::server3::format_http_date(4102444799, buf);
+  test::assert_equal<std::string>(buf, "Thu, 31 Dec 2099 23:59:59 GMT", "end of century");
+
+  const std::string now = http::server3::current_http_date();
+  test::assert_equal<std::size_t>(now.size(), http::server3::http_date_length, "current date length");
+  test::assert_equal<bool>(boost::algorithm::ends_with(now, " GMT"), true, "current date is GMT");
+}
+
+std::string fetch_raw(const std::string &uri) {
+  std::stringstream stream;
+
+  CURL *curl = curl_easy_init();
+  CURL_SETOPT(curl, CURLOPT_URL, uri.c_str());
+  CURL_SETOPT(curl, CURLOPT_WRITEFUNCTION, write_callback);
+  CURL_SETOPT(curl, CURLOPT_WRITEDATA, &stream);
+
+  CURLcode res = curl_easy_perform(curl);
+  if (res != CURLE_OK) {
+    throw std::runtime_error("cURL operation failed");
+  }
+
+  curl_easy_cleanup(curl);
+  return stream.str();
+}
+
+size_t count_occurrences(const std::string &haystack, const std::string &needle) {
+  size_t count = 0;
+  for (size_t pos = haystack.find(needle); pos != std::string::npos;
+       pos = haystack.find(needle, pos + needle.size())) {
+    ++count;
+  }
+  return count;
+}
+
+void test_batch_fetch() {
+  server_guard guard("test/single_line.xml");
+
+  std::string data = fetch_raw((boost::format("%1%/batch?tiles=0/0/0,1/0-1/0-1,1/2/0,30/1073741823/1073741823") % guard.base_url()).str());
+
+  // tiles come back in whatever order they were finished in, so just
+  // check that they're all present.
+  test::assert_equal<size_t>(count_occurrences(data, "X-Tile-Status: 200"), 6, "tiles found in batch");
+  test::assert_equal<size_t>(count_occurrences(data, "X-Tile-Status: 404"), 1, "tiles not found in batch");
+  for (auto path : {"/0/0/0.pbf", "/1/0/0.pbf", "/1/1/0.pbf", "/1/0/1.pbf", "/1/1/1.pbf", "/1/2/0.pbf",
+                    "/30/1073741823/1073741823.pbf"}) {
+    test::assert_equal<size_t>(count_occurrences(data, std::string("Content-Location: ") + path), 1, path);
+  }
+  test::assert_equal<bool>(boost::algorithm::ends_with(data, "--avecado-batch-boundary--\r\n"), true,
+                           "batch should end with closing boundary");
+}
+
+void test_batch_bad_request() {
+  server_guard guard("test/empty_map_file.xml");
+
+  std::string data = fetch_raw((boost::format("%1%/batch?tiles=0/x/0") % guard.base_url()).str());
+  test::assert_equal<size_t>(count_occurrences(data, "400 Bad Request"), 1, "malformed batch is a bad request");
+}
+
 struct cache_header_checker_handler : public request_handler {
   virtual ~cache_header_checker_handler() {}
 
@@ -353,6 +525,355 @@ void test_http_if_modified_since() {
   }
 }
 
+// replies to every request with either an empty tile or a server
+// error, after an optional delay, counting the number of requests.
+// optionally, only the first few requests fail.
+struct counting_handler : public request_handler {
+  counting_handler(std::shared_ptr<std::atomic<int> > c, bool f, int d, int ff)
+    : count(c), fail(f), delay_ms(d), fail_first(ff) {}
+  virtual ~counting_handler() {}
+
+  virtual void handle_request(const request &req, reply &rep) {
+    const int n = ++(*count);
+    if (delay_ms > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+    }
+    if (fail || (n <= fail_first)) {
+      rep = reply::stock_reply(reply::internal_server_error);
+
+    } else if (boost::algorithm::starts_with(req.uri, "/20/")) {
+      // there are no tiles at z20.
+      rep = reply::stock_reply(reply::not_found);
+
+    } else {
+      rep.status = reply::ok;
+      rep.is_hard_error = false;
+      rep.content = avecado::tile(0, 0, 0).get_data();
+      rep.headers.resize(1);
+      rep.headers[0].name = "Content-Length";
+      rep.headers[0].value = (boost::format("%1%") % rep.content.size()).str();
+    }
+  }
+
+  std::shared_ptr<std::atomic<int> > count;
+  bool fail;
+  int delay_ms, fail_first;
+};
+
+struct counting_factory : public handler_factory {
+  explicit counting_factory(bool f, int d = 0, int ff = 0)
+    : count(std::make_shared<std::atomic<int> >(0)), fail(f), delay_ms(d), fail_first(ff) {}
+  virtual ~counting_factory() {}
+  virtual void thread_setup(boost::thread_specific_ptr<request_handler> &tss, const std::string &) {
+    tss.reset(new counting_handler(count, fail, delay_ms, fail_first));
+  }
+  std::shared_ptr<std::atomic<int> > count;
+  bool fail;
+  int delay_ms, fail_first;
+};
+
+void test_fetch_spread_over_hosts() {
+  auto factory1 = boost::make_shared<counting_factory>(false);
+  auto factory2 = boost::make_shared<counting_factory>(false);
+  server_guard2 server1(factory1), server2(factory2);
+
+  std::vector<std::string> patterns;
+  patterns.push_back(server1.base_url() + "/{z}/{x}/{y}.pbf");
+  patterns.push_back(server2.base_url() + "/{z}/{x}/{y}.pbf");
+  avecado::fetch::http fetch(std::move(patterns));
+
+  for (int x = 0; x < 32; ++x) {
+    avecado::fetch_response response(fetch(avecado::request(5, x, 0)).get());
+    test::assert_equal<bool>(response.is_left(), true, "should fetch tile OK");
+  }
+
+  test::assert_equal<int>(*factory1->count + *factory2->count, 32, "should have made one request per tile");
+  test::assert_greater_or_equal<int>(*factory1->count, 1, "should have used the first host");
+  test::assert_greater_or_equal<int>(*factory2->count, 1, "should have used the second host");
+}
+
+void test_fetch_failover() {
+  auto bad_factory = boost::make_shared<counting_factory>(true);
+  auto good_factory = boost::make_shared<counting_factory>(false);
+  server_guard2 bad_server(bad_factory), good_server(good_factory);
+
+  std::vector<std::string> patterns;
+  patterns.push_back(bad_server.base_url() + "/{z}/{x}/{y}.pbf");
+  patterns.push_back(good_server.base_url() + "/{z}/{x}/{y}.pbf");
+  avecado::fetch::http fetch(std::move(patterns));
+
+  for (int x = 0; x < 32; ++x) {
+    avecado::fetch_response response(fetch(avecado::request(5, x, 0)).get());
+    test::assert_equal<bool>(response.is_left(), true, "should fetch tile OK from the other host");
+  }
+
+  test::assert_equal<int>(*good_factory->count, 32, "should have fetched every tile from the good host");
+  // the bad host should have been ejected after a few failures.
+  test::assert_less_or_equal<int>(*bad_factory->count, 3, "should have stopped using the bad host");
+}
+
+void test_fetch_coalesced() {
+  // slow enough that all the requests are made while the first is
+  // still in flight.
+  auto factory = boost::make_shared<counting_factory>(false, 200);
+  server_guard2 server(factory);
+
+  avecado::fetch::http fetch(server.base_url(), "pbf");
+
+  std::vector<std::future<avecado::fetch_response> > futures;
+  for (int i = 0; i < 8; ++i) {
+    futures.push_back(fetch(avecado::request(1, 1, 0)));
+  }
+  futures.push_back(fetch(avecado::request(1, 0, 0)));
+
+  for (auto &future : futures) {
+    avecado::fetch_response response(future.get());
+    test::assert_equal<bool>(response.is_left(), true, "should fetch tile OK");
+  }
+
+  test::assert_equal<int>(*factory->count, 2, "should have made one request per distinct tile");
+}
+
+void test_fetch_retry() {
+  // a single host which fails the first couple of times.
+  auto factory = boost::make_shared<counting_factory>(false, 0, 2);
+  server_guard2 server(factory);
+
+  std::vector<std::string> patterns;
+  patterns.push_back(server.base_url() + "/{z}/{x}/{y}.pbf");
+  avecado::fetch::http_options options;
+  options.max_retries = 2;
+  options.retry_base_delay_ms = 1;
+  avecado::fetch::http fetch(std::move(patterns), options);
+
+  avecado::fetch_response response(fetch(avecado::request(0, 0, 0)).get());
+  test::assert_equal<bool>(response.is_left(), true, "should fetch tile OK after retrying");
+  test::assert_equal<int>(*factory->count, 3, "should have retried twice");
+
+  // but gives up once it's out of retries.
+  auto bad_factory = boost::make_shared<counting_factory>(true);
+  server_guard2 bad_server(bad_factory);
+
+  std::vector<std::string> bad_patterns;
+  bad_patterns.push_back(bad_server.base_url() + "/{z}/{x}/{y}.pbf");
+  avecado::fetch::http bad_fetch(std::move(bad_patterns), options);
+
+  avecado::fetch_response response2(bad_fetch(avecado::request(0, 0, 0)).get());
+  test::assert_equal<bool>(response2.is_right(), true, "should give up after retrying");
+  test::assert_equal<int>(*bad_factory->count, 3, "should have stopped after two retries");
+}
+
+void test_fetch_timeout() {
+  auto factory = boost::make_shared<counting_factory>(false, 1000);
+  server_guard2 server(factory);
+
+  std::vector<std::string> patterns;
+  patterns.push_back(server.base_url() + "/{z}/{x}/{y}.pbf");
+  avecado::fetch::http_options options;
+  options.timeout_ms = 100;
+  options.max_retries = 0;
+  avecado::fetch::http fetch(std::move(patterns), options);
+
+  const auto start = std::chrono::steady_clock::now();
+  avecado::fetch_response response(fetch(avecado::request(0, 0, 0)).get());
+  const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - start).count();
+
+  test::assert_equal<bool>(response.is_right(), true, "should time out");
+  test::assert_equal<int>(int(response.right().status), int(avecado::fetch_status::server_error),
+                          "timeout should be a server error");
+  test::assert_less_or_equal<int>(elapsed, 900, "should not have waited for the slow server");
+}
+
+void test_fetch_hedged() {
+  auto slow_factory = boost::make_shared<counting_factory>(false, 50);
+  auto fast_factory = boost::make_shared<counting_factory>(false);
+  server_guard2 slow_server(slow_factory), fast_server(fast_factory);
+
+  std::vector<std::string> patterns;
+  patterns.push_back(slow_server.base_url() + "/{z}/{x}/{y}.pbf");
+  patterns.push_back(fast_server.base_url() + "/{z}/{x}/{y}.pbf");
+  avecado::fetch::http_options options;
+  options.hedge_percentile = 0.25;
+  avecado::fetch::http fetch(std::move(patterns), options);
+
+  // the first lot of requests measure the latency, after which any
+  // request slower than most of them is duplicated on the other host.
+  for (int x = 0; x < 64; ++x) {
+    avecado::fetch_response response(fetch(avecado::request(6, x, 0)).get());
+    test::assert_equal<bool>(response.is_left(), true, "should fetch tile OK");
+  }
+
+  test::assert_greater_or_equal<int>(*slow_factory->count + *fast_factory->count, 65,
+                            "should have hedged some requests to the other host");
+}
+
+void test_fetch_hedged_shutdown() {
+  // a single slow, single-threaded host, so that each hedge queues up
+  // behind the request it duplicates, and is still in flight when
+  // that answers.
+  auto factory = boost::make_shared<counting_factory>(false, 50);
+  server_guard2 server(factory);
+
+  std::vector<std::string> patterns;
+  patterns.push_back(server.base_url() + "/{z}/{x}/{y}.pbf");
+  avecado::fetch::http_options options;
+  options.hedge_percentile = 0.25;
+  std::unique_ptr<avecado::fetch::http> fetch(new avecado::fetch::http(std::move(patterns), options));
+
+  for (int x = 0; x < 16; ++x) {
+    avecado::fetch_response response((*fetch)(avecado::request(5, x, 0)).get());
+    test::assert_equal<bool>(response.is_left(), true, "should fetch tile OK");
+  }
+
+  // these queue up at the host, so the later ones are hedged.
+  std::vector<std::future<avecado::fetch_response> > futures;
+  for (int x = 16; x < 20; ++x) {
+    futures.push_back((*fetch)(avecado::request(5, x, 0)));
+  }
+  for (auto &future : futures) {
+    avecado::fetch_response response(future.get());
+    test::assert_equal<bool>(response.is_left(), true, "should fetch tile OK");
+  }
+
+  // the hedges which lost were cancelled, so destroying the fetcher
+  // shouldn't wait for them. it's destroyed on another thread, so
+  // that the test fails rather than hangs if it does.
+  std::shared_ptr<std::promise<void> > destroyed = std::make_shared<std::promise<void> >();
+  std::future<void> done = destroyed->get_future();
+  avecado::fetch::http *ptr = fetch.release();
+  std::thread([ptr, destroyed]() { delete ptr; destroyed->set_value(); }).detach();
+  test::assert_equal<bool>(done.wait_for(std::chrono::seconds(10)) == std::future_status::ready, true,
+                           "should destroy the fetcher promptly");
+}
+
+void test_fetch_connection_limits() {
+  auto factory = boost::make_shared<counting_factory>(false, 10);
+  server_guard2 server(factory);
+
+  std::vector<std::string> patterns;
+  patterns.push_back(server.base_url() + "/{z}/{x}/{y}.pbf");
+  avecado::fetch::http_options options;
+  options.handle_pool_size = 2;
+  options.max_host_connections = 1;
+  options.max_total_connections = 2;
+  avecado::fetch::http fetch(std::move(patterns), options);
+
+  // more requests than connections, so most have to wait their turn.
+  std::vector<std::future<avecado::fetch_response> > futures;
+  for (int x = 0; x < 16; ++x) {
+    futures.push_back(fetch(avecado::request(4, x, 0)));
+  }
+
+  for (auto &future : futures) {
+    avecado::fetch_response response(future.get());
+    test::assert_equal<bool>(response.is_left(), true, "should fetch tile OK");
+  }
+
+  test::assert_equal<int>(*factory->count, 16, "should have made one request per tile");
+}
+
+void test_fetch_callback() {
+  auto factory = boost::make_shared<counting_factory>(false);
+  server_guard2 server(factory);
+
+  avecado::fetch::http fetch(server.base_url(), "pbf");
+
+  // lots of fetches outstanding at once, with nothing waiting on any
+  // of them except the last callback.
+  const int num_tiles = 64;
+  std::atomic<int> remaining(num_tiles), ok(0);
+  std::promise<void> done;
+  for (int x = 0; x < num_tiles; ++x) {
+    fetch.fetch(avecado::request(6, x, 0), [&](avecado::fetch_response &&response) {
+        if (response.is_left()) { ++ok; }
+        if (--remaining == 0) { done.set_value(); }
+      });
+  }
+  done.get_future().wait();
+
+  test::assert_equal<int>(ok, num_tiles, "should have fetched every tile OK");
+  test::assert_equal<int>(*factory->count, num_tiles, "should have made one request per tile");
+}
+
+void test_fetch_many() {
+  auto factory = boost::make_shared<counting_factory>(false);
+  server_guard2 server(factory);
+
+  avecado::fetch::http fetch(server.base_url(), "pbf");
+
+  // every tile is asked for twice, and one is invalid.
+  const int num_tiles = 32;
+  std::vector<avecado::request> requests;
+  for (int i = 0; i < 2 * num_tiles; ++i) {
+    requests.push_back(avecado::request(5, i % num_tiles, 1));
+  }
+  requests.push_back(avecado::request(5, -1, 1));
+
+  std::vector<avecado::fetch_response> responses = fetch(requests).get();
+  test::assert_equal<std::size_t>(responses.size(), requests.size(), "should have a response for each request");
+
+  for (int i = 0; i < 2 * num_tiles; ++i) {
+    test::assert_equal<bool>(responses[i].is_left(), true, "should fetch tile OK");
+    test::assert_equal<int>(responses[i].left()->x, i % num_tiles, "responses should be in request order");
+  }
+  test::assert_equal<bool>(responses.back().is_right(), true, "should not fetch invalid tile");
+  test::assert_equal<int>(*factory->count, num_tiles, "should have made one request per distinct tile");
+}
+
+void test_fetch_decode_threads() {
+  auto factory = boost::make_shared<counting_factory>(false);
+  server_guard2 server(factory);
+
+  // with no decode threads, every tile is decoded on the fetcher's
+  // thread, otherwise it's spread over the decode threads.
+  for (unsigned int decode_threads = 0; decode_threads <= 2; decode_threads += 2) {
+    std::vector<std::string> patterns;
+    patterns.push_back(server.base_url() + "/{z}/{x}/{y}.pbf");
+    avecado::fetch::http_options options;
+    options.decode_threads = decode_threads;
+    avecado::fetch::http fetch(std::move(patterns), options);
+
+    // a tile which isn't found has nothing to decode, so it's always
+    // answered from the fetcher's own thread.
+    std::promise<std::thread::id> fetcher_thread;
+    fetch.fetch(avecado::request(20, 0, 0), [&](avecado::fetch_response &&) {
+        fetcher_thread.set_value(std::this_thread::get_id());
+      });
+    const std::thread::id curl_thread = fetcher_thread.get_future().get();
+
+    const int num_tiles = 32;
+    std::mutex mutex;
+    std::set<std::thread::id> threads;
+    std::atomic<int> remaining(num_tiles), ok(0);
+    std::promise<void> done;
+    for (int x = 0; x < num_tiles; ++x) {
+      fetch.fetch(avecado::request(5, x, int(decode_threads)), [&](avecado::fetch_response &&response) {
+          if (response.is_left()) { ++ok; }
+          {
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.insert(std::this_thread::get_id());
+          }
+          if (--remaining == 0) { done.set_value(); }
+        });
+    }
+    done.get_future().wait();
+
+    test::assert_equal<int>(ok, num_tiles, "should have fetched every tile OK");
+    test::assert_equal<bool>(threads.count(std::this_thread::get_id()) == 0, true,
+                             "should not have called back on the caller's thread");
+    if (decode_threads == 0) {
+      test::assert_equal<bool>(threads == std::set<std::thread::id>({ curl_thread }), true,
+                               "should have called back from the fetcher's thread");
+    } else {
+      test::assert_equal<bool>(threads.count(curl_thread) == 0, true,
+                               "should not have called back from the fetcher's thread");
+      test::assert_equal<bool>(threads.size() <= decode_threads, true,
+                               "should have called back from the decoding threads");
+    }
+  }
+}
+
 } // anonymous namespace
 
 int main() {
@@ -378,6 +899,23 @@ int main() {
   RUN_TEST(test_tile_is_not_compressed);
   RUN_TEST(test_http_etag);
   RUN_TEST(test_http_if_modified_since);
+  RUN_TEST(test_fetch_spread_over_hosts);
+  RUN_TEST(test_fetch_failover);
+  RUN_TEST(test_fetch_coalesced);
+  RUN_TEST(test_fetch_retry);
+  RUN_TEST(test_fetch_timeout);
+  RUN_TEST(test_fetch_hedged);
+  RUN_TEST(test_fetch_hedged_shutdown);
+  RUN_TEST(test_fetch_connection_limits);
+  RUN_TEST(test_fetch_callback);
+  RUN_TEST(test_fetch_many);
+  RUN_TEST(test_fetch_decode_threads);
+  RUN_TEST(test_parse_path);
+  RUN_TEST(test_url_decode);
+  RUN_TEST(test_format_http_date);
+  RUN_TEST(test_batch_parse);
+  RUN_TEST(test_batch_fetch);
+  RUN_TEST(test_batch_bad_request);
 
   std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
 
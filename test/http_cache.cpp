@@ -5,11 +5,21 @@
 #include "logging/logger.hpp"
 #include "http_server/server.hpp"
 #include "http_server/mapnik_handler_factory.hpp"
+#include "http_server/http_date.hpp"
+#include "http_server/reply.hpp"
+#include "http_server/request.hpp"
 #include "vector_tile.pb.h"
 
 #include <mapnik/datasource_cache.hpp>
 
+#include <boost/make_shared.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+
+#include <chrono>
+#include <future>
 #include <iostream>
+#include <map>
+#include <thread>
 
 using http::server3::server_options;
 using http::server3::mapnik_server_options;
@@ -52,6 +62,7 @@ mapnik_server_options default_mapnik_options(const std::string &map_file,
   options.logger = logger;
   options.max_age = 60;
   options.compression_level = -1;
+  options.datasource_pool_size = 0;
   return options;
 }
 
@@ -79,6 +90,38 @@ struct server_guard {
   }
 };
 
+// runs a server with handlers from the factory for as long as the
+// guard is around, so that it's stopped even if a test fails.
+struct factory_server_guard {
+  server_options srv_opt;
+  http::server3::server server;
+  std::string port;
+
+  explicit factory_server_guard(boost::shared_ptr<http::server3::handler_factory> factory)
+    : srv_opt(factory_options(factory))
+    , server("localhost", srv_opt)
+    , port(server.port()) {
+
+    server.run(false);
+  }
+
+  ~factory_server_guard() {
+    server.stop();
+  }
+
+  std::string base_url() {
+    return (boost::format("http://localhost:%1%") % port).str();
+  }
+
+  static server_options factory_options(boost::shared_ptr<http::server3::handler_factory> factory) {
+    server_options options;
+    options.thread_hint = 1;
+    options.port = "";
+    options.factory = factory;
+    return options;
+  }
+};
+
 void test_cache_once() {
   std::shared_ptr<request_counter> counter = std::make_shared<request_counter>();
   {
@@ -144,6 +187,359 @@ void test_cache_disable() {
   test::assert_equal<std::size_t>(counter->num_requests, 2, "should have made two requests");
 }
 
+// counts of the different kinds of response sent by the origin.
+struct origin_counts {
+  origin_counts() : full(0), not_modified(0) {}
+  std::mutex mutex;
+  std::size_t full, not_modified;
+  std::map<std::string, std::size_t> paths;
+};
+
+// serves a tile with an ETag which has already expired, so that each
+// time it is fetched it needs revalidating. if the request has the
+// right validator, then it replies 304 with a max-age, so that the
+// tile shouldn't need revalidating again.
+struct revalidating_handler : public http::server3::request_handler {
+  explicit revalidating_handler(std::shared_ptr<origin_counts> c) : counts(c) {}
+  virtual ~revalidating_handler() {}
+
+  virtual void handle_request(const http::server3::request &req, http::server3::reply &rep) {
+    using http::server3::reply;
+
+    char date[http::server3::http_date_length + 1], expires[http::server3::http_date_length + 1];
+    std::time_t now = time(nullptr);
+    http::server3::format_http_date(now, date);
+    http::server3::format_http_date(now - 3600, expires);
+
+    bool matched = false;
+    for (const auto &header : req.headers) {
+      if (boost::iequals(header.name, "If-None-Match") && (header.value == "\"v1\"")) {
+        matched = true;
+      }
+    }
+
+    std::unique_lock<std::mutex> lock(counts->mutex);
+    rep.is_hard_error = false;
+    if (matched) {
+      ++counts->not_modified;
+      rep.status = reply::not_modified;
+      rep.content.clear();
+      rep.headers.resize(3);
+      rep.headers[2].name = "Cache-Control";
+      rep.headers[2].value = "max-age=60";
+
+    } else {
+      ++counts->full;
+      avecado::tile tile(0, 0, 0);
+      tile.mapnik_tile().add_layers()->set_name("revalidated");
+      tile.mapnik_tile().mutable_layers(0)->set_version(1);
+      rep.status = reply::ok;
+      rep.content = tile.get_data();
+      rep.headers.resize(4);
+      rep.headers[2].name = "Expires";
+      rep.headers[2].value = expires;
+      rep.headers[3].name = "Content-Length";
+      rep.headers[3].value = (boost::format("%1%") % rep.content.size()).str();
+    }
+    rep.headers[0].name = "ETag";
+    rep.headers[0].value = "\"v1\"";
+    rep.headers[1].name = "Date";
+    rep.headers[1].value = date;
+  }
+
+  std::shared_ptr<origin_counts> counts;
+};
+
+struct revalidating_factory : public http::server3::handler_factory {
+  explicit revalidating_factory(std::shared_ptr<origin_counts> c) : counts(c) {}
+  virtual ~revalidating_factory() {}
+  virtual void thread_setup(boost::thread_specific_ptr<http::server3::request_handler> &tss, const std::string &) {
+    tss.reset(new revalidating_handler(counts));
+  }
+  std::shared_ptr<origin_counts> counts;
+};
+
+void test_cache_revalidate() {
+  std::shared_ptr<origin_counts> counts = std::make_shared<origin_counts>();
+
+  factory_server_guard guard(boost::make_shared<revalidating_factory>(counts));
+
+  {
+    test::temp_dir dir;
+    avecado::fetch::http fetch(guard.base_url(), "pbf");
+    fetch.enable_cache((dir.path() / "cache").native());
+
+    // first fetch gets the full tile, the second finds it expired in
+    // the cache and revalidates it, and the third finds it fresh
+    // again, as the 304 refreshed its expiry.
+    for (int i = 0; i < 3; ++i) {
+      avecado::fetch_response response(fetch(avecado::request(0, 0, 0)).get());
+      test::assert_equal<bool>(response.is_left(), true, "should fetch tile OK");
+      test::assert_equal<int>(response.left()->mapnik_tile().layers_size(), 1, "should have one layer");
+      test::assert_equal<std::string>(response.left()->mapnik_tile().layers(0).name(), "revalidated", "layer name");
+    }
+  }
+
+  test::assert_equal<std::size_t>(counts->full, 1, "should have fetched the whole tile once");
+  test::assert_equal<std::size_t>(counts->not_modified, 1, "should have revalidated once");
+}
+
+// a tile padded out with a layer with a kilobyte-long name. the
+// name is pseudo-random, so that it doesn't compress away.
+std::string padded_tile_data() {
+  std::string padding(1000, ' ');
+  unsigned int seed = 1;
+  for (char &c : padding) {
+    seed = seed * 1103515245 + 12345;
+    c = 'a' + ((seed >> 16) % 26);
+  }
+
+  avecado::tile tile(0, 0, 0);
+  tile.mapnik_tile().add_layers()->set_name(padding);
+  tile.mapnik_tile().mutable_layers(0)->set_version(1);
+  return tile.get_data();
+}
+
+// serves every tile padded out with a long max-age, counting the
+// number of requests for each path. there are no tiles at z19.
+struct padded_handler : public http::server3::request_handler {
+  explicit padded_handler(std::shared_ptr<origin_counts> c) : counts(c) {}
+  virtual ~padded_handler() {}
+
+  virtual void handle_request(const http::server3::request &req, http::server3::reply &rep) {
+    using http::server3::reply;
+
+    std::unique_lock<std::mutex> lock(counts->mutex);
+    ++counts->paths[req.uri];
+    if (boost::algorithm::starts_with(req.uri, "/19/")) {
+      rep = reply::stock_reply(reply::not_found);
+      return;
+    }
+    rep.is_hard_error = false;
+    rep.status = reply::ok;
+    rep.content = padded_tile_data();
+    rep.headers.resize(2);
+    rep.headers[0].name = "Cache-Control";
+    rep.headers[0].value = "max-age=3600";
+    rep.headers[1].name = "Content-Length";
+    rep.headers[1].value = (boost::format("%1%") % rep.content.size()).str();
+  }
+
+  std::shared_ptr<origin_counts> counts;
+};
+
+struct padded_factory : public http::server3::handler_factory {
+  explicit padded_factory(std::shared_ptr<origin_counts> c) : counts(c) {}
+  virtual ~padded_factory() {}
+  virtual void thread_setup(boost::thread_specific_ptr<http::server3::request_handler> &tss, const std::string &) {
+    tss.reset(new padded_handler(counts));
+  }
+  std::shared_ptr<origin_counts> counts;
+};
+
+void test_cache_evict() {
+  std::shared_ptr<origin_counts> counts = std::make_shared<origin_counts>();
+
+  factory_server_guard guard(boost::make_shared<padded_factory>(counts));
+
+  const std::string base_url = guard.base_url();
+  // room for two and a half tiles, so writing the third evicts the
+  // first.
+  const std::size_t max_bytes = padded_tile_data().size() * 5 / 2;
+
+  {
+    test::temp_dir dir;
+    const std::string location = (dir.path() / "cache").native();
+
+    {
+      avecado::fetch::http fetch(base_url, "pbf");
+      fetch.enable_cache(location, max_bytes);
+      for (int x = 0; x < 3; ++x) {
+        avecado::fetch_response response(fetch(avecado::request(2, x, 0)).get());
+        test::assert_equal<bool>(response.is_left(), true, "should fetch tile OK");
+      }
+    }
+
+    // writes are flushed when the fetcher goes away, so the cache
+    // should have settled by the time it's re-opened.
+    {
+      avecado::fetch::http fetch(base_url, "pbf");
+      fetch.enable_cache(location, max_bytes);
+      for (int x : {2, 0}) {
+        avecado::fetch_response response(fetch(avecado::request(2, x, 0)).get());
+        test::assert_equal<bool>(response.is_left(), true, "should fetch tile OK");
+      }
+    }
+  }
+
+  test::assert_equal<std::size_t>(counts->paths["/2/0/0.pbf"], 2, "least recently used tile should have been evicted");
+  test::assert_equal<std::size_t>(counts->paths["/2/2/0.pbf"], 1, "most recently used tile should have been kept");
+}
+
+void test_memory_cache() {
+  std::shared_ptr<origin_counts> counts = std::make_shared<origin_counts>();
+
+  factory_server_guard guard(boost::make_shared<padded_factory>(counts));
+
+  {
+    avecado::fetch::http fetch(guard.base_url(), "pbf");
+    fetch.enable_memory_cache(1 << 20);
+
+    for (int i = 0; i < 3; ++i) {
+      avecado::fetch_response response(fetch(avecado::request(0, 0, 0)).get());
+      test::assert_equal<bool>(response.is_left(), true, "should fetch tile OK");
+      test::assert_equal<int>(response.left()->mapnik_tile().layers_size(), 1, "should have one layer");
+
+      // modifying the tile shouldn't affect the cached copy, which
+      // is shared with the next response.
+      response.left()->mapnik_tile().add_layers()->set_name("modified");
+    }
+
+    avecado::fetch::memory_cache_stats stats = fetch.get_memory_cache_stats();
+    test::assert_equal<std::size_t>(stats.hits, 2, "should have hit the memory cache twice");
+    test::assert_equal<std::size_t>(stats.entries, 1, "should have one tile in the memory cache");
+  }
+
+  test::assert_equal<std::size_t>(counts->paths["/0/0/0.pbf"], 1, "should have made one request");
+}
+
+void test_not_found_memory() {
+  std::shared_ptr<origin_counts> counts = std::make_shared<origin_counts>();
+
+  factory_server_guard guard(boost::make_shared<padded_factory>(counts));
+
+  const std::string base_url = guard.base_url();
+  {
+    avecado::fetch::http fetch(base_url, "pbf");
+    for (int i = 0; i < 3; ++i) {
+      avecado::fetch_response response(fetch(avecado::request(19, 0, 0)).get());
+      test::assert_equal<bool>(response.is_right(), true, "should not find tile");
+      test::assert_equal<int>(int(response.right().status), int(avecado::fetch_status::not_found), "should be not found");
+    }
+  }
+  {
+    // with the TTL turned off, every request goes to the origin.
+    std::vector<std::string> patterns;
+    patterns.push_back(base_url + "/{z}/{x}/{y}.pbf");
+    avecado::fetch::http_options options;
+    options.not_found_ttl_seconds = 0;
+    avecado::fetch::http fetch(std::move(patterns), options);
+    for (int i = 0; i < 2; ++i) {
+      avecado::fetch_response response(fetch(avecado::request(19, 1, 0)).get());
+      test::assert_equal<bool>(response.is_right(), true, "should not find tile");
+    }
+  }
+
+  test::assert_equal<std::size_t>(counts->paths["/19/0/0.pbf"], 1, "should have remembered the missing tile");
+  test::assert_equal<std::size_t>(counts->paths["/19/1/0.pbf"], 2, "should not have remembered the missing tile");
+}
+
+void test_cache_not_found() {
+  std::shared_ptr<origin_counts> counts = std::make_shared<origin_counts>();
+
+  factory_server_guard guard(boost::make_shared<padded_factory>(counts));
+
+  const std::string base_url = guard.base_url();
+  {
+    test::temp_dir dir;
+    const std::string location = (dir.path() / "cache").native();
+
+    // each fetcher has its own memory, so the second can only know
+    // the tile is missing from the disk cache.
+    for (int i = 0; i < 2; ++i) {
+      avecado::fetch::http fetch(base_url, "pbf");
+      fetch.enable_cache(location);
+      avecado::fetch_response response(fetch(avecado::request(19, 0, 0)).get());
+      test::assert_equal<bool>(response.is_right(), true, "should not find tile");
+      test::assert_equal<int>(int(response.right().status), int(avecado::fetch_status::not_found), "should be not found");
+    }
+  }
+
+  test::assert_equal<std::size_t>(counts->paths["/19/0/0.pbf"], 1, "should have cached the missing tile");
+}
+
+void test_cache_stale_while_revalidate() {
+  std::shared_ptr<origin_counts> counts = std::make_shared<origin_counts>();
+
+  factory_server_guard guard(boost::make_shared<revalidating_factory>(counts));
+
+  {
+    test::temp_dir dir;
+    std::vector<std::string> patterns;
+    patterns.push_back(guard.base_url() + "/{z}/{x}/{y}.pbf");
+    avecado::fetch::http_options options;
+    options.stale_while_revalidate_seconds = 7200;
+    avecado::fetch::http fetch(std::move(patterns), options);
+    fetch.enable_cache((dir.path() / "cache").native());
+
+    avecado::fetch_response first(fetch(avecado::request(0, 0, 0)).get());
+    test::assert_equal<bool>(first.is_left(), true, "should fetch tile OK");
+
+    // the tile expired an hour ago, which is inside the window, so it
+    // should be answered without waiting for the origin.
+    std::future<avecado::fetch_response> future = fetch(avecado::request(0, 0, 0));
+    test::assert_equal<bool>(future.wait_for(std::chrono::seconds(0)) == std::future_status::ready, true,
+                             "should answer with the stale tile straight away");
+    avecado::fetch_response stale(future.get());
+    test::assert_equal<bool>(stale.is_left(), true, "should serve stale tile OK");
+    test::assert_equal<std::string>(stale.left()->mapnik_tile().layers(0).name(), "revalidated", "layer name");
+
+    // wait for the background revalidation to finish, after which the
+    // tile is fresh again.
+    for (int i = 0; (i < 1000) && (fetch.background_refreshes() == 0); ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    test::assert_equal<std::size_t>(fetch.background_refreshes(), 1, "should have finished the background refresh");
+
+    avecado::fetch_response fresh(fetch(avecado::request(0, 0, 0)).get());
+    test::assert_equal<bool>(fresh.is_left(), true, "should fetch tile OK");
+    test::assert_equal<std::size_t>(fetch.background_refreshes(), 1, "fresh tile shouldn't be refreshed again");
+  }
+
+  test::assert_equal<std::size_t>(counts->full, 1, "should have fetched the whole tile once");
+  test::assert_equal<std::size_t>(counts->not_modified, 1, "should have revalidated once, in the background");
+}
+
+void test_cache_stale_if_error() {
+  std::shared_ptr<origin_counts> counts = std::make_shared<origin_counts>();
+  test::temp_dir dir;
+  const std::string location = (dir.path() / "cache").native();
+  std::string pattern;
+
+  {
+    factory_server_guard guard(boost::make_shared<revalidating_factory>(counts));
+    pattern = guard.base_url() + "/{z}/{x}/{y}.pbf";
+
+    std::vector<std::string> patterns(1, pattern);
+    avecado::fetch::http fetch(std::move(patterns));
+    fetch.enable_cache(location);
+    avecado::fetch_response response(fetch(avecado::request(0, 0, 0)).get());
+    test::assert_equal<bool>(response.is_left(), true, "should fetch tile OK");
+  }
+
+  // with the origin gone, the expired tile is only served if it's
+  // inside the stale-if-error window. the server's listening socket
+  // is only closed when it's destroyed, which is why it's in a
+  // block of its own.
+  for (int i = 0; i < 2; ++i) {
+    std::vector<std::string> patterns(1, pattern);
+    avecado::fetch::http_options options;
+    options.max_retries = 0;
+    options.timeout_ms = 1000;
+    options.stale_if_error_seconds = (i == 0) ? 0 : 7200;
+    avecado::fetch::http fetch(std::move(patterns), options);
+    fetch.enable_cache(location);
+
+    avecado::fetch_response response(fetch(avecado::request(0, 0, 0)).get());
+    if (i == 0) {
+      test::assert_equal<bool>(response.is_right(), true, "should not serve stale tile");
+    } else {
+      test::assert_equal<bool>(response.is_left(), true, "should serve stale tile when the origin fails");
+      test::assert_equal<std::string>(response.left()->mapnik_tile().layers(0).name(), "revalidated", "layer name");
+    }
+  }
+}
+
 } // anonymous namespace
 
 int main() {
@@ -161,11 +557,18 @@ int main() {
 
 #define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
   RUN_TEST(test_cache_once);
+  RUN_TEST(test_memory_cache);
+  RUN_TEST(test_not_found_memory);
 
   // these tests will only work if we have SQLite installed.
 #ifdef HAVE_SQLITE3
   RUN_TEST(test_cache_twice);
   RUN_TEST(test_cache_disable);
+  RUN_TEST(test_cache_revalidate);
+  RUN_TEST(test_cache_evict);
+  RUN_TEST(test_cache_not_found);
+  RUN_TEST(test_cache_stale_while_revalidate);
+  RUN_TEST(test_cache_stale_if_error);
 #endif /* HAVE_SQLITE3 */
 
   std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
@@ -172,6 +172,45 @@ void test_intersected_line() {
   test::assert_equal(json, single_line_z1_json, "Wrong JSON");
 }
 
+void test_request_leaves_map_unchanged() {
+/* This test makes the same tile as test_intersected_line, but passing the
+ * extent of the tile in a request rather than setting it on the map, and
+ * checks that the result is the same and the map wasn't changed. The map
+ * is set up for a different tile, at a different size, so that any use of
+ * the map's own extent or size would show up.
+ */
+  const unsigned map_size = 2 * tile_size;
+  avecado::tile tile(_z, _x, _y);
+  mapnik::Map map = test::make_map("test/single_line.xml", map_size, 0, 0, 0);
+  const mapnik::box2d<double> map_extent = map.get_current_extent();
+  const mapnik::request request =
+    avecado::util::request_for_tile(1, 0, 0, tile_size, buffer_size);
+  avecado::make_vector_tile(tile, path_multiplier, map, request, scale_factor,
+                            offset_x, offset_y, tolerance, image_format,
+                            scaling_method, scale_denominator, boost::none);
+
+  test::assert_equal(map.width(), map_size, "Map width changed");
+  test::assert_equal(map.height(), map_size, "Map height changed");
+  test::assert_equal(map.get_current_extent() == map_extent, true, "Map extent changed");
+  test::assert_equal(map_extent == avecado::util::box_for_tile(1, 0, 0), false, "Map extent should differ from the request's");
+
+  avecado::tile tile2(_z, _x, _y);
+  tile2.from_string(tile.get_data());
+  const vector_tile::Tile &result = tile2.mapnik_tile();
+
+  test::assert_equal(result.layers_size(), 1, "Wrong number of layers");
+  vector_tile::Tile_Layer layer = result.layers(0);
+
+  mapnik::vector_tile_impl::tile_datasource ds(layer, 0, 0, 1, tile_size);
+
+  mapnik::query qq = mapnik::query(avecado::util::box_for_tile(1, 0, 0));
+  qq.add_property_name("name");
+  mapnik::featureset_ptr fs;
+  fs = ds.features(qq);
+  mapnik::feature_ptr feat = fs->next();
+  std::string json = feature_to_geojson(*feat);
+  test::assert_equal(json, single_line_z1_json, "Wrong JSON");
+}
 
 int main() {
   int tests_failed = 0;
@@ -184,6 +223,7 @@ int main() {
   RUN_TEST(test_single_line);
   RUN_TEST(test_single_polygon);
   RUN_TEST(test_intersected_line);
+  RUN_TEST(test_request_leaves_map_unchanged);
   cout << " >> Tests failed: " << tests_failed << endl << endl;
 
   return (tests_failed > 0) ? 1 : 0;
@@ -0,0 +1,150 @@
+#include "config.h"
+#include "common.hpp"
+#include "fetch/mbtiles.hpp"
+#include "vector_tile.pb.h"
+
+#include <boost/format.hpp>
+
+#include <future>
+#include <iostream>
+#include <vector>
+
+#ifdef HAVE_SQLITE3
+#include <sqlite3.h>
+#endif
+
+using avecado::fetch_status;
+
+namespace {
+
+#ifdef HAVE_SQLITE3
+void exec(sqlite3 *db, const std::string &sql) {
+  if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK) {
+    throw std::runtime_error((boost::format("Unable to run \"%1%\": %2%") % sql % sqlite3_errmsg(db)).str());
+  }
+}
+
+// write an MBTiles file containing the given tiles, in the TMS scheme,
+// each with a single layer named after its (XYZ) coordinates.
+void write_mbtiles(const std::string &file, const std::vector<avecado::request> &tiles) {
+  sqlite3 *db = nullptr;
+  if (sqlite3_open(file.c_str(), &db) != SQLITE_OK) {
+    throw std::runtime_error("Unable to create MBTiles file.");
+  }
+
+  exec(db, "create table metadata (name text, value text)");
+  exec(db, "create table tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob)");
+
+  sqlite3_stmt *stmt = nullptr;
+  sqlite3_prepare_v2(db, "insert into tiles values (?, ?, ?, ?)", -1, &stmt, nullptr);
+  for (const avecado::request &r : tiles) {
+    avecado::tile tile(r.z, r.x, r.y);
+    tile.mapnik_tile().add_layers()->set_name((boost::format("%1%/%2%/%3%") % r.z % r.x % r.y).str());
+    tile.mapnik_tile().mutable_layers(0)->set_version(1);
+    const std::string data = tile.get_data();
+
+    sqlite3_bind_int(stmt, 1, r.z);
+    sqlite3_bind_int(stmt, 2, r.x);
+    sqlite3_bind_int(stmt, 3, (1 << r.z) - 1 - r.y);
+    sqlite3_bind_blob(stmt, 4, data.data(), data.size(), SQLITE_TRANSIENT);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+      throw std::runtime_error("Unable to insert tile.");
+    }
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+}
+
+fetch_status status_of(avecado::fetch_response &response) {
+  test::assert_equal<bool>(response.is_right(), true, "should be an error");
+  return response.right().status;
+}
+
+void test_fetch_tile() {
+  test::temp_dir dir;
+  const std::string file = (dir.path() / "tiles.mbtiles").native();
+  write_mbtiles(file, {avecado::request(3, 2, 1), avecado::request(3, 2, 6)});
+
+  avecado::fetch::mbtiles fetch("mbtiles://" + file);
+  for (int y : {1, 6}) {
+    avecado::fetch_response response(fetch(avecado::request(3, 2, y)).get());
+
+    test::assert_equal<bool>(response.is_left(), true, "should find tile");
+    const avecado::tile &tile = *response.left();
+    test::assert_equal<int>(tile.y, y, "tile y");
+    test::assert_equal<int>(tile.mapnik_tile().layers_size(), 1, "number of layers");
+    test::assert_equal<std::string>(tile.mapnik_tile().layers(0).name(),
+                                    (boost::format("3/2/%1%") % y).str(), "layer name");
+  }
+}
+
+void test_missing_tile() {
+  test::temp_dir dir;
+  const std::string file = (dir.path() / "tiles.mbtiles").native();
+  write_mbtiles(file, {avecado::request(3, 2, 1)});
+
+  avecado::fetch::mbtiles fetch(file);
+  avecado::fetch_response missing(fetch(avecado::request(3, 2, 2)).get());
+  test::assert_equal<int>(int(status_of(missing)), int(fetch_status::not_found), "missing tile");
+
+  avecado::fetch_response outside(fetch(avecado::request(1, 0, 2)).get());
+  test::assert_equal<int>(int(status_of(outside)), int(fetch_status::not_found), "outside the world");
+}
+
+void test_concurrent_fetches() {
+  test::temp_dir dir;
+  const std::string file = (dir.path() / "tiles.mbtiles").native();
+  std::vector<avecado::request> tiles;
+  for (int x = 0; x < 16; ++x) {
+    tiles.push_back(avecado::request(4, x, 15 - x));
+  }
+  write_mbtiles(file, tiles);
+
+  // fetches from many threads at once each need a connection.
+  avecado::fetch::mbtiles fetch(file);
+  std::vector<std::future<avecado::fetch_response> > responses;
+  for (int i = 0; i < 64; ++i) {
+    const avecado::request &r = tiles[i % tiles.size()];
+    responses.push_back(std::async(std::launch::async, [&fetch, r]() {
+          return fetch(r).get();
+        }));
+  }
+  for (auto &f : responses) {
+    avecado::fetch_response response(f.get());
+    test::assert_equal<bool>(response.is_left(), true, "should find tile");
+  }
+}
+#endif /* HAVE_SQLITE3 */
+
+void test_missing_file() {
+  test::temp_dir dir;
+  bool threw = false;
+  try {
+    avecado::fetch::mbtiles fetch((dir.path() / "missing.mbtiles").native());
+
+  } catch (const std::exception &) {
+    threw = true;
+  }
+  test::assert_equal<bool>(threw, true, "should throw for a missing file");
+}
+
+} // anonymous namespace
+
+int main() {
+  int tests_failed = 0;
+
+  std::cout << "== Testing MBTiles fetcher ==" << std::endl << std::endl;
+
+#define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
+#ifdef HAVE_SQLITE3
+  RUN_TEST(test_fetch_tile);
+  RUN_TEST(test_missing_tile);
+  RUN_TEST(test_concurrent_fetches);
+#endif /* HAVE_SQLITE3 */
+  RUN_TEST(test_missing_file);
+
+  std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
@@ -3,31 +3,84 @@
 #include "fetch/overzoom.hpp"
 #include "logging/logger.hpp"
 
+#include <algorithm>
 #include <iostream>
+#include <utility>
+#include <vector>
 
 namespace {
 
 struct test_fetcher : public avecado::fetcher {
   int m_min_zoom, m_max_zoom;
   avecado::fetch_status m_status;
+  int m_calls;
 
-  test_fetcher(int min_zoom, int max_zoom, avecado::fetch_status status) : m_min_zoom(min_zoom), m_max_zoom(max_zoom), m_status(status) {}
+  test_fetcher(int min_zoom, int max_zoom, avecado::fetch_status status) : m_min_zoom(min_zoom), m_max_zoom(max_zoom), m_status(status), m_calls(0) {}
   virtual ~test_fetcher() {}
 
-  std::future<avecado::fetch_response> operator()(const avecado::request &r) {
-    std::promise<avecado::fetch_response> response;
-
+  void fetch(const avecado::request &r, avecado::fetch_callback callback) {
+    ++m_calls;
     if ((r.z >= m_min_zoom) && (r.z <= m_max_zoom)) {
       std::unique_ptr<avecado::tile> tile(new avecado::tile(r.z, r.x, r.y));
-      response.set_value(avecado::fetch_response(std::move(tile)));
+      callback(avecado::fetch_response(std::move(tile)));
 
     } else {
       avecado::fetch_result err;
       err.status = m_status;
-      response.set_value(avecado::fetch_response(err));
+      callback(avecado::fetch_response(err));
+    }
+  }
+};
+
+// holds on to the callbacks until told to answer them, to simulate
+// fetches which are still in progress. tiles above the max zoom are
+// missing.
+struct deferred_fetcher : public avecado::fetcher {
+  std::vector<std::pair<avecado::request, avecado::fetch_callback> > m_pending;
+  int m_max_zoom;
+
+  explicit deferred_fetcher(int max_zoom = 22) : m_max_zoom(max_zoom) {}
+  virtual ~deferred_fetcher() {}
+
+  void fetch(const avecado::request &r, avecado::fetch_callback callback) {
+    m_pending.push_back(std::make_pair(r, callback));
+  }
+
+  // answers in the order the fetches were made, or the reverse.
+  void answer_all(bool reverse = false) {
+    std::vector<std::pair<avecado::request, avecado::fetch_callback> > pending;
+    pending.swap(m_pending);
+    if (reverse) {
+      std::reverse(pending.begin(), pending.end());
+    }
+    for (auto &p : pending) {
+      if (p.first.z <= m_max_zoom) {
+        std::unique_ptr<avecado::tile> tile(new avecado::tile(p.first.z, p.first.x, p.first.y));
+        p.second(avecado::fetch_response(std::move(tile)));
+
+      } else {
+        avecado::fetch_result err;
+        err.status = avecado::fetch_status::not_found;
+        p.second(avecado::fetch_response(err));
+      }
     }
+  }
+};
+
+// as test_fetcher, but also records the size of each batch.
+struct batch_fetcher : public test_fetcher {
+  std::vector<std::size_t> m_batches;
 
-    return response.get_future();
+  batch_fetcher(int min_zoom, int max_zoom) : test_fetcher(min_zoom, max_zoom, avecado::fetch_status::not_found) {}
+  virtual ~batch_fetcher() {}
+
+  void fetch_many(const std::vector<avecado::request> &rs, avecado::fetch_many_callback callback) {
+    m_batches.push_back(rs.size());
+    std::vector<avecado::fetch_response> responses;
+    for (const avecado::request &r : rs) {
+      fetch(r, [&](avecado::fetch_response &&response) { responses.emplace_back(std::move(response)); });
+    }
+    callback(std::move(responses));
   }
 };
 
@@ -100,6 +153,174 @@ void test_fetch_no_mask2() {
   check_tile(o, 16, 0, 0, true, "z16");
 }
 
+// the callback interface should chain the fall back to the mask
+// zoom, calling the callback once with the masked tile.
+void test_fetch_callback() {
+  std::unique_ptr<avecado::fetcher> f(new test_fetcher(11, 16, avecado::fetch_status::not_found));
+  avecado::fetch::overzoom o(std::move(f), 18, 12);
+
+  int calls = 0;
+  int zoom = -1;
+  o.fetch(avecado::request(18, 0, 0), [&](avecado::fetch_response &&response) {
+      ++calls;
+      if (response.is_left()) {
+        zoom = response.left()->z;
+      }
+    });
+
+  test::assert_equal<int>(calls, 1, "callback should be called once");
+  test::assert_equal<int>(zoom, 12, "should have been given the mask zoom tile");
+}
+
+// every child of a parent tile should share the one decoded parent,
+// rather than fetching it again.
+void test_fetch_parent_cached() {
+  test_fetcher *source = new test_fetcher(0, 14, avecado::fetch_status::not_found);
+  std::unique_ptr<avecado::fetcher> f(source);
+  avecado::fetch::overzoom o(std::move(f), 14, boost::none);
+
+  for (int x = 0; x < 16; ++x) {
+    for (int y = 0; y < 16; ++y) {
+      avecado::fetch_response response(o(avecado::request(18, x, y)).get());
+      test::assert_equal<bool>(response.is_left(), true, "should get parent tile");
+      test::assert_equal<int>(response.left()->z, 14, "should get parent tile at max zoom");
+    }
+  }
+
+  test::assert_equal<int>(source->m_calls, 1, "should have fetched the parent once");
+  test::assert_equal<std::size_t>(o.parent_cache_stats().hits, 255, "should have re-used the parent");
+
+  // tiles at or below max zoom aren't shared, so go to the source.
+  check_tile(o, 14, 0, 0, true, "z14");
+  test::assert_equal<int>(source->m_calls, 2, "should have fetched the tile at max zoom");
+}
+
+// concurrent requests for children of the same parent should wait
+// for the same fetch.
+void test_fetch_parent_deduplicated() {
+  deferred_fetcher *source = new deferred_fetcher;
+  std::unique_ptr<avecado::fetcher> f(source);
+  avecado::fetch::overzoom o(std::move(f), 14, boost::none, 0);
+
+  int answered = 0;
+  for (int x = 0; x < 4; ++x) {
+    o.fetch(avecado::request(16, x, 0), [&](avecado::fetch_response &&response) {
+        if (response.is_left() && (response.left()->z == 14)) { ++answered; }
+      });
+  }
+
+  test::assert_equal<std::size_t>(source->m_pending.size(), 1, "should have made one fetch for the parent");
+  source->answer_all();
+  test::assert_equal<int>(answered, 4, "should have answered every request");
+}
+
+// with speculation, the mask zoom tile is fetched straight away, and
+// used when it answers before the tile turns out to be missing.
+void test_mask_speculation_always() {
+  deferred_fetcher *source = new deferred_fetcher(16);
+  std::unique_ptr<avecado::fetcher> f(source);
+  avecado::fetch::overzoom o(std::move(f), 18, 12);
+  o.set_mask_speculation(avecado::fetch::overzoom::mask_speculation::always);
+
+  int zoom = -1;
+  o.fetch(avecado::request(18, 0, 0), [&](avecado::fetch_response &&response) {
+      if (response.is_left()) { zoom = response.left()->z; }
+    });
+
+  test::assert_equal<std::size_t>(source->m_pending.size(), 2, "should fetch the tile and mask at once");
+  source->answer_all(true);
+  test::assert_equal<int>(zoom, 12, "should have used the mask zoom tile");
+  test::assert_equal<std::size_t>(source->m_pending.size(), 0, "should not need another fetch");
+
+  // but the tile itself wins when it's there.
+  o.fetch(avecado::request(16, 0, 0), [&](avecado::fetch_response &&response) {
+      if (response.is_left()) { zoom = response.left()->z; }
+    });
+  source->answer_all(true);
+  test::assert_equal<int>(zoom, 16, "should have used the tile");
+}
+
+// with hinted speculation, the mask zoom tile is only fetched early
+// near tiles which were missing.
+void test_mask_speculation_hinted() {
+  deferred_fetcher *source = new deferred_fetcher(16);
+  std::unique_ptr<avecado::fetcher> f(source);
+  avecado::fetch::overzoom o(std::move(f), 18, 12, 0);
+  o.set_mask_speculation(avecado::fetch::overzoom::mask_speculation::hinted);
+
+  int answered = 0;
+  auto count = [&](avecado::fetch_response &&response) {
+    if (response.is_left()) { ++answered; }
+  };
+
+  o.fetch(avecado::request(17, 0, 0), count);
+  test::assert_equal<std::size_t>(source->m_pending.size(), 1, "should only fetch the tile at first");
+  source->answer_all();
+  test::assert_equal<std::size_t>(source->m_pending.size(), 1, "should then fetch the mask");
+  source->answer_all();
+
+  // a neighbour under the same mask zoom tile.
+  o.fetch(avecado::request(17, 1, 0), count);
+  test::assert_equal<std::size_t>(source->m_pending.size(), 2, "should fetch the tile and mask at once");
+  source->answer_all();
+
+  // somewhere else entirely.
+  o.fetch(avecado::request(17, 1000, 1000), count);
+  test::assert_equal<std::size_t>(source->m_pending.size(), 1, "should not speculate without a hint");
+  source->answer_all();
+  source->answer_all();
+
+  test::assert_equal<int>(answered, 3, "should have answered every request");
+}
+
+// a batch should only fetch each distinct tile once, after zooming
+// out to the max zoom, and in a single batch from the source.
+void test_fetch_many_deduplicated() {
+  batch_fetcher *source = new batch_fetcher(0, 14);
+  std::unique_ptr<avecado::fetcher> f(source);
+  avecado::fetch::overzoom o(std::move(f), 14, boost::none, 0);
+
+  std::vector<avecado::request> requests;
+  for (int x = 0; x < 4; ++x) {
+    for (int y = 0; y < 4; ++y) {
+      requests.push_back(avecado::request(16, x, y));
+    }
+  }
+  requests.push_back(avecado::request(14, 1, 0));
+  requests.push_back(avecado::request(14, 1, 0));
+
+  std::vector<avecado::fetch_response> responses = o(requests).get();
+  test::assert_equal<std::size_t>(responses.size(), requests.size(), "should answer every request");
+  for (std::size_t i = 0; i < responses.size(); ++i) {
+    test::assert_equal<bool>(responses[i].is_left(), true, "should get tile");
+    test::assert_equal<int>(responses[i].left()->z, 14, "should get tile at max zoom");
+    test::assert_equal<int>(responses[i].left()->x, (i < 16) ? 0 : 1, "should be in request order");
+  }
+
+  test::assert_equal<std::size_t>(source->m_batches.size(), 1, "should fetch in one batch");
+  test::assert_equal<std::size_t>(source->m_batches[0], 2, "should fetch each distinct tile once");
+}
+
+// missing tiles in a batch should fall back to the mask zoom, which
+// is shared between them.
+void test_fetch_many_masked() {
+  batch_fetcher *source = new batch_fetcher(0, 12);
+  std::unique_ptr<avecado::fetcher> f(source);
+  avecado::fetch::overzoom o(std::move(f), 16, 12);
+
+  std::vector<avecado::request> requests;
+  requests.push_back(avecado::request(14, 0, 0));
+  requests.push_back(avecado::request(14, 1, 0));
+  requests.push_back(avecado::request(11, 0, 0));
+
+  std::vector<avecado::fetch_response> responses = o(requests).get();
+  test::assert_equal<int>(responses[0].left()->z, 12, "should get mask zoom tile");
+  test::assert_equal<int>(responses[1].left()->z, 12, "should get mask zoom tile");
+  test::assert_equal<int>(responses[2].left()->z, 11, "should get tile");
+
+  test::assert_equal<int>(source->m_calls, 4, "should fetch the mask zoom tile once");
+}
+
 } // anonymous namespace
 
 int main() {
@@ -112,6 +333,13 @@ int main() {
   RUN_TEST(test_fetch_result);
   RUN_TEST(test_fetch_no_mask);
   RUN_TEST(test_fetch_no_mask2);
+  RUN_TEST(test_fetch_callback);
+  RUN_TEST(test_fetch_parent_cached);
+  RUN_TEST(test_fetch_parent_deduplicated);
+  RUN_TEST(test_mask_speculation_always);
+  RUN_TEST(test_mask_speculation_hinted);
+  RUN_TEST(test_fetch_many_deduplicated);
+  RUN_TEST(test_fetch_many_masked);
   
   std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
 
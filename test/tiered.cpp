@@ -0,0 +1,200 @@
+#include "common.hpp"
+#include "fetch/tiered.hpp"
+#include "fetch/memory.hpp"
+#include "fetch/directory.hpp"
+#include "vector_tile.pb.h"
+
+#include <boost/format.hpp>
+
+#include <iostream>
+#include <vector>
+
+using avecado::fetch_status;
+
+namespace {
+
+// has tiles between the min and max zoom, each with a layer named
+// after the fetcher, and answers other requests with the status.
+struct test_fetcher : public avecado::fetcher {
+  std::string m_name;
+  int m_min_zoom, m_max_zoom;
+  fetch_status m_status;
+  int m_calls;
+
+  test_fetcher(const std::string &name, int min_zoom, int max_zoom, fetch_status status)
+    : m_name(name), m_min_zoom(min_zoom), m_max_zoom(max_zoom), m_status(status), m_calls(0) {}
+  virtual ~test_fetcher() {}
+
+  void fetch(const avecado::request &r, avecado::fetch_callback callback) {
+    ++m_calls;
+    if ((r.z >= m_min_zoom) && (r.z <= m_max_zoom)) {
+      std::unique_ptr<avecado::tile> tile(new avecado::tile(r.z, r.x, r.y));
+      tile->mapnik_tile().add_layers()->set_name(m_name);
+      tile->mapnik_tile().mutable_layers(0)->set_version(1);
+      callback(avecado::fetch_response(std::move(tile)));
+
+    } else {
+      avecado::fetch_result err;
+      err.status = m_status;
+      callback(avecado::fetch_response(err));
+    }
+  }
+};
+
+// a tiered fetcher with two test fetchers, keeping pointers to them
+// so that their calls can be checked.
+struct two_tiers {
+  two_tiers(test_fetcher *first, test_fetcher *second)
+    : upper(first), lower(second), fetch(make_tiers(first, second)) {}
+
+  static std::vector<std::unique_ptr<avecado::fetcher> > make_tiers(test_fetcher *first, test_fetcher *second) {
+    std::vector<std::unique_ptr<avecado::fetcher> > tiers;
+    tiers.emplace_back(first);
+    tiers.emplace_back(second);
+    return tiers;
+  }
+
+  test_fetcher *upper, *lower;
+  avecado::fetch::tiered fetch;
+};
+
+std::string layer_name(avecado::fetch_response &response) {
+  test::assert_equal<bool>(response.is_left(), true, "should find tile");
+  test::assert_equal<int>(response.left()->mapnik_tile().layers_size(), 1, "number of layers");
+  return response.left()->mapnik_tile().layers(0).name();
+}
+
+fetch_status status_of(avecado::fetch_response &response) {
+  test::assert_equal<bool>(response.is_right(), true, "should be an error");
+  return response.right().status;
+}
+
+void test_upper_tier() {
+  two_tiers t(new test_fetcher("upper", 0, 22, fetch_status::not_found),
+              new test_fetcher("lower", 0, 22, fetch_status::not_found));
+
+  avecado::fetch_response response(t.fetch(avecado::request(3, 2, 1)).get());
+  test::assert_equal<std::string>(layer_name(response), "upper", "tile from");
+  test::assert_equal<int>(t.upper->m_calls, 1, "upper tier calls");
+  test::assert_equal<int>(t.lower->m_calls, 0, "lower tier calls");
+}
+
+void test_fall_through() {
+  for (auto status : {fetch_status::not_found, fetch_status::server_error}) {
+    two_tiers t(new test_fetcher("upper", 0, 2, status),
+                new test_fetcher("lower", 0, 22, fetch_status::not_found));
+
+    avecado::fetch_response response(t.fetch(avecado::request(3, 2, 1)).get());
+    test::assert_equal<std::string>(layer_name(response), "lower", "tile from");
+    test::assert_equal<int>(t.upper->m_calls, 1, "upper tier calls");
+    test::assert_equal<int>(t.lower->m_calls, 1, "lower tier calls");
+  }
+}
+
+void test_not_modified() {
+  // the upper tier knows the tile hasn't changed, so there's no need
+  // to ask the lower tier.
+  two_tiers t(new test_fetcher("upper", 0, 2, fetch_status::not_modified),
+              new test_fetcher("lower", 0, 22, fetch_status::not_found));
+
+  avecado::fetch_response response(t.fetch(avecado::request(3, 2, 1)).get());
+  test::assert_equal<int>(int(status_of(response)), int(fetch_status::not_modified), "status");
+  test::assert_equal<int>(t.lower->m_calls, 0, "lower tier calls");
+}
+
+void test_last_tier_error() {
+  two_tiers t(new test_fetcher("upper", 0, 2, fetch_status::server_error),
+              new test_fetcher("lower", 0, 2, fetch_status::not_found));
+
+  avecado::fetch_response response(t.fetch(avecado::request(3, 2, 1)).get());
+  test::assert_equal<int>(int(status_of(response)), int(fetch_status::not_found), "status");
+}
+
+void test_memory_write_back() {
+  avecado::fetch::memory *memory = new avecado::fetch::memory(1024 * 1024, 60);
+  test_fetcher *source = new test_fetcher("source", 0, 22, fetch_status::not_found);
+
+  std::vector<std::unique_ptr<avecado::fetcher> > tiers;
+  tiers.emplace_back(memory);
+  tiers.emplace_back(source);
+  avecado::fetch::tiered fetch(std::move(tiers));
+
+  for (int i = 0; i < 3; ++i) {
+    avecado::fetch_response response(fetch(avecado::request(3, 2, 1)).get());
+    test::assert_equal<std::string>(layer_name(response), "source", "tile from");
+  }
+
+  test::assert_equal<int>(source->m_calls, 1, "source calls");
+  test::assert_equal<std::size_t>(memory->stats().hits, 2, "memory hits");
+  test::assert_equal<std::size_t>(memory->stats().entries, 1, "memory entries");
+}
+
+void test_directory_write_back() {
+  test::temp_dir dir;
+  const std::string pattern = (boost::format("file://%1%/{z}/{x}/{y}.pbf") % dir.path().native()).str();
+
+  {
+    std::vector<std::unique_ptr<avecado::fetcher> > tiers;
+    tiers.emplace_back(new avecado::fetch::directory(pattern));
+    tiers.emplace_back(new test_fetcher("source", 0, 22, fetch_status::not_found));
+    avecado::fetch::tiered fetch(std::move(tiers));
+
+    avecado::fetch_response response(fetch(avecado::request(3, 2, 1)).get());
+    test::assert_equal<std::string>(layer_name(response), "source", "tile from");
+
+    // the tile is written in the background, but destroying the
+    // fetcher waits for it.
+  }
+
+  avecado::fetch::directory local(pattern);
+  avecado::fetch_response response(local(avecado::request(3, 2, 1)).get());
+  test::assert_equal<std::string>(layer_name(response), "source", "written back tile");
+}
+
+void test_fetch_many() {
+  avecado::fetch::memory *memory = new avecado::fetch::memory(1024 * 1024, 60);
+  test_fetcher *source = new test_fetcher("source", 0, 3, fetch_status::not_found);
+
+  std::vector<std::unique_ptr<avecado::fetcher> > tiers;
+  tiers.emplace_back(memory);
+  tiers.emplace_back(source);
+  avecado::fetch::tiered fetch(std::move(tiers));
+
+  avecado::fetch_response first(fetch(avecado::request(3, 2, 1)).get());
+  test::assert_equal<std::string>(layer_name(first), "source", "tile from");
+
+  // only the tiles which aren't in memory go to the source.
+  std::vector<avecado::request> requests;
+  requests.push_back(avecado::request(3, 2, 2));
+  requests.push_back(avecado::request(3, 2, 1));
+  requests.push_back(avecado::request(4, 2, 1));
+  std::vector<avecado::fetch_response> responses = fetch(requests).get();
+
+  test::assert_equal<std::size_t>(responses.size(), 3, "number of responses");
+  test::assert_equal<int>(responses[0].left()->y, 2, "should be in request order");
+  test::assert_equal<int>(responses[1].left()->y, 1, "should be in request order");
+  test::assert_equal<int>(int(status_of(responses[2])), int(fetch_status::not_found), "missing tile");
+  test::assert_equal<int>(source->m_calls, 3, "source calls");
+  test::assert_equal<std::size_t>(memory->stats().hits, 1, "memory hits");
+}
+
+} // anonymous namespace
+
+int main() {
+  int tests_failed = 0;
+
+  std::cout << "== Testing tiered fetcher ==" << std::endl << std::endl;
+
+#define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
+  RUN_TEST(test_upper_tier);
+  RUN_TEST(test_fall_through);
+  RUN_TEST(test_not_modified);
+  RUN_TEST(test_last_tier_error);
+  RUN_TEST(test_memory_write_back);
+  RUN_TEST(test_directory_write_back);
+  RUN_TEST(test_fetch_many);
+
+  std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
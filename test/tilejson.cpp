@@ -4,6 +4,7 @@
 #include "http_server/server.hpp"
 #include "fetcher.hpp"
 #include "fetch/overzoom.hpp"
+#include "vector_tile.pb.h"
 
 #include <boost/xpressive/xpressive.hpp>
 
@@ -49,6 +50,76 @@ void test_tilejson_parse() {
   test::assert_equal<bool>(o != nullptr, true, "is overzoom");
 }
 
+// tiles in a local directory should be readable through the fetcher
+// made from the TileJSON.
+void test_tilejson_local_tiles() {
+  using namespace avecado;
+
+  test::temp_dir tmp;
+  {
+    tile t(0, 0, 0);
+    t.mapnik_tile().add_layers()->set_name("local");
+    t.mapnik_tile().mutable_layers(0)->set_version(1);
+    boost::filesystem::create_directories(tmp.path() / "0" / "0");
+    std::ofstream out((tmp.path() / "0" / "0" / "0.pbf").native());
+    out << t.get_data();
+  }
+
+  bpt::ptree uri, tiles, conf;
+  uri.put_value((boost::format("file://%1%/{z}/{x}/{y}.pbf") % tmp.path().native()).str());
+  tiles.push_back(std::make_pair("", uri));
+  conf.put("maxzoom", 0);
+  conf.add_child("tiles", tiles);
+
+  std::unique_ptr<fetcher> f = make_tilejson_fetcher(conf);
+  fetch_response response((*f)(request(0, 0, 0)).get());
+  test::assert_equal<bool>(response.is_left(), true, "should find local tile");
+  test::assert_equal<std::string>(response.left()->mapnik_tile().layers(0).name(), "local", "layer name");
+}
+
+// a "localTiles" which is just a directory, without any variables,
+// should have tiles laid out under it, rather than every tile going
+// to the same file.
+void test_tilejson_local_tiles_directory() {
+  using namespace avecado;
+
+  test::temp_dir source, local;
+  for (int x = 0; x < 2; ++x) {
+    tile t(1, x, 0);
+    t.mapnik_tile().add_layers()->set_name((boost::format("tile%1%") % x).str());
+    t.mapnik_tile().mutable_layers(0)->set_version(1);
+    boost::filesystem::create_directories(source.path() / "1" / std::to_string(x));
+    std::ofstream out((source.path() / "1" / std::to_string(x) / "0.pbf").native());
+    out << t.get_data();
+  }
+
+  bpt::ptree uri, tiles, conf;
+  uri.put_value((boost::format("file://%1%/{z}/{x}/{y}.pbf") % source.path().native()).str());
+  tiles.push_back(std::make_pair("", uri));
+  conf.put("maxzoom", 1);
+  conf.add_child("tiles", tiles);
+  conf.put("localTiles", (local.path() / "tiles").native());
+
+  // twice, so that the second time round the tiles come from the
+  // local directory they were written back to.
+  for (int i = 0; i < 2; ++i) {
+    std::unique_ptr<fetcher> f = make_tilejson_fetcher(conf);
+    for (int x = 0; x < 2; ++x) {
+      fetch_response response((*f)(request(1, x, 0)).get());
+      test::assert_equal<bool>(response.is_left(), true, "should find tile");
+      test::assert_equal<std::string>(response.left()->mapnik_tile().layers(0).name(),
+                                      (boost::format("tile%1%") % x).str(), "layer name");
+    }
+
+    if (i == 0) {
+      boost::filesystem::remove_all(source.path() / "1");
+    }
+  }
+
+  test::assert_equal<bool>(boost::filesystem::exists(local.path() / "tiles" / "1" / "1" / "0.pbf"), true,
+                           "should have written tile under the directory");
+}
+
 // utility function to create TileJSON from Mapnik XML.
 std::string tile_json_for_xml(const std::string xml) {
   using test::make_map;
@@ -198,6 +269,8 @@ int main() {
   RUN_TEST(test_tilejson_fetch);
   RUN_TEST(test_tilejson_fetch_gz);
   RUN_TEST(test_tilejson_parse);
+  RUN_TEST(test_tilejson_local_tiles);
+  RUN_TEST(test_tilejson_local_tiles_directory);
   RUN_TEST(test_tilejson_generate_numeric);
   RUN_TEST(test_tilejson_generate_numeric_force);
   RUN_TEST(test_tilejson_generate_masklevel);
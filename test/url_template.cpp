@@ -0,0 +1,109 @@
+#include "common.hpp"
+#include "fetch/url_template.hpp"
+
+#include <iostream>
+
+using avecado::fetch::url_template;
+
+namespace {
+
+void test_plain() {
+  url_template t("http://example.com/{z}/{x}/{y}.pbf");
+  test::assert_equal<std::string>(t(3, 2, 1), "http://example.com/3/2/1.pbf");
+  test::assert_equal<std::string>(t(18, 123456, 65432), "http://example.com/18/123456/65432.pbf");
+}
+
+void test_no_variables() {
+  url_template t("http://example.com/tile.pbf");
+  test::assert_equal<std::string>(t(3, 2, 1), "http://example.com/tile.pbf");
+  test::assert_equal<bool>(t.has_variables(), false, "has_variables");
+  test::assert_equal<bool>(url_template("/srv/{unknown}").has_variables(), false, "has_variables");
+  test::assert_equal<bool>(url_template("/srv/{z}").has_variables(), true, "has_variables");
+}
+
+void test_repeated_variables() {
+  url_template t("{z}{z}/{x}-{y}?z={z}");
+  test::assert_equal<std::string>(t(4, 0, 10), "44/0-10?z=4");
+}
+
+void test_unknown_variables() {
+  url_template t("http://example.com/{v}/{z}/{x}/{y}.pbf?{key}");
+  test::assert_equal<std::string>(t(1, 0, 1), "http://example.com/{v}/1/0/1.pbf?{key}");
+}
+
+void test_unterminated_brace() {
+  url_template t("http://example.com/{z}/{x/{y}");
+  test::assert_equal<std::string>(t(1, 0, 1), "http://example.com/1/{x/1");
+}
+
+void test_flipped_y() {
+  url_template t("/{z}/{x}/{-y}.pbf");
+  test::assert_equal<std::string>(t(0, 0, 0), "/0/0/0.pbf");
+  test::assert_equal<std::string>(t(2, 1, 0), "/2/1/3.pbf");
+  test::assert_equal<std::string>(t(2, 1, 3), "/2/1/0.pbf");
+
+  // above z31 the flipped row doesn't fit in 32 bits.
+  test::assert_equal<std::string>(t(32, 0, 0), "/32/0/4294967295.pbf");
+  test::assert_equal<std::string>(t(40, 0, 5), "/40/0/1099511627770.pbf");
+  test::assert_equal<std::string>(t(63, 0, 0), "/63/0/9223372036854775807.pbf");
+
+  // rows outside the zoom level are left as they are.
+  test::assert_equal<std::string>(t(2, 1, 4), "/2/1/4.pbf");
+  test::assert_equal<std::string>(t(64, 0, 7), "/64/0/7.pbf");
+}
+
+void test_subdomain() {
+  url_template t("http://{s}.example.com/{z}/{x}/{y}.pbf");
+  test::assert_equal<std::string>(t(2, 0, 0), "http://a.example.com/2/0/0.pbf");
+  test::assert_equal<std::string>(t(2, 1, 0), "http://b.example.com/2/1/0.pbf");
+  test::assert_equal<std::string>(t(2, 1, 1), "http://c.example.com/2/1/1.pbf");
+  test::assert_equal<std::string>(t(2, 3, 0), "http://a.example.com/2/3/0.pbf");
+}
+
+void test_quadkey() {
+  url_template t("/tiles/{q}.pbf");
+  test::assert_equal<std::string>(t(0, 0, 0), "/tiles/.pbf");
+  test::assert_equal<std::string>(t(1, 1, 0), "/tiles/1.pbf");
+  test::assert_equal<std::string>(t(3, 3, 5), "/tiles/213.pbf");
+
+  url_template t2("/tiles/{quadkey}.pbf");
+  test::assert_equal<std::string>(t2(3, 3, 5), "/tiles/213.pbf");
+
+  // digits for zoom levels above 32 bits are zero.
+  test::assert_equal<std::string>(t(32, 2147483648u, 0), "/tiles/1" + std::string(31, '0') + ".pbf");
+  test::assert_equal<std::string>(t(33, 1, 1), "/tiles/" + std::string(32, '0') + "3.pbf");
+  test::assert_equal<std::string>(t(40, 4294967295u, 0), "/tiles/" + std::string(8, '0') + std::string(32, '1') + ".pbf");
+}
+
+void test_buffer_reuse() {
+  url_template t("http://example.com/{z}/{x}/{y}.pbf");
+  std::string buf("something which was here before");
+  t.build(3, 2, 1, buf);
+  test::assert_equal<std::string>(buf, "http://example.com/3/2/1.pbf");
+  t.build(4, 5, 6, buf);
+  test::assert_equal<std::string>(buf, "http://example.com/4/5/6.pbf");
+}
+
+} // anonymous namespace
+
+int main() {
+  int tests_failed = 0;
+
+  std::cout << "== Testing URL templates ==" << std::endl << std::endl;
+
+#define RUN_TEST(x) { tests_failed += test::run(#x, &(x)); }
+
+  RUN_TEST(test_plain);
+  RUN_TEST(test_no_variables);
+  RUN_TEST(test_repeated_variables);
+  RUN_TEST(test_unknown_variables);
+  RUN_TEST(test_unterminated_brace);
+  RUN_TEST(test_flipped_y);
+  RUN_TEST(test_subdomain);
+  RUN_TEST(test_quadkey);
+  RUN_TEST(test_buffer_reuse);
+
+  std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
+
+  return (tests_failed > 0) ? 1 : 0;
+}
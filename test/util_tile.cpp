@@ -81,6 +81,74 @@ void test_cover_shape() {
   test::assert_equal<bool>(avecado::util::is_interesting(l), true);
 }
 
+// adds a point feature to the layer.
+void add_point(tile_layer *l, uint64_t id, int32_t x, int32_t y) {
+  vector_tile::Tile_Feature *feat = l->add_features();
+  feat->set_id(id);
+  feat->set_type(vector_tile::Tile::POINT);
+  feat->add_geometry(9);
+  feat->add_geometry((x << 1) ^ (x >> 31));
+  feat->add_geometry((y << 1) ^ (y >> 31));
+}
+
+// a tile with a point in each of its quadrants, away from the edges
+// of any of its descendants.
+void make_quadrants(vector_tile::Tile &t) {
+  tile_layer *l = t.add_layers();
+  l->set_name("points");
+  l->set_extent(4096);
+  l->set_version(1);
+  add_point(l, 1, 1000, 1000);
+  add_point(l, 2, 3000, 1000);
+  add_point(l, 3, 1000, 3000);
+  add_point(l, 4, 3000, 3000);
+}
+
+void test_cut_quadrant() {
+  vector_tile::Tile t, out;
+  make_quadrants(t);
+
+  avecado::util::cut_tile(t, 1, 1, 0, 0.0, out);
+  test::assert_equal<int>(out.layers_size(), 1, "should keep the layer");
+  test::assert_equal<int>(out.layers(0).features_size(), 1, "should keep one feature");
+  test::assert_equal<uint64_t>(out.layers(0).features(0).id(), 2, "should keep the feature in the quadrant");
+  test::assert_equal<uint32_t>(out.layers(0).extent(), 4096, "should keep the extent");
+
+  // a big enough buffer reaches the points in the neighbouring
+  // quadrants.
+  avecado::util::cut_tile(t, 1, 1, 0, 0.6, out);
+  test::assert_equal<int>(out.layers(0).features_size(), 4, "should keep features in the buffer");
+
+  // nothing in this corner, so the layer is dropped.
+  avecado::util::cut_tile(t, 3, 0, 0, 0.0, out);
+  test::assert_equal<int>(out.layers_size(), 0, "should drop the empty layer");
+}
+
+void test_cut_cache() {
+  std::shared_ptr<vector_tile::Tile> t = std::make_shared<vector_tile::Tile>();
+  make_quadrants(*t);
+  avecado::util::cut_cache cache(64);
+
+  // all the z4 tiles of a z0 tile.
+  std::size_t features = 0;
+  for (unsigned int x = 0; x < 16; ++x) {
+    for (unsigned int y = 0; y < 16; ++y) {
+      avecado::util::cut_cache::tile_data cut = cache.cut(t, 0, 0, 0, 4, x, y, 0.0);
+      for (const tile_layer &l : cut->layers()) {
+        features += l.features_size();
+      }
+    }
+  }
+
+  test::assert_equal<std::size_t>(features, 4, "each point should be in exactly one tile");
+  // 256 cuts of z4 tiles, each from one of 16 cuts of the z2 tiles.
+  test::assert_equal<std::size_t>(cache.misses(), 256 + 16, "should have made each cut once");
+  test::assert_equal<std::size_t>(cache.hits(), 256 - 16, "should have re-used the z2 cuts");
+
+  cache.cut(t, 0, 0, 0, 4, 15, 15, 0.0);
+  test::assert_equal<std::size_t>(cache.hits(), 256 - 16 + 1, "should have re-used the z4 cut");
+}
+
 } // anonymous namespace
 
 int main() {
@@ -95,6 +163,8 @@ int main() {
   RUN_TEST(test_cover_full_degenerate);
   RUN_TEST(test_cover_many);
   RUN_TEST(test_cover_shape);
+  RUN_TEST(test_cut_quadrant);
+  RUN_TEST(test_cut_cache);
 
   std::cout << " >> Tests failed: " << tests_failed << std::endl << std::endl;
 